@@ -0,0 +1,231 @@
+/*
+ * ProFTPD - mod_statsd metric aggregation implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "aggregate.h"
+
+struct aggregate_slot {
+  uint32_t hash;
+  int used;
+  struct statsd_aggregate_entry entry;
+  char name[STATSD_AGGREGATE_MAX_NAME_SIZE];
+};
+
+struct statsd_aggregate {
+  pool *pool;
+  struct aggregate_slot *slots;
+  unsigned int count;
+  time_t flushed;
+};
+
+static const char *trace_channel = "statsd.aggregate";
+
+/* FNV-1a */
+static uint32_t get_name_hash(int type, float sampling, const char *name,
+    size_t namelen) {
+  register unsigned int i;
+  uint32_t h = 2166136261UL;
+
+  h ^= (uint32_t) type;
+  h *= 16777619UL;
+  h ^= (uint32_t) (sampling * 1000000.0);
+  h *= 16777619UL;
+
+  for (i = 0; i < namelen; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619UL;
+  }
+
+  return h;
+}
+
+struct statsd_aggregate *statsd_aggregate_create(pool *p) {
+  pool *sub_pool;
+  struct statsd_aggregate *agg;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Statsd Aggregate Pool");
+
+  agg = pcalloc(sub_pool, sizeof(struct statsd_aggregate));
+  agg->pool = sub_pool;
+  agg->slots = pcalloc(sub_pool,
+    sizeof(struct aggregate_slot) * STATSD_AGGREGATE_MAX_SERIES);
+  agg->flushed = time(NULL);
+
+  return agg;
+}
+
+int statsd_aggregate_destroy(struct statsd_aggregate *agg) {
+  if (agg == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  destroy_pool(agg->pool);
+  return 0;
+}
+
+int statsd_aggregate_add(struct statsd_aggregate *agg, int type,
+    float sampling, const char *name, int64_t val) {
+  register unsigned int i;
+  size_t namelen;
+  uint32_t h;
+  unsigned int idx;
+
+  if (agg == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (type != STATSD_AGGREGATE_TYPE_COUNTER) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sampling <= 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  namelen = strlen(name);
+  if (namelen >= STATSD_AGGREGATE_MAX_NAME_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  h = get_name_hash(type, sampling, name, namelen);
+  idx = h % STATSD_AGGREGATE_MAX_SERIES;
+
+  for (i = 0; i < STATSD_AGGREGATE_MAX_SERIES; i++) {
+    struct aggregate_slot *slot;
+    struct statsd_aggregate_entry *entry;
+
+    slot = &(agg->slots[idx]);
+    entry = &(slot->entry);
+
+    if (slot->used == FALSE) {
+      slot->used = TRUE;
+      slot->hash = h;
+      memcpy(slot->name, name, namelen + 1);
+
+      entry->name = slot->name;
+      entry->namelen = namelen;
+      entry->type = type;
+      entry->sampling = sampling;
+      entry->count = 1;
+      entry->sum = val;
+
+      agg->count++;
+      return 0;
+    }
+
+    if (slot->hash == h &&
+        entry->type == type &&
+        entry->sampling == sampling &&
+        entry->namelen == namelen &&
+        memcmp(slot->name, name, namelen) == 0) {
+      entry->count++;
+      entry->sum += val;
+      return 0;
+    }
+
+    idx = (idx + 1) % STATSD_AGGREGATE_MAX_SERIES;
+  }
+
+  errno = ENOSPC;
+  return -1;
+}
+
+int statsd_aggregate_should_flush(struct statsd_aggregate *agg) {
+  if (agg == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (agg->count == 0) {
+    return FALSE;
+  }
+
+  /* Keep the probe sequences short. */
+  if (agg->count >= (STATSD_AGGREGATE_MAX_SERIES / 4) * 3) {
+    return TRUE;
+  }
+
+  if (time(NULL) - agg->flushed >= STATSD_AGGREGATE_FLUSH_INTERVAL) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+int statsd_aggregate_flush(struct statsd_aggregate *agg,
+    int (*cb)(const struct statsd_aggregate_entry *, void *), void *user_data) {
+  register unsigned int i;
+  unsigned int nseries;
+
+  if (agg == NULL ||
+      cb == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  nseries = agg->count;
+
+  for (i = 0; agg->count > 0 && i < STATSD_AGGREGATE_MAX_SERIES; i++) {
+    struct aggregate_slot *slot;
+
+    slot = &(agg->slots[i]);
+    if (slot->used == FALSE) {
+      continue;
+    }
+
+    (void) (cb)(&(slot->entry), user_data);
+
+    slot->used = FALSE;
+    agg->count--;
+  }
+
+  agg->flushed = time(NULL);
+
+  if (nseries > 0) {
+    pr_trace_msg(trace_channel, 19, "flushed %u aggregated series", nseries);
+  }
+
+  return 0;
+}
+
+unsigned int statsd_aggregate_get_count(struct statsd_aggregate *agg) {
+  if (agg == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return agg->count;
+}
@@ -0,0 +1,84 @@
+/*
+ * ProFTPD - mod_statsd metric aggregation API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_AGGREGATE_H
+#define MOD_STATSD_AGGREGATE_H
+
+#include "mod_statsd.h"
+
+struct statsd_aggregate;
+
+/* The aggregate is a fixed-size, open addressing hash table of metrics,
+ * keyed by name, in which a session sums its counters between flushes.
+ *
+ * Timers are not aggregated: statsd servers compute a timer's sum, mean, and
+ * percentiles from the individual values, which no summary sent as timer
+ * values can reproduce.
+ */
+#define STATSD_AGGREGATE_MAX_SERIES		256
+#define STATSD_AGGREGATE_MAX_NAME_SIZE		128
+
+/* The aggregate should be flushed once this many seconds have passed since
+ * the last flush, or once it is three-quarters full.
+ */
+#define STATSD_AGGREGATE_FLUSH_INTERVAL		10
+
+#define STATSD_AGGREGATE_TYPE_COUNTER		1
+
+struct statsd_aggregate_entry {
+  const char *name;
+  size_t namelen;
+  int type;
+
+  /* The sampling rate of the series' values; 1.0 if not sampled. */
+  float sampling;
+
+  /* The number of values, and their sum. */
+  uint64_t count;
+  int64_t sum;
+};
+
+struct statsd_aggregate *statsd_aggregate_create(pool *p);
+int statsd_aggregate_destroy(struct statsd_aggregate *agg);
+
+/* Adds the value, sampled at the given rate (1.0 if not sampled), to the
+ * named series.  Returns -1, with errno set to ENOSPC, if there is no room for
+ * a new series, in which case the caller should flush the aggregate.
+ */
+int statsd_aggregate_add(struct statsd_aggregate *agg, int type,
+  float sampling, const char *name, int64_t val);
+
+/* Returns TRUE if the aggregate should be flushed, per the interval and size
+ * thresholds.
+ */
+int statsd_aggregate_should_flush(struct statsd_aggregate *agg);
+
+/* Calls the given callback for each series, then empties the aggregate. */
+int statsd_aggregate_flush(struct statsd_aggregate *agg,
+  int (*cb)(const struct statsd_aggregate_entry *, void *), void *user_data);
+
+/* Returns the number of series in the aggregate. */
+unsigned int statsd_aggregate_get_count(struct statsd_aggregate *agg);
+
+#endif /* MOD_STATSD_AGGREGATE_H */
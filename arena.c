@@ -0,0 +1,457 @@
+/*
+ * ProFTPD - mod_statsd shared metric arena implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#if defined(__linux__)
+/* For sched_getcpu(3). */
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	1
+# endif
+#endif /* Linux */
+
+#include "arena.h"
+
+#if defined(HAVE_SYS_MMAN_H)
+# include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H */
+
+#if defined(HAVE_SCHED_GETCPU)
+# include <sched.h>
+#endif /* HAVE_SCHED_GETCPU */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* We need the compiler's atomic builtins, and anonymous shared mappings. */
+#if defined(__ATOMIC_RELAXED) && defined(HAVE_SYS_MMAN_H) && \
+    defined(MAP_ANONYMOUS)
+# define STATSD_USE_ARENA	1
+#endif
+
+#define STATSD_ARENA_SLOT_EMPTY		0
+#define STATSD_ARENA_SLOT_BUSY		1
+#define STATSD_ARENA_SLOT_READY		2
+
+/* How many times to check on a slot being registered by another process,
+ * before moving on.
+ */
+#define STATSD_ARENA_BUSY_SPINS		1000
+
+/* These live in the shared memory segment. */
+struct arena_slot {
+  uint32_t state;
+  uint32_t type;
+  uint32_t hash;
+  uint32_t gauge_isset;
+  int64_t gauge_value;
+  char name[STATSD_ARENA_MAX_NAME_SIZE];
+};
+
+struct statsd_arena {
+  pool *pool;
+
+  void *shm;
+  size_t shmsz;
+
+  struct arena_slot *slots;
+
+  /* The counters, one row of STATSD_ARENA_MAX_SLOTS values per shard; each
+   * row is a multiple of the cache line size, so that sessions running on
+   * different CPUs do not contend for the same cache lines.
+   */
+  int64_t *values;
+  unsigned int nshards;
+};
+
+static const char *trace_channel = "statsd.arena";
+
+#if defined(STATSD_USE_ARENA)
+/* FNV-1a */
+static uint32_t get_name_hash(int type, const char *name, size_t namelen) {
+  register unsigned int i;
+  uint32_t h = 2166136261UL;
+
+  h ^= (uint32_t) type;
+  h *= 16777619UL;
+
+  for (i = 0; i < namelen; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619UL;
+  }
+
+  return h;
+}
+
+static int slot_has_name(struct arena_slot *slot, int type, uint32_t h,
+    const char *name, size_t namelen) {
+  if (slot->hash != h ||
+      slot->type != (uint32_t) type) {
+    return FALSE;
+  }
+
+  if (strncmp(slot->name, name, namelen) != 0 ||
+      slot->name[namelen] != '\0') {
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Finds the slot for the given metric, registering it if need be.  Slots
+ * are claimed using compare-and-swap, so that no locking is needed.
+ */
+static int get_slot(struct statsd_arena *arena, int type, const char *name,
+    size_t namelen) {
+  register unsigned int i;
+  uint32_t h;
+  unsigned int idx;
+
+  if (namelen >= STATSD_ARENA_MAX_NAME_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  h = get_name_hash(type, name, namelen);
+  idx = h % STATSD_ARENA_MAX_SLOTS;
+
+  for (i = 0; i < STATSD_ARENA_MAX_SLOTS; i++) {
+    struct arena_slot *slot;
+    uint32_t state;
+
+    slot = &(arena->slots[idx]);
+    state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+
+    if (state == STATSD_ARENA_SLOT_EMPTY) {
+      uint32_t expected = STATSD_ARENA_SLOT_EMPTY;
+
+      if (__atomic_compare_exchange_n(&(slot->state), &expected,
+          STATSD_ARENA_SLOT_BUSY, FALSE, __ATOMIC_ACQ_REL,
+          __ATOMIC_ACQUIRE)) {
+        slot->type = type;
+        slot->hash = h;
+        memcpy(slot->name, name, namelen);
+        slot->name[namelen] = '\0';
+
+        __atomic_store_n(&(slot->state), STATSD_ARENA_SLOT_READY,
+          __ATOMIC_RELEASE);
+
+        pr_trace_msg(trace_channel, 17, "registered metric '%.*s' in slot %u",
+          (int) namelen, name, idx);
+        return idx;
+      }
+
+      state = expected;
+    }
+
+    if (state == STATSD_ARENA_SLOT_BUSY) {
+      register unsigned int j;
+
+      /* Another process is registering this slot; wait for it, but not
+       * forever, lest that process have died in the middle.
+       */
+      for (j = 0; j < STATSD_ARENA_BUSY_SPINS; j++) {
+        state = __atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE);
+        if (state != STATSD_ARENA_SLOT_BUSY) {
+          break;
+        }
+      }
+    }
+
+    if (state == STATSD_ARENA_SLOT_READY &&
+        slot_has_name(slot, type, h, name, namelen) == TRUE) {
+      return idx;
+    }
+
+    idx = (idx + 1) % STATSD_ARENA_MAX_SLOTS;
+  }
+
+  pr_trace_msg(trace_channel, 5,
+    "no arena slots available for metric '%.*s'", (int) namelen, name);
+  errno = ENOSPC;
+  return -1;
+}
+
+static unsigned int get_shard(struct statsd_arena *arena) {
+  if (arena->nshards == 1) {
+    return 0;
+  }
+
+#if defined(HAVE_SCHED_GETCPU)
+  {
+    int cpu;
+
+    cpu = sched_getcpu();
+    if (cpu >= 0) {
+      return ((unsigned int) cpu) % arena->nshards;
+    }
+  }
+#endif /* HAVE_SCHED_GETCPU */
+
+  return ((unsigned int) getpid()) % arena->nshards;
+}
+
+static int64_t *get_value(struct statsd_arena *arena, unsigned int shard,
+    int idx) {
+  return &(arena->values[(shard * STATSD_ARENA_MAX_SLOTS) + idx]);
+}
+
+/* Sums, and resets, the shard counters of the given slot. */
+static int64_t fold_slot(struct statsd_arena *arena, int idx) {
+  register unsigned int i;
+  int64_t sum = 0;
+
+  for (i = 0; i < arena->nshards; i++) {
+    sum += __atomic_exchange_n(get_value(arena, i, idx), 0, __ATOMIC_RELAXED);
+  }
+
+  return sum;
+}
+
+static int write_line(struct statsd *statsd, const char *name, int64_t val,
+    const char *sign, const char *type) {
+  char line[STATSD_ARENA_MAX_NAME_SIZE + 64];
+  int len;
+
+  len = snprintf(line, sizeof(line), "%s:%s%lld|%s", name, sign,
+    (long long) val, type);
+  if (len < 0 ||
+      (size_t) len >= sizeof(line)) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  return statsd_statsd_write(statsd, line, len, 0);
+}
+#endif /* STATSD_USE_ARENA */
+
+struct statsd_arena *statsd_arena_create(pool *p, unsigned int nshards) {
+#if defined(STATSD_USE_ARENA)
+  pool *sub_pool;
+  struct statsd_arena *arena;
+  size_t slotsz, valuesz;
+  void *shm;
+  int xerrno;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (nshards == 0) {
+    long ncpus = -1;
+
+# if defined(_SC_NPROCESSORS_CONF)
+    ncpus = sysconf(_SC_NPROCESSORS_CONF);
+# endif /* _SC_NPROCESSORS_CONF */
+    nshards = ncpus > 0 ? (unsigned int) ncpus : 1;
+  }
+
+  if (nshards > STATSD_ARENA_MAX_SHARDS) {
+    nshards = STATSD_ARENA_MAX_SHARDS;
+  }
+
+  slotsz = sizeof(struct arena_slot) * STATSD_ARENA_MAX_SLOTS;
+
+  /* Keep the counters on their own cache lines. */
+  slotsz = (slotsz + 63) & ~((size_t) 63);
+  valuesz = sizeof(int64_t) * STATSD_ARENA_MAX_SLOTS * nshards;
+
+  shm = mmap(NULL, slotsz + valuesz, PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  xerrno = errno;
+
+  if (shm == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 1,
+      "error mapping %lu bytes of shared memory for arena: %s",
+      (unsigned long) (slotsz + valuesz), strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  /* Anonymous mappings are zero-filled, i.e. all slots are empty. */
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Statsd Arena Pool");
+
+  arena = pcalloc(sub_pool, sizeof(struct statsd_arena));
+  arena->pool = sub_pool;
+  arena->shm = shm;
+  arena->shmsz = slotsz + valuesz;
+  arena->slots = shm;
+  arena->values = (int64_t *) (((char *) shm) + slotsz);
+  arena->nshards = nshards;
+
+  pr_trace_msg(trace_channel, 9,
+    "created arena of %u slots, %u shards (%lu bytes)",
+    (unsigned int) STATSD_ARENA_MAX_SLOTS, nshards,
+    (unsigned long) arena->shmsz);
+  return arena;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* STATSD_USE_ARENA */
+}
+
+int statsd_arena_destroy(struct statsd_arena *arena) {
+  if (arena == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(STATSD_USE_ARENA)
+  (void) munmap(arena->shm, arena->shmsz);
+#endif /* STATSD_USE_ARENA */
+  destroy_pool(arena->pool);
+
+  return 0;
+}
+
+int statsd_arena_add(struct statsd_arena *arena, int type, const char *name,
+    size_t namelen, int64_t val) {
+#if defined(STATSD_USE_ARENA)
+  int idx;
+
+  if (arena == NULL ||
+      name == NULL ||
+      namelen == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (type != STATSD_ARENA_TYPE_COUNTER &&
+      type != STATSD_ARENA_TYPE_GAUGE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  idx = get_slot(arena, type, name, namelen);
+  if (idx < 0) {
+    return -1;
+  }
+
+  (void) __atomic_fetch_add(get_value(arena, get_shard(arena), idx), val,
+    __ATOMIC_RELAXED);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_ARENA */
+}
+
+int statsd_arena_set_gauge(struct statsd_arena *arena, const char *name,
+    size_t namelen, int64_t val) {
+#if defined(STATSD_USE_ARENA)
+  struct arena_slot *slot;
+  int idx;
+
+  if (arena == NULL ||
+      name == NULL ||
+      namelen == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  idx = get_slot(arena, STATSD_ARENA_TYPE_GAUGE, name, namelen);
+  if (idx < 0) {
+    return -1;
+  }
+
+  slot = &(arena->slots[idx]);
+
+  /* Any adjustments made before this new value are moot. */
+  (void) fold_slot(arena, idx);
+
+  __atomic_store_n(&(slot->gauge_value), val, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->gauge_isset), 1, __ATOMIC_RELEASE);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_ARENA */
+}
+
+int statsd_arena_fold(struct statsd_arena *arena, struct statsd *statsd) {
+#if defined(STATSD_USE_ARENA)
+  register unsigned int i;
+  unsigned int nmetrics = 0;
+
+  if (arena == NULL ||
+      statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < STATSD_ARENA_MAX_SLOTS; i++) {
+    struct arena_slot *slot;
+    int64_t sum;
+
+    slot = &(arena->slots[i]);
+    if (__atomic_load_n(&(slot->state), __ATOMIC_ACQUIRE) !=
+        STATSD_ARENA_SLOT_READY) {
+      continue;
+    }
+
+    if (slot->type == STATSD_ARENA_TYPE_GAUGE &&
+        __atomic_exchange_n(&(slot->gauge_isset), 0, __ATOMIC_ACQUIRE) != 0) {
+      if (write_line(statsd, slot->name,
+          __atomic_load_n(&(slot->gauge_value), __ATOMIC_RELAXED), "",
+          "g") == 0) {
+        nmetrics++;
+      }
+    }
+
+    sum = fold_slot(arena, i);
+    if (sum == 0) {
+      continue;
+    }
+
+    if (slot->type == STATSD_ARENA_TYPE_COUNTER) {
+      if (write_line(statsd, slot->name, sum, "", "c") == 0) {
+        nmetrics++;
+      }
+
+    } else {
+      /* Gauge adjustments MUST be signed. */
+      if (write_line(statsd, slot->name, sum, sum > 0 ? "+" : "", "g") == 0) {
+        nmetrics++;
+      }
+    }
+  }
+
+  pr_trace_msg(trace_channel, 19, "folded arena into %u metrics", nmetrics);
+  return statsd_statsd_flush(statsd);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_ARENA */
+}
+
+unsigned int statsd_arena_get_shard_count(struct statsd_arena *arena) {
+  if (arena == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return arena->nshards;
+}
@@ -0,0 +1,71 @@
+/*
+ * ProFTPD - mod_statsd shared metric arena API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_ARENA_H
+#define MOD_STATSD_ARENA_H
+
+#include "mod_statsd.h"
+#include "statsd.h"
+
+struct statsd_arena;
+
+/* The arena is a shared memory segment, created by the daemon process before
+ * forking sessions, with a fixed number of metric slots.  Each slot has one
+ * counter per shard; sessions add to the counter for the shard of the CPU
+ * on which they are running.
+ */
+#define STATSD_ARENA_MAX_SLOTS			512
+#define STATSD_ARENA_MAX_NAME_SIZE		128
+#define STATSD_ARENA_MAX_SHARDS			32
+
+/* How often, in seconds, the daemon folds the arena, and sends the
+ * aggregated metrics.
+ */
+#define STATSD_ARENA_FOLD_INTERVAL		10
+
+/* Creates an arena with the given number of shards; use zero to use one
+ * shard per CPU.
+ */
+struct statsd_arena *statsd_arena_create(pool *p, unsigned int nshards);
+int statsd_arena_destroy(struct statsd_arena *arena);
+
+/* Adds the given value to the named counter, or gauge. */
+int statsd_arena_add(struct statsd_arena *arena, int type, const char *name,
+  size_t namelen, int64_t val);
+#define STATSD_ARENA_TYPE_COUNTER	1
+#define STATSD_ARENA_TYPE_GAUGE		2
+
+/* Sets the value of the named gauge. */
+int statsd_arena_set_gauge(struct statsd_arena *arena, const char *name,
+  size_t namelen, int64_t val);
+
+/* Folds the shards of each slot together, writes the aggregated metrics to
+ * the given client, and resets the arena.
+ */
+int statsd_arena_fold(struct statsd_arena *arena, struct statsd *statsd);
+
+/* Returns the number of shards in the arena. */
+unsigned int statsd_arena_get_shard_count(struct statsd_arena *arena);
+
+#endif /* MOD_STATSD_ARENA_H */
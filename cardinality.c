@@ -0,0 +1,239 @@
+/*
+ * ProFTPD - mod_statsd shared name set implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "cardinality.h"
+
+#if defined(HAVE_SYS_MMAN_H)
+# include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* We need the compiler's atomic builtins, and anonymous shared mappings. */
+#if defined(__ATOMIC_RELAXED) && defined(HAVE_SYS_MMAN_H) && \
+    defined(MAP_ANONYMOUS)
+# define STATSD_USE_CARDINALITY	1
+#endif
+
+/* The set is a segment of 64-bit words: the number of names, padded out to
+ * a cache line, then an open-addressed table of name hashes, with zero
+ * marking an empty slot.  The table has at least twice as many slots as
+ * names, so that there is always an empty slot, and probes stay short.
+ */
+#define STATSD_CARDINALITY_HEADER_WORDS	8
+
+struct statsd_cardinality {
+  pool *pool;
+
+  void *shm;
+  size_t shmsz;
+  unsigned int max_names;
+  unsigned int nslots;
+};
+
+static const char *trace_channel = "statsd.cardinality";
+
+#if defined(STATSD_USE_CARDINALITY)
+/* FNV-1a; zero is reserved for empty slots. */
+static uint64_t get_hash(const char *name, size_t namelen) {
+  register size_t i;
+  uint64_t h = 14695981039346656037ULL;
+
+  for (i = 0; i < namelen; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h != 0 ? h : 1;
+}
+#endif /* STATSD_USE_CARDINALITY */
+
+struct statsd_cardinality *statsd_cardinality_create(pool *p,
+    unsigned int max_names) {
+#if defined(STATSD_USE_CARDINALITY)
+  pool *sub_pool;
+  struct statsd_cardinality *card;
+  unsigned int nslots;
+  size_t shmsz;
+  void *shm;
+  int xerrno;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (max_names == 0 ||
+      max_names > STATSD_CARDINALITY_MAX_NAMES) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  nslots = 16;
+  while (nslots < (max_names * 2)) {
+    nslots *= 2;
+  }
+
+  shmsz = sizeof(uint64_t) * (STATSD_CARDINALITY_HEADER_WORDS + nslots);
+
+  shm = mmap(NULL, shmsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1,
+    0);
+  xerrno = errno;
+
+  if (shm == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 1,
+      "error mapping %lu bytes of shared memory for names: %s",
+      (unsigned long) shmsz, strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  /* Anonymous mappings are zero-filled, i.e. the set is empty. */
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Statsd Cardinality Pool");
+
+  card = pcalloc(sub_pool, sizeof(struct statsd_cardinality));
+  card->pool = sub_pool;
+  card->shm = shm;
+  card->shmsz = shmsz;
+  card->max_names = max_names;
+  card->nslots = nslots;
+
+  pr_trace_msg(trace_channel, 9, "created set of %u names (%lu bytes)",
+    max_names, (unsigned long) shmsz);
+  return card;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* STATSD_USE_CARDINALITY */
+}
+
+int statsd_cardinality_destroy(struct statsd_cardinality *card) {
+  if (card == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(STATSD_USE_CARDINALITY)
+  (void) munmap(card->shm, card->shmsz);
+#endif /* STATSD_USE_CARDINALITY */
+  destroy_pool(card->pool);
+
+  return 0;
+}
+
+int statsd_cardinality_admit(struct statsd_cardinality *card,
+    const char *name, size_t namelen) {
+#if defined(STATSD_USE_CARDINALITY)
+  register unsigned int i;
+  uint64_t *count, *slots, h;
+  unsigned int mask;
+
+  if (card == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  count = card->shm;
+  slots = ((uint64_t *) card->shm) + STATSD_CARDINALITY_HEADER_WORDS;
+  mask = card->nslots - 1;
+  h = get_hash(name, namelen);
+
+  for (i = 0; i < card->nslots; i++) {
+    uint64_t *slot, val;
+
+    slot = &(slots[(h + i) & mask]);
+    val = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (val == h) {
+      return TRUE;
+    }
+
+    if (val != 0) {
+      continue;
+    }
+
+    /* Reserve room for the name, before claiming the empty slot. */
+    if (__atomic_fetch_add(count, 1, __ATOMIC_RELAXED) >= card->max_names) {
+      (void) __atomic_fetch_sub(count, 1, __ATOMIC_RELAXED);
+
+      pr_trace_msg(trace_channel, 17, "set full, not admitting name '%.*s'",
+        (int) namelen, name);
+      return FALSE;
+    }
+
+    if (__atomic_compare_exchange_n(slot, &val, h, FALSE, __ATOMIC_RELEASE,
+        __ATOMIC_ACQUIRE)) {
+      pr_trace_msg(trace_channel, 17, "admitted name '%.*s'", (int) namelen,
+        name);
+      return TRUE;
+    }
+
+    /* Another session claimed the slot first; perhaps for the same name. */
+    (void) __atomic_fetch_sub(count, 1, __ATOMIC_RELAXED);
+
+    if (val == h) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_CARDINALITY */
+}
+
+unsigned int statsd_cardinality_get_max(struct statsd_cardinality *card) {
+  if (card == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return card->max_names;
+}
+
+unsigned int statsd_cardinality_get_count(struct statsd_cardinality *card) {
+  uint64_t count = 0;
+
+  if (card == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+#if defined(STATSD_USE_CARDINALITY)
+  count = __atomic_load_n((uint64_t *) card->shm, __ATOMIC_RELAXED);
+
+  /* Sessions briefly over-reserve, when the set is full. */
+  if (count > card->max_names) {
+    count = card->max_names;
+  }
+#endif /* STATSD_USE_CARDINALITY */
+
+  return (unsigned int) count;
+}
@@ -0,0 +1,56 @@
+/*
+ * ProFTPD - mod_statsd shared name set API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_CARDINALITY_H
+#define MOD_STATSD_CARDINALITY_H
+
+#include "mod_statsd.h"
+
+struct statsd_cardinality;
+
+/* A bounded set of names, e.g. of the client-controlled parts of metric
+ * names, living in a shared memory segment.  The set is created by the
+ * daemon process before forking sessions; sessions add names using atomic
+ * operations, until the set is full.  Names are kept as 64-bit hashes, and
+ * are never removed, so that a name, once admitted, stays admitted.
+ */
+#define STATSD_CARDINALITY_MAX_NAMES		65536
+
+/* Creates a set of up to the given number of names. */
+struct statsd_cardinality *statsd_cardinality_create(pool *p,
+  unsigned int max_names);
+int statsd_cardinality_destroy(struct statsd_cardinality *card);
+
+/* Returns TRUE if the given name is in the set, adding it if need be, or
+ * FALSE if the name is not in the set, and the set is full.  Returns -1 on
+ * error.
+ */
+int statsd_cardinality_admit(struct statsd_cardinality *card,
+  const char *name, size_t namelen);
+
+/* Returns the max number of names, and the number of names, in the set. */
+unsigned int statsd_cardinality_get_max(struct statsd_cardinality *card);
+unsigned int statsd_cardinality_get_count(struct statsd_cardinality *card);
+
+#endif /* MOD_STATSD_CARDINALITY_H */
@@ -0,0 +1,330 @@
+/*
+ * ProFTPD - mod_statsd shared histogram implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "histogram.h"
+#include "metric.h"
+
+#if defined(HAVE_SYS_MMAN_H)
+# include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/* We need the compiler's atomic builtins, and anonymous shared mappings. */
+#if defined(__ATOMIC_RELAXED) && defined(HAVE_SYS_MMAN_H) && \
+    defined(MAP_ANONYMOUS)
+# define STATSD_USE_HISTOGRAM	1
+#endif
+
+#define STATSD_HISTOGRAM_SUB_BUCKETS	(1U << STATSD_HISTOGRAM_SUB_BUCKET_BITS)
+
+/* Timings below this value each have their own bucket. */
+#define STATSD_HISTOGRAM_LINEAR_MAX	(STATSD_HISTOGRAM_SUB_BUCKETS * 2)
+
+/* Each histogram is a row of 64-bit words in the shared memory segment: the
+ * max timing, padded out to a cache line, then the bucket counts.
+ */
+#define STATSD_HISTOGRAM_HEADER_WORDS	8
+#define STATSD_HISTOGRAM_ROW_WORDS	\
+  (STATSD_HISTOGRAM_HEADER_WORDS + STATSD_HISTOGRAM_MAX_BUCKETS)
+
+struct statsd_histogram {
+  pool *pool;
+
+  void *shm;
+  size_t shmsz;
+  unsigned int count;
+
+  /* The daemon's copy of the bucket counts being folded. */
+  uint64_t *snapshot;
+};
+
+static const char *trace_channel = "statsd.histogram";
+
+static unsigned int get_msb(uint64_t val) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(val);
+#else
+  unsigned int msb = 0;
+
+  while (val >>= 1) {
+    msb++;
+  }
+
+  return msb;
+#endif /* __GNUC__ */
+}
+
+unsigned int statsd_histogram_get_bucket(uint64_t val) {
+  unsigned int shift;
+
+  if (val < STATSD_HISTOGRAM_LINEAR_MAX) {
+    return (unsigned int) val;
+  }
+
+  if (val > STATSD_HISTOGRAM_MAX_VALUE) {
+    val = STATSD_HISTOGRAM_MAX_VALUE;
+  }
+
+  /* Keep the top bits of the timing, below its most significant bit. */
+  shift = get_msb(val) - STATSD_HISTOGRAM_SUB_BUCKET_BITS;
+
+  return STATSD_HISTOGRAM_LINEAR_MAX +
+    ((shift - 1) * STATSD_HISTOGRAM_SUB_BUCKETS) +
+    (unsigned int) ((val >> shift) - STATSD_HISTOGRAM_SUB_BUCKETS);
+}
+
+uint64_t statsd_histogram_get_bucket_value(unsigned int bucket) {
+  unsigned int shift;
+  uint64_t lo;
+
+  if (bucket < STATSD_HISTOGRAM_LINEAR_MAX) {
+    return bucket;
+  }
+
+  if (bucket >= STATSD_HISTOGRAM_MAX_BUCKETS) {
+    bucket = STATSD_HISTOGRAM_MAX_BUCKETS - 1;
+  }
+
+  bucket -= STATSD_HISTOGRAM_LINEAR_MAX;
+  shift = (bucket / STATSD_HISTOGRAM_SUB_BUCKETS) + 1;
+  lo = ((uint64_t) (bucket % STATSD_HISTOGRAM_SUB_BUCKETS) +
+    STATSD_HISTOGRAM_SUB_BUCKETS) << shift;
+
+  return lo + ((((uint64_t) 1) << shift) - 1) / 2;
+}
+
+#if defined(STATSD_USE_HISTOGRAM)
+static uint64_t *get_row(struct statsd_histogram *hist, unsigned int idx) {
+  return ((uint64_t *) hist->shm) + (idx * STATSD_HISTOGRAM_ROW_WORDS);
+}
+
+/* Returns the bucket holding the timing at the given quantile. */
+static unsigned int get_quantile_bucket(const uint64_t *counts, uint64_t total,
+    double q) {
+  register unsigned int i;
+  uint64_t rank, n = 0;
+
+  rank = (uint64_t) (q * (total - 1));
+
+  for (i = 0; i < STATSD_HISTOGRAM_MAX_BUCKETS; i++) {
+    n += counts[i];
+    if (rank < n) {
+      break;
+    }
+  }
+
+  return i;
+}
+#endif /* STATSD_USE_HISTOGRAM */
+
+struct statsd_histogram *statsd_histogram_create(pool *p, unsigned int count) {
+#if defined(STATSD_USE_HISTOGRAM)
+  pool *sub_pool;
+  struct statsd_histogram *hist;
+  size_t shmsz;
+  void *shm;
+  int xerrno;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (count == 0 ||
+      count > STATSD_HISTOGRAM_MAX_COUNT) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  shmsz = sizeof(uint64_t) * STATSD_HISTOGRAM_ROW_WORDS * count;
+
+  shm = mmap(NULL, shmsz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1,
+    0);
+  xerrno = errno;
+
+  if (shm == MAP_FAILED) {
+    pr_trace_msg(trace_channel, 1,
+      "error mapping %lu bytes of shared memory for histograms: %s",
+      (unsigned long) shmsz, strerror(xerrno));
+    errno = xerrno;
+    return NULL;
+  }
+
+  /* Anonymous mappings are zero-filled, i.e. all histograms are empty. */
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Statsd Histogram Pool");
+
+  hist = pcalloc(sub_pool, sizeof(struct statsd_histogram));
+  hist->pool = sub_pool;
+  hist->shm = shm;
+  hist->shmsz = shmsz;
+  hist->count = count;
+  hist->snapshot = palloc(sub_pool,
+    sizeof(uint64_t) * STATSD_HISTOGRAM_MAX_BUCKETS);
+
+  pr_trace_msg(trace_channel, 9, "created %u histograms (%lu bytes)", count,
+    (unsigned long) shmsz);
+  return hist;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif /* STATSD_USE_HISTOGRAM */
+}
+
+int statsd_histogram_destroy(struct statsd_histogram *hist) {
+  if (hist == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(STATSD_USE_HISTOGRAM)
+  (void) munmap(hist->shm, hist->shmsz);
+#endif /* STATSD_USE_HISTOGRAM */
+  destroy_pool(hist->pool);
+
+  return 0;
+}
+
+int statsd_histogram_add(struct statsd_histogram *hist, unsigned int idx,
+    uint64_t val) {
+#if defined(STATSD_USE_HISTOGRAM)
+  uint64_t *row, max;
+
+  if (hist == NULL ||
+      idx >= hist->count) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  row = get_row(hist, idx);
+
+  (void) __atomic_fetch_add(
+    &(row[STATSD_HISTOGRAM_HEADER_WORDS + statsd_histogram_get_bucket(val)]), 1,
+    __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&(row[0]), __ATOMIC_RELAXED);
+  while (val > max) {
+    if (__atomic_compare_exchange_n(&(row[0]), &max, val, TRUE,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_HISTOGRAM */
+}
+
+int statsd_histogram_fold(struct statsd_histogram *hist, unsigned int idx,
+    struct statsd *statsd, const char *name) {
+#if defined(STATSD_USE_HISTOGRAM)
+  register unsigned int i;
+  uint64_t *row, *counts, max, total = 0;
+  unsigned int hi_bucket = 0;
+  char metric[256];
+  static const struct {
+    double q;
+    const char *label;
+  } quantiles[] = {
+    { 0.5,	"p50" },
+    { 0.9,	"p90" },
+    { 0.99,	"p99" },
+    { 0.0,	NULL }
+  };
+
+  if (hist == NULL ||
+      idx >= hist->count ||
+      statsd == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  row = get_row(hist, idx);
+  counts = hist->snapshot;
+
+  for (i = 0; i < STATSD_HISTOGRAM_MAX_BUCKETS; i++) {
+    counts[i] = __atomic_exchange_n(&(row[STATSD_HISTOGRAM_HEADER_WORDS + i]),
+      0, __ATOMIC_RELAXED);
+    if (counts[i] > 0) {
+      total += counts[i];
+      hi_bucket = i;
+    }
+  }
+
+  max = __atomic_exchange_n(&(row[0]), 0, __ATOMIC_RELAXED);
+
+  if (total == 0) {
+    return 0;
+  }
+
+  /* A session may have added its timing to the buckets after we read them,
+   * but before we reset the max, or vice versa; keep the two consistent.
+   */
+  if (statsd_histogram_get_bucket(max) != hi_bucket) {
+    max = statsd_histogram_get_bucket_value(hi_bucket);
+  }
+
+  for (i = 0; quantiles[i].label != NULL; i++) {
+    uint64_t val;
+
+    val = statsd_histogram_get_bucket_value(get_quantile_bucket(counts, total,
+      quantiles[i].q));
+    if (val > max) {
+      val = max;
+    }
+
+    pr_snprintf(metric, sizeof(metric), "%s.%s", name, quantiles[i].label);
+    (void) statsd_metric_gauge(statsd, metric, (int64_t) val, 0);
+  }
+
+  pr_snprintf(metric, sizeof(metric), "%s.max", name);
+  (void) statsd_metric_gauge(statsd, metric, (int64_t) max, 0);
+
+  pr_snprintf(metric, sizeof(metric), "%s.count", name);
+  (void) statsd_metric_gauge(statsd, metric, (int64_t) total, 0);
+
+  pr_trace_msg(trace_channel, 19, "folded histogram '%s' of %lu timings",
+    name, (unsigned long) total);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* STATSD_USE_HISTOGRAM */
+}
+
+unsigned int statsd_histogram_get_count(struct statsd_histogram *hist) {
+  if (hist == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return hist->count;
+}
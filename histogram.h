@@ -0,0 +1,75 @@
+/*
+ * ProFTPD - mod_statsd shared histogram API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_HISTOGRAM_H
+#define MOD_STATSD_HISTOGRAM_H
+
+#include "mod_statsd.h"
+#include "statsd.h"
+
+struct statsd_histogram;
+
+/* The histograms live in a shared memory segment, created by the daemon
+ * process before forking sessions; sessions add their timings using atomic
+ * increments, and the daemon periodically folds the histograms, sending
+ * their percentiles.
+ *
+ * Each histogram is log-linear, HDR-style: timings below 128 ms each have
+ * their own bucket, and each power of two above that is divided into 64
+ * buckets, for a relative error of less than 1%.  Timings up to 2^37 ms
+ * (well beyond the longest timer, of one year) thus need 2048 buckets.
+ */
+#define STATSD_HISTOGRAM_SUB_BUCKET_BITS	6
+#define STATSD_HISTOGRAM_MAX_BUCKETS		2048
+#define STATSD_HISTOGRAM_MAX_VALUE		((((uint64_t) 1) << 37) - 1)
+
+/* The max number of histograms in a segment. */
+#define STATSD_HISTOGRAM_MAX_COUNT		32
+
+/* Creates a segment of the given number of histograms. */
+struct statsd_histogram *statsd_histogram_create(pool *p, unsigned int count);
+int statsd_histogram_destroy(struct statsd_histogram *hist);
+
+/* Adds the timing to the given histogram of the segment. */
+int statsd_histogram_add(struct statsd_histogram *hist, unsigned int idx,
+  uint64_t val);
+
+/* Writes the percentiles of the given histogram to the given client, as
+ * gauges named "name.p50", "name.p90", "name.p99", "name.max", and
+ * "name.count", and resets the histogram.  Nothing is written for an empty
+ * histogram.
+ */
+int statsd_histogram_fold(struct statsd_histogram *hist, unsigned int idx,
+  struct statsd *statsd, const char *name);
+
+/* Returns the number of histograms in the segment. */
+unsigned int statsd_histogram_get_count(struct statsd_histogram *hist);
+
+/* Returns the bucket for the given timing, and the timing reported for the
+ * given bucket, i.e. the midpoint of the bucket.
+ */
+unsigned int statsd_histogram_get_bucket(uint64_t val);
+uint64_t statsd_histogram_get_bucket_value(unsigned int bucket);
+
+#endif /* MOD_STATSD_HISTOGRAM_H */
@@ -1,6 +1,6 @@
 /*
  * ProFTPD: mod_statsd Metric API
- * Copyright (c) 2017-2022 TJ Saunders
+ * Copyright (c) 2017-2026 TJ Saunders
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -23,74 +23,598 @@
  */
 
 #include "metric.h"
+#include "arena.h"
+#include "aggregate.h"
+#include "sketch.h"
 
 /* Don't allow timings longer than 1 year. */
 #define STATSD_MAX_TIME_MS	31536000000UL
 
+struct statsd_metric {
+  struct statsd *statsd;
+  int type;
+  int flags;
+  struct statsd_metric_name name;
+
+  /* The encoded "prefix" "name" "suffix" ":". */
+  char *head;
+  size_t headlen;
+
+  /* The encoded "|" "type"; any "|@rate" text is appended when writing. */
+  char tail[4];
+  size_t taillen;
+};
+
+/* For metrics which are not sampled. */
+static const struct statsd_sampling no_sampling = {
+  1.0, ((uint64_t) 1) << 32, "", 0
+};
+
 static const char *trace_channel = "statsd.metric";
 
-/* Watch out for any characters which might interfere with the statsd format. */
-static char *sanitize_name(pool *p, const char *name) {
-  char *cleaned_name, *ptr;
+/* Copies the metric name into the given buffer, watching out for any
+ * characters which might interfere with the statsd format.
+ */
+static void sanitize_name(char *buf, const char *name, size_t namelen) {
+  register unsigned int i;
   int adjusted_name = FALSE;
 
-  cleaned_name = pstrdup(p, name);
-  for (ptr = cleaned_name; *ptr; ptr++) {
-    if (*ptr == ':' ||
-        *ptr == '|' ||
-        *ptr == '@') {
-      *ptr = '_';
+  for (i = 0; i < namelen; i++) {
+    char c;
+
+    c = name[i];
+    if (c == ':' ||
+        c == '|' ||
+        c == '@') {
+      c = '_';
       adjusted_name = TRUE;
     }
+
+    buf[i] = c;
   }
 
   if (adjusted_name == TRUE) {
-    pr_trace_msg(trace_channel, 12, "sanitized metric name '%s' into '%s'",
-      name, cleaned_name);
+    pr_trace_msg(trace_channel, 12, "sanitized metric name '%s' into '%.*s'",
+      name, (int) namelen, buf);
+  }
+}
+
+static size_t get_digit_count(uint64_t val) {
+  size_t ndigits = 1;
+
+  while (val >= 10) {
+    val /= 10;
+    ndigits++;
+  }
+
+  return ndigits;
+}
+
+/* Writes the decimal digits of the given value, which MUST have the given
+ * number of digits, into the buffer.
+ */
+static void write_digits(char *buf, uint64_t val, size_t ndigits) {
+  char *ptr;
+
+  ptr = buf + ndigits;
+  do {
+    *(--ptr) = '0' + (val % 10);
+    val /= 10;
+  } while (val > 0);
+}
+
+static void init_name(struct statsd_metric_name *mn, const char *name) {
+  mn->name = name;
+  mn->namelen = strlen(name);
+  mn->fqname = NULL;
+  mn->fqnamelen = 0;
+}
+
+/* Returns the absolute value, and the sign to write for the value, if any. */
+static uint64_t get_abs_value(int64_t val, int explicit_sign, char *sign) {
+  if (val < 0) {
+    *sign = '-';
+
+    /* Careful to avoid overflow when negating the most negative value. */
+    return ((uint64_t) -(val + 1)) + 1;
   }
 
-  return cleaned_name;
+  *sign = explicit_sign == TRUE ? '+' : '\0';
+  return (uint64_t) val;
 }
 
+/* Encodes the metric, i.e. "prefix" "name" "suffix" ":" [sign] "value" "|"
+ * "type" ["|@rate"], directly into the statsd client's pending buffer.  A
+ * name already namespaced for the client is copied as is.
+ */
 static int write_metric(struct statsd *statsd, const char *metric_type,
-    const char *name, const char *val_prefix, int64_t val, float sampling) {
-  int res, xerrno;
-  pool *p, *tmp_pool;
+    size_t metric_typelen, const struct statsd_metric_name *mn, int64_t val,
+    int explicit_sign, const char *sampling_suffix, size_t sampling_suffixlen) {
   const char *prefix = NULL, *suffix = NULL;
-  char *metric;
-  size_t metric_len;
+  size_t namelen, prefixlen = 0, suffixlen = 0;
+  size_t metric_len, ndigits;
+  uint64_t uval;
+  char sign = '\0', *metric, *ptr;
 
-  statsd_statsd_get_namespacing(statsd, &prefix, &suffix);
-  p = statsd_statsd_get_pool(statsd);
-  tmp_pool = make_sub_pool(p);
+  if (mn->fqname == NULL) {
+    statsd_statsd_get_namespacing(statsd, &prefix, &suffix);
+    statsd_statsd_get_namespacing_len(statsd, &prefixlen, &suffixlen);
+    namelen = mn->namelen;
+
+  } else {
+    namelen = mn->fqnamelen;
+  }
+
+  uval = get_abs_value(val, explicit_sign, &sign);
+  ndigits = get_digit_count(uval);
+
+  metric_len = prefixlen + namelen + suffixlen + 1 + (sign ? 1 : 0) + ndigits +
+    1 + metric_typelen + sampling_suffixlen;
+
+  metric = statsd_statsd_reserve(statsd, metric_len);
+  if (metric == NULL) {
+    return -1;
+  }
+
+  ptr = metric;
+
+  if (prefixlen > 0) {
+    memcpy(ptr, prefix, prefixlen);
+    ptr += prefixlen;
+  }
+
+  if (mn->fqname == NULL) {
+    sanitize_name(ptr, mn->name, namelen);
+
+  } else {
+    memcpy(ptr, mn->fqname, namelen);
+  }
+  ptr += namelen;
+
+  if (suffixlen > 0) {
+    memcpy(ptr, suffix, suffixlen);
+    ptr += suffixlen;
+  }
+
+  *ptr++ = ':';
+
+  if (sign) {
+    *ptr++ = sign;
+  }
+
+  write_digits(ptr, uval, ndigits);
+  ptr += ndigits;
+
+  *ptr++ = '|';
+  memcpy(ptr, metric_type, metric_typelen);
+  ptr += metric_typelen;
+
+  if (sampling_suffixlen > 0) {
+    memcpy(ptr, sampling_suffix, sampling_suffixlen);
+  }
+
+  return statsd_statsd_commit(statsd, metric_len, 0);
+}
+
+static void encode_tail(struct statsd_metric *metric) {
+  const char *metric_type;
+  size_t metric_typelen;
+
+  switch (metric->type) {
+    case STATSD_METRIC_TYPE_COUNTER:
+      metric_type = "c";
+      break;
+
+    case STATSD_METRIC_TYPE_TIMER:
+      metric_type = "ms";
+      break;
+
+    default:
+      metric_type = "g";
+      break;
+  }
 
-  metric_len = STATSD_MAX_METRIC_SIZE;
-  metric = pcalloc(tmp_pool, metric_len);
+  metric_typelen = strlen(metric_type);
+
+  metric->tail[0] = '|';
+  memcpy(metric->tail + 1, metric_type, metric_typelen);
+  metric->taillen = metric_typelen + 1;
+}
+
+/* Writes the value of a registered metric, splicing its digits between the
+ * preencoded head and tail, followed by the prepared "|@rate" text, if any.
+ */
+static int write_encoded(struct statsd_metric *metric, int64_t val,
+    int explicit_sign, const struct statsd_sampling *sampling) {
+  size_t metric_len, ndigits;
+  uint64_t uval;
+  char sign = '\0', *ptr;
+
+  uval = get_abs_value(val, explicit_sign, &sign);
+  ndigits = get_digit_count(uval);
+
+  metric_len = metric->headlen + (sign ? 1 : 0) + ndigits + metric->taillen +
+    sampling->suffixlen;
+
+  ptr = statsd_statsd_reserve(metric->statsd, metric_len);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  memcpy(ptr, metric->head, metric->headlen);
+  ptr += metric->headlen;
+
+  if (sign) {
+    *ptr++ = sign;
+  }
+
+  write_digits(ptr, uval, ndigits);
+  ptr += ndigits;
+
+  memcpy(ptr, metric->tail, metric->taillen);
+  ptr += metric->taillen;
+
+  if (sampling->suffixlen > 0) {
+    memcpy(ptr, sampling->suffix, sampling->suffixlen);
+  }
+
+  return statsd_statsd_commit(metric->statsd, metric_len, 0);
+}
+
+/* Returns the "|@rate" text for the given sampling rate, if any.  For the
+ * client's own rate, the text is preformatted; otherwise, it is formatted into
+ * the given buffer.
+ */
+static const char *get_sampling_suffix(struct statsd *statsd, float sampling,
+    char *buf, size_t bufsz, size_t *suffixlen) {
+  int len;
+
+  *suffixlen = 0;
 
   if (sampling >= 1.0) {
-    res = snprintf(metric, metric_len-1, "%s%s%s:%s%lld|%s",
-      prefix != NULL ? prefix : "", sanitize_name(tmp_pool, name),
-      suffix != NULL ? suffix : "", val_prefix, (long long) val, metric_type);
+    return "";
+  }
+
+  if (sampling == statsd_statsd_get_sampling(statsd)) {
+    return statsd_statsd_get_sampling_suffix(statsd, suffixlen);
+  }
+
+  len = statsd_statsd_format_sampling(buf, bufsz, sampling);
+  if (len < 0) {
+    return "";
+  }
+
+  *suffixlen = len;
+  return buf;
+}
+
+/* Returns the sampling for a metric written with the given flags. */
+static const struct statsd_sampling *get_sampling(struct statsd *statsd,
+    int flags) {
+  if (flags & STATSD_METRIC_FL_IGNORE_SAMPLING) {
+    return &no_sampling;
+  }
+
+  return statsd_statsd_get_prepared_sampling(statsd);
+}
+
+/* Writes an aggregated counter, as its sum. */
+static int write_aggregate(const struct statsd_aggregate_entry *entry,
+    void *user_data) {
+  struct statsd *statsd;
+  struct statsd_metric_name mn;
+  const char *sampling_suffix;
+  size_t sampling_suffixlen;
+  char buf[32];
+
+  statsd = user_data;
+  sampling_suffix = get_sampling_suffix(statsd, entry->sampling, buf,
+    sizeof(buf), &sampling_suffixlen);
+
+  mn.name = entry->name;
+  mn.namelen = entry->namelen;
+  mn.fqname = NULL;
+  mn.fqnamelen = 0;
+
+  return write_metric(statsd, "c", 1, &mn, entry->sum, FALSE,
+    sampling_suffix, sampling_suffixlen);
+}
+
+static int flush_aggregate(struct statsd *statsd,
+    struct statsd_aggregate *agg) {
+  return statsd_aggregate_flush(agg, write_aggregate, statsd);
+}
+
+/* Adds the metric to the client's aggregate, if any.  Returns -1 if the
+ * metric could not be added, in which case it is to be sent as usual.
+ */
+static int add_aggregate_metric(struct statsd *statsd, int type,
+    float sampling, const char *name, int64_t val) {
+  struct statsd_aggregate *agg;
+  int res;
+
+  agg = statsd_statsd_get_aggregate(statsd);
+  if (agg == NULL) {
+    return -1;
+  }
+
+  res = statsd_aggregate_add(agg, type, sampling, name, val);
+  if (res < 0 &&
+      errno == ENOSPC) {
+    (void) flush_aggregate(statsd, agg);
+    res = statsd_aggregate_add(agg, type, sampling, name, val);
+  }
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 12,
+      "error aggregating metric '%s': %s", name, strerror(errno));
+    return -1;
+  }
+
+  if (statsd_aggregate_should_flush(agg) == TRUE) {
+    (void) flush_aggregate(statsd, agg);
+  }
+
+  return 0;
+}
+
+/* Writes a timer sketch, as gauges of its estimated percentiles, its max, and
+ * its count, e.g. "name.p50", "name.p90", "name.p99", "name.max", and
+ * "name.count".
+ */
+static int write_sketch(const char *name, size_t namelen, float sampling,
+    const struct statsd_sketch *sketch, void *user_data) {
+  register unsigned int i;
+  struct statsd *statsd;
+  struct statsd_metric_name mn;
+  char metric[STATSD_SKETCH_MAX_NAME_SIZE + 8];
+  uint64_t count;
+  static const struct {
+    double q;
+    const char *label;
+  } quantiles[] = {
+    { 0.5,	"p50" },
+    { 0.9,	"p90" },
+    { 0.99,	"p99" },
+    { 0.0,	NULL }
+  };
+
+  statsd = user_data;
+
+  for (i = 0; quantiles[i].label != NULL; i++) {
+    uint64_t val;
+
+    if (statsd_sketch_get_quantile(sketch, quantiles[i].q, &val) < 0) {
+      return -1;
+    }
+
+    pr_snprintf(metric, sizeof(metric), "%.*s.%s", (int) namelen, name,
+      quantiles[i].label);
+    init_name(&mn, metric);
+    (void) write_metric(statsd, "g", 1, &mn, (int64_t) val, FALSE, "", 0);
+  }
+
+  pr_snprintf(metric, sizeof(metric), "%.*s.max", (int) namelen, name);
+  init_name(&mn, metric);
+  (void) write_metric(statsd, "g", 1, &mn,
+    (int64_t) statsd_sketch_get_max(sketch), FALSE, "", 0);
+
+  /* Gauges are not sent with a sampling rate, so scale the count here, as
+   * the statsd server would have.
+   */
+  count = statsd_sketch_get_count(sketch);
+  if (sampling > 0.0 &&
+      sampling < 1.0) {
+    count = (uint64_t) ((count / sampling) + 0.5);
+  }
+
+  pr_snprintf(metric, sizeof(metric), "%.*s.count", (int) namelen, name);
+  init_name(&mn, metric);
+  return write_metric(statsd, "g", 1, &mn, (int64_t) count, FALSE, "", 0);
+}
+
+static int flush_sketches(struct statsd *statsd,
+    struct statsd_sketch_table *tab) {
+  return statsd_sketch_table_flush(tab, write_sketch, statsd);
+}
+
+/* Adds the timer to the client's sketch table, if any.  Returns -1 if the
+ * timer could not be added, in which case it is to be sent as usual.
+ */
+static int add_sketch_metric(struct statsd *statsd, float sampling,
+    const char *name, uint64_t ms) {
+  struct statsd_sketch_table *tab;
+  int res;
+
+  tab = statsd_statsd_get_sketches(statsd);
+  if (tab == NULL) {
+    return -1;
+  }
+
+  res = statsd_sketch_table_add(tab, sampling, name, ms);
+  if (res < 0 &&
+      errno == ENOSPC) {
+    (void) flush_sketches(statsd, tab);
+    res = statsd_sketch_table_add(tab, sampling, name, ms);
+  }
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 12,
+      "error adding timer '%s' to sketch: %s", name, strerror(errno));
+    return -1;
+  }
+
+  if (statsd_sketch_table_should_flush(tab) == TRUE) {
+    (void) flush_sketches(statsd, tab);
+  }
+
+  return 0;
+}
+
+/* Adds the metric to the client's shared arena, if any.  Returns -1 if the
+ * metric could not be added, in which case it is to be sent as usual.
+ */
+static int add_arena_metric(struct statsd *statsd, int type,
+    const struct statsd_metric_name *mn, int64_t val, int set_gauge) {
+  struct statsd_arena *arena;
+  const char *prefix = NULL, *suffix = NULL;
+  size_t prefixlen = 0, suffixlen = 0, metric_len;
+  char buf[STATSD_ARENA_MAX_NAME_SIZE], *ptr;
+  const char *metric;
+  int res;
+
+  arena = statsd_statsd_get_arena(statsd);
+  if (arena == NULL) {
+    return -1;
+  }
+
+  if (mn->fqname != NULL) {
+    metric = mn->fqname;
+    metric_len = mn->fqnamelen;
+    if (metric_len >= sizeof(buf)) {
+      return -1;
+    }
 
   } else {
-    res = snprintf(metric, metric_len-1, "%s%s%s:%s%lld|%s|@%.2f",
-      prefix != NULL ? prefix : "", sanitize_name(tmp_pool, name),
-      suffix != NULL ? suffix : "", val_prefix, (long long) val, metric_type,
-      sampling);
+    statsd_statsd_get_namespacing(statsd, &prefix, &suffix);
+    statsd_statsd_get_namespacing_len(statsd, &prefixlen, &suffixlen);
+
+    metric_len = prefixlen + mn->namelen + suffixlen;
+    if (metric_len >= sizeof(buf)) {
+      return -1;
+    }
+
+    ptr = buf;
+
+    if (prefixlen > 0) {
+      memcpy(ptr, prefix, prefixlen);
+      ptr += prefixlen;
+    }
+
+    sanitize_name(ptr, mn->name, mn->namelen);
+    ptr += mn->namelen;
+
+    if (suffixlen > 0) {
+      memcpy(ptr, suffix, suffixlen);
+    }
+
+    metric = buf;
   }
 
-  res = statsd_statsd_write(statsd, metric, res, 0);
-  xerrno = errno;
+  if (set_gauge == TRUE) {
+    res = statsd_arena_set_gauge(arena, metric, metric_len, val);
+
+  } else {
+    res = statsd_arena_add(arena, type, metric, metric_len, val);
+  }
 
-  destroy_pool(tmp_pool);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 12,
+      "error adding metric '%.*s' to arena: %s", (int) metric_len, metric,
+      strerror(errno));
+  }
 
-  errno = xerrno;
   return res;
 }
 
+static int write_counter(struct statsd *statsd,
+    const struct statsd_metric_name *mn, struct statsd_metric *metric,
+    int64_t incr, const struct statsd_sampling *sampling) {
+
+  if (statsd_statsd_get_arena(statsd) != NULL) {
+    int64_t val = incr;
+
+    /* The folded counter is not sent with a sampling rate, so scale the
+     * sampled increment here, as the statsd server would have.
+     */
+    if (sampling->rate > 0.0 &&
+        sampling->rate < 1.0) {
+      val = (int64_t) ((incr / sampling->rate) + (incr < 0 ? -0.5 : 0.5));
+    }
+
+    if (add_arena_metric(statsd, STATSD_ARENA_TYPE_COUNTER, mn, val,
+        FALSE) == 0) {
+      return 0;
+    }
+  }
+
+  if (statsd_statsd_get_aggregate(statsd) != NULL &&
+      add_aggregate_metric(statsd, STATSD_AGGREGATE_TYPE_COUNTER,
+        sampling->rate, mn->name, incr) == 0) {
+    return 0;
+  }
+
+  if (metric != NULL) {
+    return write_encoded(metric, incr, FALSE, sampling);
+  }
+
+  return write_metric(statsd, "c", 1, mn, incr, FALSE, sampling->suffix,
+    sampling->suffixlen);
+}
+
+static int write_timer(struct statsd *statsd,
+    const struct statsd_metric_name *mn, struct statsd_metric *metric,
+    uint64_t ms, const struct statsd_sampling *sampling) {
+
+  if (ms > STATSD_MAX_TIME_MS) {
+    pr_trace_msg(trace_channel, 19, "truncating time %lu ms to max %lu ms",
+      (unsigned long) ms, (unsigned long) STATSD_MAX_TIME_MS);
+    ms = STATSD_MAX_TIME_MS;
+  }
+
+  if (statsd_statsd_get_sketches(statsd) != NULL &&
+      add_sketch_metric(statsd, sampling->rate, mn->name, ms) == 0) {
+    return 0;
+  }
+
+  if (metric != NULL) {
+    return write_encoded(metric, (int64_t) ms, FALSE, sampling);
+  }
+
+  return write_metric(statsd, "ms", 2, mn, (int64_t) ms, FALSE,
+    sampling->suffix, sampling->suffixlen);
+}
+
+static int write_gauge(struct statsd *statsd,
+    const struct statsd_metric_name *mn, struct statsd_metric *metric,
+    int64_t val, int flags) {
+  int explicit_sign = FALSE;
+
+  if (flags & STATSD_METRIC_FL_GAUGE_ADJUST) {
+    /* Adjustments MUST be signed; otherwise the statsd server would treat
+     * the value as the new gauge value.
+     */
+    explicit_sign = TRUE;
+
+  } else {
+    /* If we are NOT adjusting an existing gauge value, then a negative
+     * gauge value makes no sense.
+     */
+    if (val < 0) {
+      val = 0;
+    }
+  }
+
+  /* Unlike counters and timers, gauges are NOT subject to sampling frequency;
+   * the statsd protocol does not allow for this, and rightly so.
+   */
+
+  if (statsd_statsd_get_arena(statsd) != NULL &&
+      add_arena_metric(statsd, STATSD_ARENA_TYPE_GAUGE, mn, val,
+        explicit_sign == TRUE ? FALSE : TRUE) == 0) {
+    return 0;
+  }
+
+  if (metric != NULL) {
+    return write_encoded(metric, val, explicit_sign, &no_sampling);
+  }
+
+  return write_metric(statsd, "g", 1, mn, val, explicit_sign, "", 0);
+}
+
 int statsd_metric_counter(struct statsd *statsd, const char *name,
     int64_t incr, int flags) {
-  float sampling;
+  struct statsd_metric_name mn;
 
   if (statsd == NULL ||
       name == NULL) {
@@ -98,19 +622,27 @@ int statsd_metric_counter(struct statsd *statsd, const char *name,
     return -1;
   }
 
-  if (flags & STATSD_METRIC_FL_IGNORE_SAMPLING) {
-    sampling = 1.0;
+  init_name(&mn, name);
+  return write_counter(statsd, &mn, NULL, incr, get_sampling(statsd, flags));
+}
 
-  } else {
-    sampling = statsd_statsd_get_sampling(statsd);
+int statsd_metric_timer(struct statsd *statsd, const char *name, uint64_t ms,
+    int flags) {
+  struct statsd_metric_name mn;
+
+  if (statsd == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
   }
 
-  return write_metric(statsd, "c", name, "", incr, sampling);
+  init_name(&mn, name);
+  return write_timer(statsd, &mn, NULL, ms, get_sampling(statsd, flags));
 }
 
-int statsd_metric_timer(struct statsd *statsd, const char *name, uint64_t ms,
+int statsd_metric_gauge(struct statsd *statsd, const char *name, int64_t val,
     int flags) {
-  float sampling;
+  struct statsd_metric_name mn;
 
   if (statsd == NULL ||
       name == NULL) {
@@ -118,53 +650,158 @@ int statsd_metric_timer(struct statsd *statsd, const char *name, uint64_t ms,
     return -1;
   }
 
-  if (ms > STATSD_MAX_TIME_MS) {
-    pr_trace_msg(trace_channel, 19, "truncating time %lu ms to max %lu ms",
-      (unsigned long) ms, (unsigned long) STATSD_MAX_TIME_MS);
-    ms = STATSD_MAX_TIME_MS;
+  init_name(&mn, name);
+  return write_gauge(statsd, &mn, NULL, val, flags);
+}
+
+int statsd_metric_name_init(struct statsd *statsd, pool *p, const char *name,
+    struct statsd_metric_name *mn) {
+  const char *prefix = NULL, *suffix = NULL;
+  size_t namelen, prefixlen = 0, suffixlen = 0;
+  char *fqname, *ptr;
+
+  if (statsd == NULL ||
+      p == NULL ||
+      name == NULL ||
+      mn == NULL) {
+    errno = EINVAL;
+    return -1;
   }
 
-  if (flags & STATSD_METRIC_FL_IGNORE_SAMPLING) {
-    sampling = 1.0;
+  statsd_statsd_get_namespacing(statsd, &prefix, &suffix);
+  statsd_statsd_get_namespacing_len(statsd, &prefixlen, &suffixlen);
 
-  } else {
-    sampling = statsd_statsd_get_sampling(statsd);
+  namelen = strlen(name);
+
+  mn->name = pstrndup(p, name, namelen);
+  mn->namelen = namelen;
+
+  fqname = ptr = palloc(p, prefixlen + namelen + suffixlen + 1);
+
+  if (prefixlen > 0) {
+    memcpy(ptr, prefix, prefixlen);
+    ptr += prefixlen;
   }
 
-  return write_metric(statsd, "ms", name, "", ms, sampling);
+  sanitize_name(ptr, name, namelen);
+  ptr += namelen;
+
+  if (suffixlen > 0) {
+    memcpy(ptr, suffix, suffixlen);
+    ptr += suffixlen;
+  }
+
+  *ptr = '\0';
+
+  mn->fqname = fqname;
+  mn->fqnamelen = prefixlen + namelen + suffixlen;
+
+  return 0;
 }
 
-int statsd_metric_gauge(struct statsd *statsd, const char *name, int64_t val,
-    int flags) {
-  char *val_prefix;
+struct statsd_metric *statsd_metric_register(struct statsd *statsd, pool *p,
+    int type, const char *name, int flags) {
+  struct statsd_metric *metric;
 
   if (statsd == NULL ||
+      p == NULL ||
       name == NULL) {
     errno = EINVAL;
+    return NULL;
+  }
+
+  if (type != STATSD_METRIC_TYPE_COUNTER &&
+      type != STATSD_METRIC_TYPE_TIMER &&
+      type != STATSD_METRIC_TYPE_GAUGE) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  metric = pcalloc(p, sizeof(struct statsd_metric));
+  metric->statsd = statsd;
+  metric->type = type;
+  metric->flags = flags;
+
+  if (statsd_metric_name_init(statsd, p, name, &(metric->name)) < 0) {
+    return NULL;
+  }
+
+  metric->headlen = metric->name.fqnamelen + 1;
+  metric->head = palloc(p, metric->headlen);
+  memcpy(metric->head, metric->name.fqname, metric->name.fqnamelen);
+  metric->head[metric->headlen - 1] = ':';
+
+  encode_tail(metric);
+
+  return metric;
+}
+
+static int write_registered(struct statsd_metric *metric, int64_t val,
+    const struct statsd_sampling *sampling) {
+  if (metric->flags & STATSD_METRIC_FL_IGNORE_SAMPLING) {
+    sampling = &no_sampling;
+  }
+
+  switch (metric->type) {
+    case STATSD_METRIC_TYPE_COUNTER:
+      return write_counter(metric->statsd, &(metric->name), metric, val,
+        sampling);
+
+    case STATSD_METRIC_TYPE_TIMER:
+      if (val < 0) {
+        val = 0;
+      }
+
+      return write_timer(metric->statsd, &(metric->name), metric,
+        (uint64_t) val, sampling);
+
+    default:
+      break;
+  }
+
+  return write_gauge(metric->statsd, &(metric->name), metric, val,
+    metric->flags);
+}
+
+int statsd_metric_write(struct statsd_metric *metric, int64_t val) {
+  if (metric == NULL) {
+    errno = EINVAL;
     return -1;
   }
 
-  val_prefix = "";
+  return write_registered(metric, val,
+    statsd_statsd_get_prepared_sampling(metric->statsd));
+}
 
-  if (flags & STATSD_METRIC_FL_GAUGE_ADJUST) {
-    if (val > 0) {
-      val_prefix = "+";
+int statsd_metric_write_sampled(struct statsd_metric *metric, int64_t val,
+    const struct statsd_sampling *sampling) {
+  if (metric == NULL ||
+      sampling == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
 
-    } else if (val < 0) {
-      val_prefix = "-";
-    }
+  return write_registered(metric, val, sampling);
+}
 
-  } else {
-    /* If we are NOT adjusting an existing gauge value, then a negative
-     * gauge value makes no sense.
-     */
-    if (val < 0) {
-      val = 0;
-    }
+int statsd_metric_flush(struct statsd *statsd) {
+  struct statsd_aggregate *agg;
+  struct statsd_sketch_table *tab;
+
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
   }
 
-  /* Unlike counters and timers, gauges are NOT subject to sampling frequency;
-   * the statsd protocol does not allow for this, and rightly so.
-   */
-  return write_metric(statsd, "g", name, val_prefix, val, 1.0);
+  agg = statsd_statsd_get_aggregate(statsd);
+  if (agg != NULL) {
+    (void) flush_aggregate(statsd, agg);
+  }
+
+  tab = statsd_statsd_get_sketches(statsd);
+  if (tab != NULL) {
+    (void) flush_sketches(statsd, tab);
+  }
+
+  return statsd_statsd_flush(statsd);
 }
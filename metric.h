@@ -35,6 +35,49 @@ int statsd_metric_timer(struct statsd *statsd, const char *name, uint64_t ms,
 int statsd_metric_gauge(struct statsd *statsd, const char *name, int64_t val,
   int flags);
 
+/* A metric name used repeatedly, e.g. by a registered metric, along with its
+ * namespaced (i.e. with the client's prefix and suffix) and sanitized form,
+ * so that the name need not be namespaced and sanitized for every value.
+ * The namespaced form is only valid for the client used to initialize it.
+ */
+struct statsd_metric_name {
+  const char *name;
+  size_t namelen;
+  const char *fqname;
+  size_t fqnamelen;
+};
+
+int statsd_metric_name_init(struct statsd *statsd, pool *p, const char *name,
+  struct statsd_metric_name *mn);
+
+/* A metric registered for repeated use with a client.  Its name and type are
+ * encoded once, so that writing a value only formats the value's digits.  The metric is only valid for the client used to register
+ * it.
+ */
+struct statsd_metric;
+
+struct statsd_metric *statsd_metric_register(struct statsd *statsd, pool *p,
+  int type, const char *name, int flags);
+#define STATSD_METRIC_TYPE_COUNTER		1
+#define STATSD_METRIC_TYPE_TIMER		2
+#define STATSD_METRIC_TYPE_GAUGE		3
+
+/* Writes the given value of a registered metric: the increment of a counter,
+ * the milliseconds of a timer, or the value (or adjustment) of a gauge.
+ */
+int statsd_metric_write(struct statsd_metric *metric, int64_t val);
+
+/* Writes the given value of a registered metric, sampled at the given
+ * prepared rate, e.g. that of a command, rather than the client's rate.
+ */
+int statsd_metric_write_sampled(struct statsd_metric *metric, int64_t val,
+  const struct statsd_sampling *sampling);
+
+/* Writes any aggregated metrics and timer sketches to the client, and
+ * flushes the client.
+ */
+int statsd_metric_flush(struct statsd *statsd);
+
 /* Use this flag, for a gauge, for adjusting the existing gauge value, rather
  * than setting it.
  */
@@ -22,11 +22,18 @@
  *
  * -----DO NOT EDIT BELOW THIS LINE-----
  * $Archive: mod_statsd.a $
+ * $Libraries: -lm$
  */
 
 #include "mod_statsd.h"
 #include "statsd.h"
 #include "metric.h"
+#include "arena.h"
+#include "relay.h"
+#include "aggregate.h"
+#include "sketch.h"
+#include "histogram.h"
+#include "cardinality.h"
 
 extern xaset_t *server_list;
 
@@ -34,31 +41,384 @@ module statsd_module;
 
 #define STATSD_DEFAULT_ENGINE			FALSE
 #define STATSD_DEFAULT_SAMPLING			1.0F
+#define STATSD_DEFAULT_SERVER_TTL		300
+#define STATSD_DEFAULT_FLUSH_FILL		100
+#define STATSD_DEFAULT_MAX_NAMES		256
+
+/* StatsdSampling modes */
+#define STATSD_SAMPLING_MODE_COMMAND		0
+#define STATSD_SAMPLING_MODE_SESSION		1
+
+/* The size of the per-command tables, indexed by command ID. */
+#define STATSD_MAX_CMD_IDS			256
+#define STATSD_CMD_BITMAP_WORDS			(STATSD_MAX_CMD_IDS / 32)
+
+/* The max number of commands without an ID whose StatsdExcludeFilter result
+ * is cached; clients can send arbitrary command names.
+ */
+#define STATSD_MAX_EXCLUDE_NAMES		64
+#define STATSD_MAX_SAMPLING_NAMES		64
+
+/* The IDs of the metrics with fixed names, from the metric catalog. */
+enum {
+#define STATSD_METRIC(id, type, name, flags)	STATSD_FIXED_##id,
+#include "metrics.def"
+  STATSD_FIXED_COUNT
+};
+
+/* StatsdServer schemes */
+#define STATSD_SCHEME_UDP			0
+#define STATSD_SCHEME_TCP			1
+#define STATSD_SCHEME_UNIX			2
+
+/* StatsdOptions */
+#define STATSD_OPT_SHARED_SOCKET		0x0001
+#define STATSD_OPT_SHARED_COUNTERS		0x0002
+#define STATSD_OPT_RELAY			0x0004
+#define STATSD_OPT_AGGREGATE			0x0008
+#define STATSD_OPT_SHARED_HISTOGRAMS		0x0010
 
 static int statsd_engine = STATSD_DEFAULT_ENGINE;
+static unsigned long statsd_opts = 0UL;
 static const char *statsd_exclude_filter = NULL;
 #if defined(PR_USE_REGEX)
 static pr_regex_t *statsd_exclude_pre = NULL;
 #endif /* PR_USE_REGEX */
+
+/* The StatsdExcludeFilter result for each command ID: a command's bit in the
+ * resolved bitmap is set once the filter has been applied to that command,
+ * and its bit in the excluded bitmap then holds the result.  The results for
+ * commands without an ID are cached by name.
+ */
+static uint32_t statsd_exclude_resolved[STATSD_CMD_BITMAP_WORDS];
+static uint32_t statsd_exclude_ids[STATSD_CMD_BITMAP_WORDS];
+static pr_table_t *statsd_exclude_names = NULL;
 static float statsd_sampling = STATSD_DEFAULT_SAMPLING;
+static int statsd_sampling_mode = STATSD_SAMPLING_MODE_COMMAND;
+
+/* The StatsdSampling rate, and the full rate used for the commands kept by
+ * tail sampling, prepared once for the session.
+ */
+static struct statsd_sampling statsd_default_sampling;
+static struct statsd_sampling statsd_full_sampling;
+
+/* The StatsdCommandSampling rules, in configuration order, each with its
+ * prepared rate.
+ */
+struct statsd_cmd_sampling_rule {
+  struct statsd_cmd_sampling_rule *next;
+  config_rec *c;
+  struct statsd_sampling sampling;
+};
+
+static struct statsd_cmd_sampling_rule *statsd_cmd_sampling_rules = NULL;
+
+/* With StatsdCommandSampling rules, the prepared sampling for each command
+ * ID, resolved from the rules for the known commands when the session
+ * starts.  The sampling for commands without an ID is cached by name.
+ */
+static const struct statsd_sampling **statsd_cmd_sampling = NULL;
+static pr_table_t *statsd_cmd_sampling_names = NULL;
+
+/* The commands whose sampling is resolved when the session starts. */
+static const char *statsd_sampling_cmds[] = {
+  C_USER, C_PASS, C_ACCT, C_CWD, C_XCWD, C_CDUP, C_XCUP, C_SMNT, C_REIN,
+  C_QUIT, C_PORT, C_EPRT, C_PASV, C_EPSV, C_TYPE, C_STRU, C_MODE, C_RETR,
+  C_STOR, C_STOU, C_APPE, C_ALLO, C_REST, C_RNFR, C_RNTO, C_ABOR, C_DELE,
+  C_MDTM, C_RMD, C_XRMD, C_MKD, C_XMKD, C_PWD, C_XPWD, C_SIZE, C_LIST,
+  C_NLST, C_MLSD, C_MLST, C_SITE, C_SYST, C_STAT, C_HELP, C_NOOP, C_FEAT,
+  C_OPTS, C_LANG, C_HOST, C_CLNT, C_MFMT, C_MFF, C_ADAT, C_AUTH, C_CCC,
+  C_CONF, C_ENC, C_MIC, C_PBSZ, C_PROT,
+  NULL
+};
+
+/* With StatsdTailSampling, failed commands, and commands slower than the
+ * configured threshold (if any), are always sampled.
+ */
+static int statsd_tail_sampling = FALSE;
+static unsigned long statsd_tail_slow_ms = 0;
+
+/* With whole-session sampling, whether this session is instrumented.  An
+ * unsampled session only maintains the "connection.unsampled" gauge, using
+ * the shared arena, if available, rather than a client of its own.
+ */
+static int statsd_sess_sampled = TRUE;
+static struct statsd_arena *statsd_unsampled_arena = NULL;
+static const char *statsd_unsampled_gauge = NULL;
 static uint64_t statsd_sess_start_ms = 0;
 static struct statsd *statsd = NULL;
 
+/* The session's registered command metrics, by command ID and response
+ * code.
+ */
+struct statsd_cmd_metric {
+  struct statsd_cmd_metric *next;
+  unsigned int resp_code;
+  struct statsd_metric *counter;
+  struct statsd_metric *timer;
+};
+
+static struct statsd_cmd_metric **statsd_cmd_metrics = NULL;
+
+/* The registered metric handles are allocated from this sub-pool of the
+ * client's pool, and so are freed when the client is closed, e.g. on a HOST
+ * reinitialization.
+ */
+static pool *statsd_metric_pool = NULL;
+
+/* The descriptors of the metrics with fixed names, from the metric catalog,
+ * registered for the session.  The counters of events which are NOT subject
+ * to the sampling frequency are flagged here, and registered according to
+ * the sampling mode.
+ */
+static const struct {
+  int type;
+  const char *name;
+  int flags;
+} statsd_fixed_metric_tab[STATSD_FIXED_COUNT] = {
+#define STATSD_METRIC(id, type, name, flags) \
+  { STATSD_METRIC_TYPE_##type, name, flags },
+#include "metrics.def"
+};
+
+static struct statsd_metric *statsd_fixed_metrics[STATSD_FIXED_COUNT];
+
 /* SQL metrics */
 static unsigned int statsd_sql_conn_count = 0;
 
+/* The daemon resolves the StatsdServer addresses, and periodically
+ * re-resolves them, so that sessions need not.
+ */
+static int statsd_resolve_timer_id = -1;
+
+/* With a StatsdFlushInterval, pending metrics are sent by a timer, or once
+ * they fill the configured percentage of a packet, rather than after every
+ * command.
+ */
+static int statsd_flush_interval = 0;
+static unsigned int statsd_flush_fill = STATSD_DEFAULT_FLUSH_FILL;
+static int statsd_flush_timer_id = -1;
+
+/* With the SharedSocket StatsdOption, the daemon opens the UDP (or Unix
+ * domain) sockets, which are then used by all of the sessions.  These
+ * sockets are kept across restarts.
+ */
+struct statsd_socket {
+  struct statsd_socket *next;
+  const char *key;
+  pr_netaddr_t *addr;
+  int fd;
+};
+
+static pool *statsd_socket_pool = NULL;
+static struct statsd_socket *statsd_sockets = NULL;
+
+/* With the SharedCounters StatsdOption, the daemon creates a shared memory
+ * arena for each StatsdServer, to which the sessions add their counters and
+ * gauges.  The daemon periodically folds each arena, sending the aggregated
+ * metrics using its own client.  Each arena has its own pool, as arenas are
+ * kept across restarts.
+ */
+struct statsd_shared_arena {
+  struct statsd_shared_arena *next;
+  pool *pool;
+  const char *key;
+  struct statsd_arena *arena;
+
+  /* For opening the daemon's client. */
+  const pr_netaddr_t *addr;
+  const char *path;
+  int use_tcp;
+  struct statsd *statsd;
+};
+
+static struct statsd_shared_arena *statsd_arenas = NULL;
+static int statsd_fold_timer_id = -1;
+
+/* With the Relay StatsdOption, the standalone daemon forks a relay process,
+ * which sends the metrics from all sessions on to the StatsdServers, using
+ * one long-lived client per StatsdServer.  The sockets between the sessions
+ * and the relay are kept across restarts, so that the relay can be restarted
+ * without disrupting the existing sessions.
+ */
+struct statsd_relay_conn {
+  struct statsd_relay_conn *next;
+  pool *pool;
+  const char *key;
+  int fds[2];
+
+  /* For opening the relay's client. */
+  const pr_netaddr_t *addr;
+  const char *path;
+  int use_tcp;
+  size_t max_pktsz;
+};
+
+static struct statsd_relay_conn *statsd_relay_conns = NULL;
+static pid_t statsd_relay_pid = 0;
+
+/* Set once the standalone daemon has started up; until then (and for
+ * inetd, or when only checking the configuration), there is no relay.
+ */
+static int statsd_relay_enabled = FALSE;
+
+/* With the SharedHistograms StatsdOption, the daemon creates shared memory
+ * latency histograms, one per command family, for each StatsdServer and
+ * prefix/suffix, to which the sessions add their command response times.
+ * The daemon periodically sends, and resets, the percentiles of each
+ * histogram, using its own client.  As with the arenas, the histograms are
+ * kept across restarts.
+ */
+struct statsd_shared_histogram {
+  struct statsd_shared_histogram *next;
+  pool *pool;
+  const char *key;
+  struct statsd_histogram *hist;
+
+  /* For opening the daemon's client. */
+  const pr_netaddr_t *addr;
+  const char *path;
+  int use_tcp;
+  const char *prefix;
+  const char *suffix;
+  struct statsd *statsd;
+};
+
+static struct statsd_shared_histogram *statsd_histograms = NULL;
+
+/* The session's histograms, if any. */
+static struct statsd_histogram *statsd_histogram = NULL;
+
+/* Per StatsdMaxMetricNames, the max number of distinct client-controlled
+ * names, i.e. of commands without an ID, and of TLS ciphers and protocols,
+ * used in metric names; the metrics of any other names are collapsed into
+ * "OTHER" metrics, so that clients cannot create unbounded metric series.
+ * The daemon creates the set of names shared by the sessions; each session
+ * also keeps the names it has admitted, to avoid the shared set for them,
+ * and to bound its own names should the shared set be unavailable.
+ */
+static unsigned int statsd_max_names = STATSD_DEFAULT_MAX_NAMES;
+static struct statsd_cardinality *statsd_names = NULL;
+static pr_table_t *statsd_sess_names = NULL;
+
+/* The collapsed "OTHER" command metrics, by response code. */
+static struct statsd_cmd_metric *statsd_other_cmd_metrics = NULL;
+
+/* The command families, by command class; the first matching family is
+ * used, with the last family matching any command.
+ */
+static struct {
+  int cmd_class;
+  const char *name;
+} statsd_cmd_families[] = {
+  { CL_READ,	"latency.read" },
+  { CL_WRITE,	"latency.write" },
+  { CL_DIRS,	"latency.dirs" },
+  { CL_INFO,	"latency.info" },
+  { CL_AUTH,	"latency.auth" },
+  { CL_MISC,	"latency.misc" },
+  { CL_NONE,	"latency.other" },
+
+  { -1, NULL }
+};
+
+#define STATSD_CMD_FAMILY_COUNT \
+  ((sizeof(statsd_cmd_families) / sizeof(statsd_cmd_families[0])) - 1)
+
 static int statsd_sess_init(void);
 
 static const char *trace_channel = "statsd";
 
-static char *get_cmd_metric(pool *p, const char *cmd) {
-  const char *resp_code = NULL;
+static void write_fixed_metric(unsigned int idx, int64_t val) {
+  /* The handles do not outlive the client, e.g. for events after core.exit. */
+  if (statsd == NULL) {
+    return;
+  }
+
+  (void) statsd_metric_write(statsd_fixed_metrics[idx], val);
+}
+
+/* Writes a fixed metric for a command, at the command's sampling rate. */
+static void write_fixed_metric_sampled(unsigned int idx, int64_t val,
+    const struct statsd_sampling *sampling) {
+  if (statsd == NULL) {
+    return;
+  }
+
+  (void) statsd_metric_write_sampled(statsd_fixed_metrics[idx], val,
+    sampling);
+}
+
+/* The registered metric handles must be forgotten before the client, and
+ * with it their pool, is closed.
+ */
+static void clear_metric_handles(void) {
+  statsd_metric_pool = NULL;
+  statsd_cmd_metrics = NULL;
+  statsd_other_cmd_metrics = NULL;
+  memset(statsd_fixed_metrics, 0, sizeof(statsd_fixed_metrics));
+}
+
+/* Returns the numeric response code, for the command metric cache; 0 for no
+ * response code, and -1 for an unexpected one.
+ */
+static int get_resp_code_key(const char *resp_code) {
+  if (resp_code[0] == '-' &&
+      resp_code[1] == '\0') {
+    return 0;
+  }
+
+  if (resp_code[0] < '1' || resp_code[0] > '9' ||
+      resp_code[1] < '0' || resp_code[1] > '9' ||
+      resp_code[2] < '0' || resp_code[2] > '9' ||
+      resp_code[3] != '\0') {
+    return -1;
+  }
+
+  return ((resp_code[0] - '0') * 100) + ((resp_code[1] - '0') * 10) +
+    (resp_code[2] - '0');
+}
+
+/* Returns TRUE if the given client-controlled metric name may be used, or
+ * FALSE if its metrics are to be collapsed, per StatsdMaxMetricNames.
+ */
+static int admit_name(const char *name) {
+  static int admitted = TRUE;
+
+  if (statsd_sess_names == NULL) {
+    return TRUE;
+  }
+
+  if (pr_table_get(statsd_sess_names, name, NULL) != NULL) {
+    return TRUE;
+  }
+
+  if ((unsigned int) pr_table_count(statsd_sess_names) >= statsd_max_names) {
+    return FALSE;
+  }
+
+  if (statsd_names != NULL &&
+      statsd_cardinality_admit(statsd_names, name, strlen(name)) != TRUE) {
+    return FALSE;
+  }
+
+  (void) pr_table_add(statsd_sess_names, pstrdup(session.pool, name),
+    &admitted, sizeof(int));
+  return TRUE;
+}
+
+static struct statsd_cmd_metric *get_cmd_metric(cmd_rec *cmd,
+    const struct statsd_sampling *sampling) {
+  const char *name, *resp_code = NULL;
   char *metric;
+  struct statsd_cmd_metric *cm = NULL, **cms = NULL;
+  pool *p;
+  int code = -1;
 
-  if (strcasecmp(cmd, C_QUIT) != 0) {
+  if (strcasecmp(cmd->argv[0], C_QUIT) != 0) {
     int res;
 
-    res = pr_response_get_last(p, &resp_code, NULL);
+    res = pr_response_get_last(cmd->tmp_pool, &resp_code, NULL);
     if (res < 0 ||
         resp_code == NULL) {
       resp_code = "-";
@@ -68,95 +428,105 @@ static char *get_cmd_metric(pool *p, const char *cmd) {
     resp_code = R_221;
   }
 
-  metric = pstrcat(p, "command.", cmd, ".", resp_code, NULL);
-  return metric;
-}
+  name = cmd->argv[0];
 
-static char *get_conn_metric(pool *p, const char *name) {
-  char *metric;
+  if (statsd_cmd_metrics != NULL &&
+      cmd->cmd_id > 0 &&
+      cmd->cmd_id < STATSD_MAX_CMD_IDS) {
+    cms = &(statsd_cmd_metrics[cmd->cmd_id]);
 
-  if (name == NULL) {
-    metric = pstrdup(p, "connection");
+  } else if (admit_name(pstrcat(cmd->tmp_pool, "command.", name,
+      NULL)) != TRUE) {
+    /* Commands without an ID are named by the client. */
+    pr_trace_msg(trace_channel, 15,
+      "collapsing metrics for command '%s' per StatsdMaxMetricNames", name);
+    write_fixed_metric_sampled(STATSD_FIXED_COLLAPSED_COMMAND, 1, sampling);
 
-  } else {
-    metric = pstrcat(p, name, ".connection", NULL);
+    name = "OTHER";
+    cms = &statsd_other_cmd_metrics;
   }
 
-  return metric;
-}
+  if (cms != NULL) {
+    code = get_resp_code_key(resp_code);
+  }
 
-static char *get_log_level_metric(pool *p, int log_level) {
-  char *name, *metric;
+  if (code >= 0) {
+    for (cm = *cms; cm != NULL; cm = cm->next) {
+      if (cm->resp_code == (unsigned int) code) {
+        return cm;
+      }
+    }
+  }
 
-  switch (log_level) {
-    case PR_LOG_DEBUG:
-      name = "DEBUG";
-      break;
+  /* Metrics which cannot be cached are registered for this use only. */
+  p = code >= 0 ? statsd_metric_pool : cmd->tmp_pool;
 
-    case PR_LOG_INFO:
-      name = "INFO";
-      break;
+  metric = pstrcat(cmd->tmp_pool, "command.", name, ".", resp_code, NULL);
 
-    case PR_LOG_NOTICE:
-      name = "NOTICE";
-      break;
+  cm = pcalloc(p, sizeof(struct statsd_cmd_metric));
+  cm->counter = statsd_metric_register(statsd, p, STATSD_METRIC_TYPE_COUNTER,
+    metric, 0);
+  cm->timer = statsd_metric_register(statsd, p, STATSD_METRIC_TYPE_TIMER,
+    metric, 0);
 
-    case PR_LOG_WARNING:
-      name = "WARN";
-      break;
+  if (cm->counter == NULL ||
+      cm->timer == NULL) {
+    return NULL;
+  }
 
-    case PR_LOG_ERR:
-      name = "ERROR";
-      break;
+  if (code >= 0) {
+    cm->resp_code = code;
+    cm->next = *cms;
+    *cms = cm;
+  }
 
-    case PR_LOG_CRIT:
-      name = "CRIT";
-      break;
+  return cm;
+}
 
-    case PR_LOG_ALERT:
-      name = "ALERT";
-      break;
+static char *get_conn_metric(pool *p, const char *name) {
+  char *metric;
 
-    case PR_LOG_EMERG:
-      name = "EMERG";
-      break;
+  if (name == NULL) {
+    metric = pstrdup(p, "connection");
 
-    default:
-      name = "unknown";
-      break;
+  } else {
+    metric = pstrcat(p, name, ".connection", NULL);
   }
 
-  metric = pstrcat(p, "log.", name, NULL);
   return metric;
 }
 
-static char *get_sql_metric(pool *p, const char *name) {
+static char *get_tls_metric(pool *p, const char *name) {
   char *metric;
 
-  metric = pstrcat(p, "sql.", name, NULL);
+  metric = pstrcat(p, "tls.", name, NULL);
   return metric;
 }
 
-static char *get_timeout_metric(pool *p, const char *name) {
+/* The TLS cipher and protocol are chosen by the client, from those
+ * configured; collapse them, like command names.
+ */
+static char *get_tls_env_metric(pool *p, const char *name, const char *val,
+    const struct statsd_sampling *sampling) {
   char *metric;
 
-  metric = pstrcat(p, "timeout.", name, NULL);
-  return metric;
-}
+  metric = get_tls_metric(p, pstrcat(p, name, ".", val, NULL));
+  if (admit_name(metric) != TRUE) {
+    pr_trace_msg(trace_channel, 15,
+      "collapsing metric '%s' per StatsdMaxMetricNames", metric);
+    write_fixed_metric_sampled(STATSD_FIXED_COLLAPSED_TLS, 1, sampling);
 
-static char *get_tls_metric(pool *p, const char *name) {
-  char *metric;
+    metric = get_tls_metric(p, pstrcat(p, name, ".OTHER", NULL));
+  }
 
-  metric = pstrcat(p, "tls.", name, NULL);
   return metric;
 }
 
-static int should_exclude(cmd_rec *cmd) {
+static int match_exclude_filter(const char *name) {
   int exclude = FALSE;
 
 #if defined(PR_USE_REGEX)
-  if (pr_regexp_exec(statsd_exclude_pre, (char *) cmd->argv[0], 0, NULL, 0, 0,
-      0) == 0) {
+  if (pr_regexp_exec(statsd_exclude_pre, name, 0, NULL, 0, 0, 0) == 0) {
     exclude = TRUE;
   }
 #endif /* PR_USE_REGEX */
@@ -164,414 +534,2265 @@ static int should_exclude(cmd_rec *cmd) {
   return exclude;
 }
 
-static int should_sample(float sampling) {
-  float p;
-
-  if (sampling >= 1.0) {
-    return TRUE;
-  }
-
-#if defined(HAVE_RANDOM)
-  p = ((float) random() / RAND_MAX);
-#else
-  p = ((float) rand() / RAND_MAX);
-#endif /* HAVE_RANDOM */
+static int should_exclude(cmd_rec *cmd) {
+  int exclude;
+  const int *cached;
+  const char *name;
 
-  pr_trace_msg(trace_channel, 19, "sampling: p = %f, sample percentage = %f",
-    p, sampling);
-  if (p > sampling) {
+  if (statsd_exclude_filter == NULL) {
     return FALSE;
   }
 
-  return TRUE;
-}
+  if (cmd->cmd_id > 0 &&
+      cmd->cmd_id < STATSD_MAX_CMD_IDS) {
+    unsigned int idx;
+    uint32_t bit;
 
-/* Configuration handlers
- */
+    idx = cmd->cmd_id / 32;
+    bit = ((uint32_t) 1) << (cmd->cmd_id % 32);
 
-/* usage: StatsdEngine on|off */
-MODRET set_statsdengine(cmd_rec *cmd) {
-  int engine = -1;
-  config_rec *c;
+    if (!(statsd_exclude_resolved[idx] & bit)) {
+      if (match_exclude_filter(cmd->argv[0]) == TRUE) {
+        statsd_exclude_ids[idx] |= bit;
+      }
 
-  CHECK_ARGS(cmd, 1);
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+      statsd_exclude_resolved[idx] |= bit;
+    }
 
-  engine = get_boolean(cmd, 1);
-  if (engine == -1) {
-    CONF_ERROR(cmd, "expected Boolean parameter");
+    return (statsd_exclude_ids[idx] & bit) ? TRUE : FALSE;
   }
 
-  c = add_config_param(cmd->argv[0], 1, NULL);
-  c->argv[0] = palloc(c->pool, sizeof(int));
-  *((int *) c->argv[0]) = engine;
-
-  return PR_HANDLED(cmd);
-}
-
-/* usage: StatsdExcludeFilter regex|"none" */
-MODRET set_statsdexcludefilter(cmd_rec *cmd) {
-#if defined(PR_USE_REGEX)
-  pr_regex_t *pre = NULL;
-  config_rec *c;
-  char *pattern;
-  int res;
-
-  CHECK_ARGS(cmd, 1);
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+  name = cmd->argv[0];
 
-  if (strcasecmp(cmd->argv[1], "none") == 0) {
-    (void) add_config_param(cmd->argv[0], 0);
-    return PR_HANDLED(cmd);
+  cached = pr_table_get(statsd_exclude_names, name, NULL);
+  if (cached != NULL) {
+    return *cached;
   }
 
-  pre = pr_regexp_alloc(&statsd_module);
+  exclude = match_exclude_filter(name);
 
-  pattern = cmd->argv[1];
-  res = pr_regexp_compile(pre, pattern, REG_EXTENDED|REG_NOSUB);
-  if (res != 0) {
-    char errstr[256] = {'\0'};
+  if (pr_table_count(statsd_exclude_names) < STATSD_MAX_EXCLUDE_NAMES) {
+    int *val;
 
-    pr_regexp_error(res, pre, errstr, sizeof(errstr));
-    pr_regexp_free(NULL, pre);
+    val = palloc(session.pool, sizeof(int));
+    *val = exclude;
 
-    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", pattern,
-      "' failed regex compilation: ", errstr, NULL));
+    (void) pr_table_add(statsd_exclude_names, pstrdup(session.pool, name), val,
+      sizeof(int));
   }
 
-  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
-  c->argv[0] = pstrdup(c->pool, pattern);
-  c->argv[1] = (void *) pre;
-
-  return PR_HANDLED(cmd);
-#else
-  CONF_ERROR(cmd, "The StatsdExcludeFilter directive cannot be used on this "
-    "system, as you do not have POSIX compliant regex support");
-#endif /* PR_USE_REGEX */
+  return exclude;
 }
 
-/* usage: StatsdSampling percentage */
-MODRET set_statsdsampling(cmd_rec *cmd) {
-  config_rec *c;
-  char *ptr = NULL;
-  float percentage, sampling;
-
-  CHECK_ARGS(cmd, 1);
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+static unsigned int get_cmd_family(cmd_rec *cmd) {
+  register unsigned int i;
 
-  percentage = strtof(cmd->argv[1], &ptr);
-  if (ptr && *ptr) {
-    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted percentage value: ",
-      cmd->argv[1], NULL));
+  for (i = 0; i < STATSD_CMD_FAMILY_COUNT - 1; i++) {
+    if (cmd->cmd_class & statsd_cmd_families[i].cmd_class) {
+      break;
+    }
   }
 
-  if (percentage <= 0.0 ||
-      percentage > 100.0) {
-    CONF_ERROR(cmd, "percentage must be between 0 and 100");
+  return i;
+}
+
+static int should_sample(const struct statsd_sampling *sampling) {
+  if (statsd == NULL) {
+    return FALSE;
   }
 
-  /* For easier comparison with e.g. random(3) values, and for formatting
-   * the statsd metric values, we convert from a 1-100 value to 0.00-1.00.
+  /* With whole-session sampling, every event of a sampled session is
+   * sampled.
    */
-  sampling = percentage / 100.0;
+  if (statsd_sampling_mode == STATSD_SAMPLING_MODE_SESSION) {
+    return TRUE;
+  }
 
-  c = add_config_param(cmd->argv[0], 1, NULL);
-  c->argv[0] = palloc(c->pool, sizeof(float));
-  *((float *) c->argv[0]) = sampling;
+  if (statsd_statsd_should_sample_at(statsd, sampling) != TRUE) {
+    return FALSE;
+  }
 
-  return PR_HANDLED(cmd);
+  return TRUE;
 }
 
-/* usage: StatsdServer [scheme://]host[:port] [prefix] [suffix] */
-MODRET set_statsdserver(cmd_rec *cmd) {
-  config_rec *c;
-  char *server, *ptr;
-  size_t server_len;
-  int port = STATSD_DEFAULT_PORT, use_tcp = FALSE;
-
-  if (cmd->argc < 2 ||
-      cmd->argc > 4) {
-    CONF_ERROR(cmd, "wrong number of parameters");
-  }
+/* Returns the prepared sampling of the first StatsdCommandSampling rule
+ * matching the given command, or the StatsdSampling rate.
+ */
+static const struct statsd_sampling *match_cmd_sampling(const char *name) {
+  struct statsd_cmd_sampling_rule *rule;
 
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+  for (rule = statsd_cmd_sampling_rules; rule != NULL; rule = rule->next) {
+    register int i;
+    config_rec *c;
 
-  server = pstrdup(cmd->tmp_pool, cmd->argv[1]);
+    c = rule->c;
 
-  if (strncasecmp(server, "tcp://", 6) == 0) {
-    use_tcp = TRUE;
-    server += 6;
+#if defined(PR_USE_REGEX)
+    if (c->argv[1] != NULL) {
+      if (pr_regexp_exec(c->argv[1], name, 0, NULL, 0, 0, 0) == 0) {
+        return &(rule->sampling);
+      }
+    }
+#endif /* PR_USE_REGEX */
+
+    for (i = 2; i < c->argc; i++) {
+      if (strcasecmp(c->argv[i], name) == 0) {
+        return &(rule->sampling);
+      }
+    }
+  }
+
+  return &statsd_default_sampling;
+}
+
+/* Prepares the rate of each StatsdCommandSampling rule, starting with the
+ * given one, and resolves the sampling of the known commands, so that the
+ * rules need not be matched as commands are logged.
+ */
+static void resolve_cmd_sampling(config_rec *c) {
+  register unsigned int i;
+  struct statsd_cmd_sampling_rule *last = NULL;
+
+  while (c != NULL) {
+    struct statsd_cmd_sampling_rule *rule;
+
+    pr_signals_handle();
+
+    rule = pcalloc(session.pool, sizeof(struct statsd_cmd_sampling_rule));
+    rule->c = c;
+    (void) statsd_statsd_prepare_sampling(&(rule->sampling),
+      *((float *) c->argv[0]));
+
+    if (last == NULL) {
+      statsd_cmd_sampling_rules = rule;
+
+    } else {
+      last->next = rule;
+    }
+
+    last = rule;
+
+    c = find_config_next(c, c->next, CONF_PARAM, "StatsdCommandSampling",
+      FALSE);
+  }
+
+  statsd_cmd_sampling = pcalloc(session.pool,
+    sizeof(struct statsd_sampling *) * STATSD_MAX_CMD_IDS);
+  statsd_cmd_sampling_names = pr_table_alloc(session.pool, 0);
+
+  for (i = 0; statsd_sampling_cmds[i] != NULL; i++) {
+    int cmd_id;
+
+    cmd_id = pr_cmd_get_id(statsd_sampling_cmds[i]);
+    if (cmd_id <= 0 ||
+        cmd_id >= STATSD_MAX_CMD_IDS) {
+      continue;
+    }
+
+    statsd_cmd_sampling[cmd_id] = match_cmd_sampling(statsd_sampling_cmds[i]);
+  }
+}
+
+static const struct statsd_sampling *get_cmd_sampling(cmd_rec *cmd) {
+  const struct statsd_sampling *sampling;
+  const char *name;
+
+  if (statsd_cmd_sampling == NULL) {
+    return &statsd_default_sampling;
+  }
+
+  name = cmd->argv[0];
+
+  if (cmd->cmd_id > 0 &&
+      cmd->cmd_id < STATSD_MAX_CMD_IDS) {
+    sampling = statsd_cmd_sampling[cmd->cmd_id];
+    if (sampling == NULL) {
+      sampling = match_cmd_sampling(name);
+      statsd_cmd_sampling[cmd->cmd_id] = sampling;
+
+      pr_trace_msg(trace_channel, 17, "resolved sampling for '%s' to %g%%",
+        name, sampling->rate * 100.0);
+    }
+
+    return sampling;
+  }
+
+  sampling = pr_table_get(statsd_cmd_sampling_names, name, NULL);
+  if (sampling != NULL) {
+    return sampling;
+  }
+
+  sampling = match_cmd_sampling(name);
+
+  if (pr_table_count(statsd_cmd_sampling_names) < STATSD_MAX_SAMPLING_NAMES) {
+    (void) pr_table_add(statsd_cmd_sampling_names, pstrdup(session.pool, name),
+      sampling, sizeof(struct statsd_sampling));
+  }
+
+  return sampling;
+}
+
+/* Returns TRUE if StatsdTailSampling keeps the given command regardless of
+ * its sampling percentage.
+ */
+static int is_tail_cmd(cmd_rec *cmd, int had_error, const uint64_t *start_ms,
+    uint64_t now_ms) {
+  if (statsd_tail_sampling == FALSE) {
+    return FALSE;
+  }
+
+  if (had_error == TRUE) {
+    pr_trace_msg(trace_channel, 17, "keeping metrics for failed '%s'",
+      (char *) cmd->argv[0]);
+    return TRUE;
+  }
+
+  if (statsd_tail_slow_ms > 0 &&
+      start_ms != NULL &&
+      now_ms - *start_ms >= statsd_tail_slow_ms) {
+    pr_trace_msg(trace_channel, 17, "keeping metrics for slow '%s' (%lu ms)",
+      (char *) cmd->argv[0], (unsigned long) (now_ms - *start_ms));
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Returns the flags for metrics which are not subject to per-command
+ * sampling.  With whole-session sampling, these metrics only count the
+ * sampled sessions, and so carry the sampling rate like any other.
+ */
+static int get_ignore_sampling_flag(void) {
+  if (statsd_sampling_mode == STATSD_SAMPLING_MODE_SESSION) {
+    return 0;
+  }
+
+  return STATSD_METRIC_FL_IGNORE_SAMPLING;
+}
+
+/* Registers the session's metrics with fixed names, once the client is
+ * opened.
+ */
+static void register_fixed_metrics(void) {
+  register unsigned int i;
+
+  for (i = 0; i < STATSD_FIXED_COUNT; i++) {
+    int flags;
+
+    flags = statsd_fixed_metric_tab[i].flags;
+    if (flags & STATSD_METRIC_FL_IGNORE_SAMPLING) {
+      flags &= ~STATSD_METRIC_FL_IGNORE_SAMPLING;
+      flags |= get_ignore_sampling_flag();
+    }
+
+    statsd_fixed_metrics[i] = statsd_metric_register(statsd,
+      statsd_metric_pool, statsd_fixed_metric_tab[i].type,
+      statsd_fixed_metric_tab[i].name, flags);
+  }
+}
+
+/* Adjusts the "connection.unsampled" gauge, for a session not sampled by
+ * whole-session sampling.
+ */
+static void adjust_unsampled_gauge(int64_t val) {
+  if (statsd_unsampled_arena != NULL) {
+    (void) statsd_arena_add(statsd_unsampled_arena, STATSD_ARENA_TYPE_GAUGE,
+      statsd_unsampled_gauge, strlen(statsd_unsampled_gauge), val);
+    return;
+  }
+
+  if (statsd != NULL) {
+    statsd_metric_gauge(statsd, statsd_unsampled_gauge, val,
+      STATSD_METRIC_FL_GAUGE_ADJUST);
+    (void) statsd_statsd_flush(statsd);
+  }
+}
+
+/* Configuration handlers
+ */
+
+/* usage: StatsdCommandSampling percentage cmd1 ...
+ *        StatsdCommandSampling percentage "regex" pattern
+ */
+MODRET set_statsdcommandsampling(cmd_rec *cmd) {
+  register int i;
+  config_rec *c;
+  char *ptr = NULL;
+  float percentage, sampling;
+  pr_regex_t *pre = NULL;
+
+  if (cmd->argc < 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  percentage = strtof(cmd->argv[1], &ptr);
+  if (ptr && *ptr) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted percentage value: ",
+      cmd->argv[1], NULL));
+  }
+
+  if (percentage <= 0.0 ||
+      percentage > 100.0) {
+    CONF_ERROR(cmd, "percentage must be between 0 and 100");
+  }
+
+  sampling = percentage / 100.0;
+
+  if (strcasecmp(cmd->argv[2], "regex") == 0) {
+#if defined(PR_USE_REGEX)
+    char *pattern;
+    int res;
+
+    if (cmd->argc != 4) {
+      CONF_ERROR(cmd, "wrong number of parameters");
+    }
+
+    pre = pr_regexp_alloc(&statsd_module);
+
+    pattern = cmd->argv[3];
+    res = pr_regexp_compile(pre, pattern, REG_EXTENDED|REG_NOSUB|REG_ICASE);
+    if (res != 0) {
+      char errstr[256] = {'\0'};
+
+      pr_regexp_error(res, pre, errstr, sizeof(errstr));
+      pr_regexp_free(NULL, pre);
+
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", pattern,
+        "' failed regex compilation: ", errstr, NULL));
+    }
+
+    c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+#else
+    CONF_ERROR(cmd, "The regex StatsdCommandSampling parameter cannot be used "
+      "on this system, as you do not have POSIX compliant regex support");
+#endif /* PR_USE_REGEX */
+
+  } else {
+    c = add_config_param(cmd->argv[0], 0);
+    c->argc = cmd->argc;
+    c->argv = pcalloc(c->pool, (c->argc + 1) * sizeof(void *));
+
+    for (i = 2; i < cmd->argc; i++) {
+      c->argv[i] = pstrdup(c->pool, cmd->argv[i]);
+    }
+  }
+
+  c->argv[0] = palloc(c->pool, sizeof(float));
+  *((float *) c->argv[0]) = sampling;
+  c->argv[1] = (void *) pre;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdEngine on|off */
+MODRET set_statsdengine(cmd_rec *cmd) {
+  int engine = -1;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdExcludeFilter regex|"none" */
+MODRET set_statsdexcludefilter(cmd_rec *cmd) {
+#if defined(PR_USE_REGEX)
+  pr_regex_t *pre = NULL;
+  config_rec *c;
+  char *pattern;
+  int res;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (strcasecmp(cmd->argv[1], "none") == 0) {
+    (void) add_config_param(cmd->argv[0], 0);
+    return PR_HANDLED(cmd);
+  }
+
+  pre = pr_regexp_alloc(&statsd_module);
+
+  pattern = cmd->argv[1];
+  res = pr_regexp_compile(pre, pattern, REG_EXTENDED|REG_NOSUB);
+  if (res != 0) {
+    char errstr[256] = {'\0'};
+
+    pr_regexp_error(res, pre, errstr, sizeof(errstr));
+    pr_regexp_free(NULL, pre);
+
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "'", pattern,
+      "' failed regex compilation: ", errstr, NULL));
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, pattern);
+  c->argv[1] = (void *) pre;
+
+  return PR_HANDLED(cmd);
+#else
+  CONF_ERROR(cmd, "The StatsdExcludeFilter directive cannot be used on this "
+    "system, as you do not have POSIX compliant regex support");
+#endif /* PR_USE_REGEX */
+}
+
+/* usage: StatsdFlushInterval secs|"none" [fill-percent] */
+MODRET set_statsdflushinterval(cmd_rec *cmd) {
+  config_rec *c;
+  int interval = 0;
+  unsigned int fill_pct = STATSD_DEFAULT_FLUSH_FILL;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (strcasecmp(cmd->argv[1], "none") != 0) {
+    if (pr_str_get_duration(cmd->argv[1], &interval) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing interval value '",
+        cmd->argv[1], "': ", strerror(errno), NULL));
+    }
+  }
+
+  if (cmd->argc == 3) {
+    char *ptr = NULL;
+    unsigned long pct;
+
+    pct = strtoul(cmd->argv[2], &ptr, 10);
+    if (ptr && *ptr) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted fill value: ",
+        cmd->argv[2], NULL));
+    }
+
+    if (pct < 1 ||
+        pct > 100) {
+      CONF_ERROR(cmd, "fill must be between 1 and 100 percent");
+    }
+
+    fill_pct = pct;
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = interval;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = fill_pct;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdMaxMetricNames count|"none" */
+MODRET set_statsdmaxmetricnames(cmd_rec *cmd) {
+  config_rec *c;
+  unsigned int max_names = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "none") != 0) {
+    char *ptr = NULL;
+    unsigned long count;
+
+    count = strtoul(cmd->argv[1], &ptr, 10);
+    if (ptr && *ptr) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted count value: ",
+        cmd->argv[1], NULL));
+    }
+
+    if (count == 0 ||
+        count > STATSD_CARDINALITY_MAX_NAMES) {
+      char limits[64];
+
+      memset(limits, '\0', sizeof(limits));
+      pr_snprintf(limits, sizeof(limits)-1, "1 and %u",
+        (unsigned int) STATSD_CARDINALITY_MAX_NAMES);
+
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "count must be between ", limits,
+        NULL));
+    }
+
+    max_names = count;
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[0]) = max_names;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdMaxPacketSize size|"auto" */
+MODRET set_statsdmaxpacketsize(cmd_rec *cmd) {
+  config_rec *c;
+  size_t pktsz = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (strcasecmp(cmd->argv[1], "auto") != 0) {
+    char *ptr = NULL;
+    unsigned long size;
+
+    size = strtoul(cmd->argv[1], &ptr, 10);
+    if (ptr && *ptr) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted size value: ",
+        cmd->argv[1], NULL));
+    }
+
+    if (size < STATSD_MIN_PACKET_SIZE_LIMIT ||
+        size > STATSD_MAX_PACKET_SIZE_LIMIT) {
+      char limits[64];
+
+      memset(limits, '\0', sizeof(limits));
+      pr_snprintf(limits, sizeof(limits)-1, "%u and %u",
+        (unsigned int) STATSD_MIN_PACKET_SIZE_LIMIT,
+        (unsigned int) STATSD_MAX_PACKET_SIZE_LIMIT);
+
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "size must be between ", limits,
+        NULL));
+    }
+
+    pktsz = size;
+  }
+
+  /* Note that a size of zero indicates automatic sizing. */
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(size_t));
+  *((size_t *) c->argv[0]) = pktsz;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdOptions opt1 ... */
+MODRET set_statsdoptions(cmd_rec *cmd) {
+  config_rec *c = NULL;
+  register unsigned int i = 0;
+  unsigned long opts = 0UL;
+
+  if (cmd->argc-1 == 0) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+
+  for (i = 1; i < cmd->argc; i++) {
+    if (strcmp(cmd->argv[i], "SharedSocket") == 0) {
+      opts |= STATSD_OPT_SHARED_SOCKET;
+
+    } else if (strcmp(cmd->argv[i], "SharedCounters") == 0) {
+      opts |= STATSD_OPT_SHARED_COUNTERS;
+
+    } else if (strcmp(cmd->argv[i], "Relay") == 0) {
+      opts |= STATSD_OPT_RELAY;
+
+    } else if (strcmp(cmd->argv[i], "Aggregate") == 0) {
+      opts |= STATSD_OPT_AGGREGATE;
+
+    } else if (strcmp(cmd->argv[i], "SharedHistograms") == 0) {
+      opts |= STATSD_OPT_SHARED_HISTOGRAMS;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown StatsdOption '",
+        cmd->argv[i], "'", NULL));
+    }
+  }
+
+  c->argv[0] = pcalloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[0]) = opts;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdSampling percentage ["session"] */
+MODRET set_statsdsampling(cmd_rec *cmd) {
+  config_rec *c;
+  char *ptr = NULL;
+  float percentage, sampling;
+  int mode = STATSD_SAMPLING_MODE_COMMAND;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (cmd->argc == 3) {
+    if (strcasecmp(cmd->argv[2], "session") != 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unknown sampling mode: ",
+        cmd->argv[2], NULL));
+    }
+
+    mode = STATSD_SAMPLING_MODE_SESSION;
+  }
+
+  percentage = strtof(cmd->argv[1], &ptr);
+  if (ptr && *ptr) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted percentage value: ",
+      cmd->argv[1], NULL));
+  }
+
+  if (percentage <= 0.0 ||
+      percentage > 100.0) {
+    CONF_ERROR(cmd, "percentage must be between 0 and 100");
+  }
+
+  /* For easier computing of the sampling threshold, and for formatting
+   * the statsd metric values, we convert from a 1-100 value to 0.00-1.00.
+   */
+  sampling = percentage / 100.0;
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(float));
+  *((float *) c->argv[0]) = sampling;
+  c->argv[1] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = mode;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdServer [scheme://]host[:port] [prefix] [suffix]
+ *        StatsdServer unix://path [prefix] [suffix]
+ */
+MODRET set_statsdserver(cmd_rec *cmd) {
+  config_rec *c;
+  char *server, *ptr;
+  size_t server_len;
+  int port = STATSD_DEFAULT_PORT, scheme = STATSD_SCHEME_UDP;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 4) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  server = pstrdup(cmd->tmp_pool, cmd->argv[1]);
+
+  if (strncasecmp(server, "tcp://", 6) == 0) {
+    scheme = STATSD_SCHEME_TCP;
+    server += 6;
+
+  } else if (strncasecmp(server, "udp://", 6) == 0) {
+    scheme = STATSD_SCHEME_UDP;
+    server += 6;
+
+  } else if (strncasecmp(server, "unix://", 7) == 0) {
+    scheme = STATSD_SCHEME_UNIX;
+    server += 7;
+
+    if (*server != '/') {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "Unix domain socket path must be an absolute path: ", server, NULL));
+    }
+  }
+
+  server_len = strlen(server);
+
+  ptr = strrchr(server, ':');
+  if (ptr != NULL &&
+      scheme != STATSD_SCHEME_UNIX) {
+    /* We also need to check for IPv6 addresses, e.g. "[::1]" or "[::1]:8125",
+     * before assuming that the text following our discovered ':' is indeed
+     * a port number.
+     */
+
+    if (*server == '[') {
+      if (*(ptr-1) == ']') {
+        /* We have an IPv6 address with an explicit port number. */
+        server = pstrndup(cmd->tmp_pool, server + 1, (ptr - 1) - (server + 1));
+        *ptr = '\0';
+        port = atoi(ptr + 1);
+
+      } else if (server[server_len-1] == ']') {
+        /* We have an IPv6 address without an explicit port number. */
+        server = pstrndup(cmd->tmp_pool, server + 1, server_len - 2);
+        port = STATSD_DEFAULT_PORT;
+      }
+
+    } else {
+      *ptr = '\0';
+      port = atoi(ptr + 1);
+    }
+  }
+
+  /* Note that the resolved address, argv[5], is filled in by the daemon,
+   * after the configuration has been parsed.
+   */
+  c = add_config_param(cmd->argv[0], 6, NULL, NULL, NULL, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, server);
+  c->argv[1] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[1]) = port;
+  c->argv[2] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[2]) = scheme;
+
+  if (cmd->argc > 2) {
+    char *prefix;
+
+    prefix = cmd->argv[2];
+    if (*prefix) {
+      /* Automatically append a '.' here, to make construction of the metric
+       * name easier.
+       */
+      c->argv[3] = pstrcat(c->pool, prefix, ".", NULL);
+    }
+  }
+
+  if (cmd->argc == 4) {
+    char *suffix;
+
+    suffix = cmd->argv[3];
+    if (*suffix) {
+      /* Automatically prepend a '.' here, to make construction of the metric
+       * name easier.
+       */
+      c->argv[4] = pstrcat(c->pool, ".", suffix, NULL);
+    }
+  }
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdServerTTL secs|"none" */
+MODRET set_statsdserverttl(cmd_rec *cmd) {
+  config_rec *c;
+  int ttl = 0;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  if (strcasecmp(cmd->argv[1], "none") != 0) {
+    if (pr_str_get_duration(cmd->argv[1], &ttl) < 0) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "error parsing TTL value '",
+        cmd->argv[1], "': ", strerror(errno), NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = ttl;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdTailSampling on|off [slow-ms] */
+MODRET set_statsdtailsampling(cmd_rec *cmd) {
+  config_rec *c;
+  int engine;
+  unsigned long slow_ms = 0;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  if (cmd->argc == 3) {
+    char *ptr = NULL;
+
+    slow_ms = strtoul(cmd->argv[2], &ptr, 10);
+    if (ptr && *ptr) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "badly formatted slow-ms value: ",
+        cmd->argv[2], NULL));
+    }
+
+    if (slow_ms == 0) {
+      CONF_ERROR(cmd, "slow-ms must be greater than zero");
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[1]) = slow_ms;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: StatsdTimerSketch on|off [accuracy] */
+MODRET set_statsdtimersketch(cmd_rec *cmd) {
+  config_rec *c;
+  int engine;
+  float accuracy = STATSD_SKETCH_DEFAULT_ACCURACY;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  if (cmd->argc == 3) {
+    char *ptr = NULL;
+    float percentage;
+
+    percentage = strtof(cmd->argv[2], &ptr);
+    if (ptr && *ptr) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "badly formatted accuracy value: ", cmd->argv[2], NULL));
+    }
+
+    /* The accuracy is configured as a percentage, e.g. "1" for 1%. */
+    accuracy = percentage / 100.0;
+    if (accuracy < STATSD_SKETCH_MIN_ACCURACY ||
+        accuracy > STATSD_SKETCH_MAX_ACCURACY) {
+      char limits[64];
+
+      memset(limits, '\0', sizeof(limits));
+      pr_snprintf(limits, sizeof(limits)-1, "%g and %g",
+        STATSD_SKETCH_MIN_ACCURACY * 100.0,
+        STATSD_SKETCH_MAX_ACCURACY * 100.0);
+
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "accuracy must be between ",
+        limits, " percent", NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+  c->argv[1] = palloc(c->pool, sizeof(float));
+  *((float *) c->argv[1]) = accuracy;
+
+  return PR_HANDLED(cmd);
+}
+
+/* Command handlers
+ */
+
+/* Sends the pending metrics.  With a StatsdFlushInterval, the metrics are
+ * only sent once they fill enough of a packet; otherwise, they are left for
+ * the flush timer.
+ */
+static void flush_metrics(void) {
+  unsigned int fill_pct = 0;
+
+  if (statsd == NULL) {
+    return;
+  }
+
+  if (statsd_flush_interval > 0 &&
+      statsd_statsd_get_fill(statsd, &fill_pct) == 0 &&
+      fill_pct < statsd_flush_fill) {
+    pr_trace_msg(trace_channel, 29,
+      "pending metrics fill %u%% of packet, deferring flush", fill_pct);
+    return;
+  }
+
+  (void) statsd_statsd_flush(statsd);
+}
+
+static void log_tls_auth_metrics(cmd_rec *cmd, uint64_t now_ms,
+    const struct statsd_sampling *sampling) {
+  const uint64_t *start_ms;
+  char *protocol_env, *cipher_env;
+
+  write_fixed_metric_sampled(STATSD_FIXED_TLS_HANDSHAKE_COUNTER, 1, sampling);
+  write_fixed_metric_sampled(STATSD_FIXED_FTPS_COUNTER, 1, sampling);
+  write_fixed_metric_sampled(STATSD_FIXED_FTPS_GAUGE, 1, sampling);
+
+  start_ms = pr_table_get(cmd->notes, "start_ms", NULL);
+  if (start_ms != NULL) {
+    uint64_t handshake_ms;
+
+    handshake_ms = now_ms - *start_ms;
+    write_fixed_metric_sampled(STATSD_FIXED_TLS_HANDSHAKE_TIMER,
+      (int64_t) handshake_ms, sampling);
+  }
+
+  cipher_env = pr_env_get(cmd->tmp_pool, "TLS_CIPHER");
+  if (cipher_env != NULL) {
+    char *cipher_metric;
+
+    cipher_metric = get_tls_env_metric(cmd->tmp_pool, "cipher", cipher_env,
+      sampling);
+    (void) statsd_metric_write_sampled(statsd_metric_register(statsd,
+      cmd->tmp_pool, STATSD_METRIC_TYPE_COUNTER, cipher_metric, 0), 1,
+      sampling);
+  }
+
+  protocol_env = pr_env_get(cmd->tmp_pool, "TLS_PROTOCOL");
+  if (protocol_env != NULL) {
+    char *protocol_metric;
+
+    protocol_metric = get_tls_env_metric(cmd->tmp_pool, "protocol",
+      protocol_env, sampling);
+    (void) statsd_metric_write_sampled(statsd_metric_register(statsd,
+      cmd->tmp_pool, STATSD_METRIC_TYPE_COUNTER, protocol_metric, 0), 1,
+      sampling);
+  }
+}
+
+static void log_tls_metrics(cmd_rec *cmd, int had_error, uint64_t now_ms,
+    const struct statsd_sampling *sampling) {
+  if (pr_module_exists("mod_tls.c") != TRUE) {
+    return;
+  }
+
+  if (pr_cmd_cmp(cmd, PR_CMD_AUTH_ID) == 0 &&
+      cmd->argc == 2) {
+    char *tls_mode;
+
+    /* Find out if the args are one of the mod_tls (vs GSSAPI et al) ones. */
+
+    tls_mode = cmd->argv[1];
+    if (strcasecmp(tls_mode, "TLS") == 0 ||
+        strcasecmp(tls_mode, "TLS-C") == 0 ||
+        strcasecmp(tls_mode, "TLS-P") == 0 ||
+        strcasecmp(tls_mode, "SSL") == 0) {
+      /* We are only interested in tracking successful handshakes here; the
+       * failed handshakes are tracked elsewhere.
+       */
+      if (had_error == FALSE) {
+        log_tls_auth_metrics(cmd, now_ms, sampling);
+      }
+    }
+  }
+}
+
+static void log_cmd_metrics(cmd_rec *cmd, int had_error) {
+  struct statsd_cmd_metric *cm;
+  const uint64_t *start_ms = NULL;
+  uint64_t now_ms = 0;
+  const struct statsd_sampling *sampling;
+
+  if (statsd_engine == FALSE) {
+    return;
+  }
+
+  pr_gettimeofday_millis(&now_ms);
+
+  if (should_exclude(cmd) == TRUE) {
+    pr_trace_msg(trace_channel, 9,
+      "command '%s' excluded by StatsdExcludeFilter '%s'", (char *) cmd->argv[0],
+      statsd_exclude_filter);
+    return;
+  }
+
+  start_ms = pr_table_get(cmd->notes, "start_ms", NULL);
+
+  /* The shared histograms are cheap enough to not be subject to sampling. */
+  if (statsd_histogram != NULL &&
+      start_ms != NULL) {
+    (void) statsd_histogram_add(statsd_histogram, get_cmd_family(cmd),
+      now_ms - *start_ms);
+  }
+
+  /* A command with its own sampling percentage uses that percentage, both
+   * for the sampling decision and for the rate sent with its metrics.  The
+   * commands kept by tail sampling are sent with no rate, so that the
+   * counts remain unbiased.
+   */
+  sampling = get_cmd_sampling(cmd);
+  if (sampling->rate < 1.0 &&
+      is_tail_cmd(cmd, had_error, start_ms, now_ms) == TRUE) {
+    sampling = &statsd_full_sampling;
+  }
+
+  if (should_sample(sampling) != TRUE) {
+    pr_trace_msg(trace_channel, 28, "skipping sampling of metric for '%s'",
+      (char *) cmd->argv[0]);
+    return;
+  }
+
+  cm = get_cmd_metric(cmd, sampling);
+  if (cm != NULL) {
+    (void) statsd_metric_write_sampled(cm->counter, 1, sampling);
+  }
+
+  if (cm != NULL &&
+      start_ms != NULL) {
+    uint64_t response_ms;
+
+    response_ms = now_ms - *start_ms;
+    (void) statsd_metric_write_sampled(cm->timer, (int64_t) response_ms,
+      sampling);
+  }
+
+  log_tls_metrics(cmd, had_error, now_ms, sampling);
+
+  if (pr_cmd_cmp(cmd, PR_CMD_PASS_ID) == 0 &&
+      had_error == FALSE) {
+    const char *proto;
+
+    proto = pr_session_get_protocol(0);
+    if (strcmp(proto, "ftp") == 0) {
+      /* At this point in time, we are certain that we have a plain FTP
+       * connection, not FTPS or SFTP or anything else.
+       */
+      write_fixed_metric_sampled(STATSD_FIXED_FTP_COUNTER, 1, sampling);
+      write_fixed_metric_sampled(STATSD_FIXED_FTP_GAUGE, 1, sampling);
+    }
+  }
+
+  flush_metrics();
+}
+
+MODRET statsd_log_any(cmd_rec *cmd) {
+  log_cmd_metrics(cmd, FALSE);
+  return PR_DECLINED(cmd);
+}
+
+MODRET statsd_log_any_err(cmd_rec *cmd) {
+  log_cmd_metrics(cmd, TRUE);
+  return PR_DECLINED(cmd);
+}
+
+/* Data transfers may block for a long time; send any deferred metrics
+ * before the transfer starts.
+ */
+MODRET statsd_pre_xfer(cmd_rec *cmd) {
+  if (statsd_engine == FALSE ||
+      statsd == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  (void) statsd_statsd_flush(statsd);
+  return PR_DECLINED(cmd);
+}
+
+/* Event handlers
+ */
+
+static void statsd_exit_ev(const void *event_data, void *user_data) {
+  if (statsd_sess_sampled == FALSE) {
+    adjust_unsampled_gauge(-1);
+
+    if (statsd != NULL) {
+      statsd_statsd_close(statsd);
+      statsd = NULL;
+    }
+
+    return;
+  }
+
+  if (statsd != NULL) {
+    char *metric;
+    unsigned char *authenticated;
+
+    write_fixed_metric(STATSD_FIXED_CONN_GAUGE, -1);
+
+    authenticated = get_param_ptr(main_server->conf, "authenticated", FALSE);
+    if (authenticated != NULL &&
+        *authenticated == TRUE) {
+      const char *proto;
+      uint64_t now_ms = 0, sess_ms;
+
+      proto = pr_session_get_protocol(0);
+      metric = get_conn_metric(session.pool, proto);
+      statsd_metric_gauge(statsd, metric, -1, STATSD_METRIC_FL_GAUGE_ADJUST);
+
+      pr_gettimeofday_millis(&now_ms);
+      sess_ms = now_ms - statsd_sess_start_ms;
+      statsd_metric_timer(statsd, metric, sess_ms, 0);
+    }
+
+    if (statsd_sql_conn_count > 0) {
+      metric = get_conn_metric(session.pool, "sql");
+      statsd_metric_gauge(statsd, metric, statsd_sql_conn_count * -1,
+        STATSD_METRIC_FL_GAUGE_ADJUST);
+      statsd_sql_conn_count = 0;
+    }
+
+    statsd_metric_flush(statsd);
+    clear_metric_handles();
+    statsd_statsd_close(statsd);
+    statsd = NULL;
+  }
+}
+
+static void statsd_log_ev(const void *event_data, void *user_data) {
+  const pr_log_event_t *le;
+  unsigned int idx = STATSD_FIXED_LOG_UNKNOWN;
+
+  le = event_data;
+
+  /* Unlike other common metrics, for now the log level counters are NOT
+   * subject to the sampling frequency.
+   */
+
+  if (le->log_level >= PR_LOG_EMERG &&
+      le->log_level <= PR_LOG_DEBUG) {
+    idx = le->log_level;
+  }
+
+  write_fixed_metric(idx, 1);
+}
+
+#if defined(PR_SHARED_MODULE)
+static void statsd_mod_unload_ev(const void *event_data, void *user_data) {
+  if (strcmp("mod_statsd.c", (const char *) event_data) == 0) {
+    pr_event_unregister(&statsd_module, NULL, NULL);
+    (void) pr_timer_remove(-1, &statsd_module);
+  }
+}
+#endif /* PR_SHARED_MODULE */
+
+/* Resolves the StatsdServer address for each server, updating the address
+ * which sessions will use.  If resolution fails, the last successfully
+ * resolved address, if any, continues to be used.
+ */
+static void resolve_statsd_servers(void) {
+  server_rec *s;
+  pool *tmp_pool;
+
+  tmp_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(tmp_pool, "Statsd resolver pool");
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    const char *host;
+    const pr_netaddr_t *addr;
+    pr_netaddr_t *resolved;
+    int engine, port;
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    engine = *((int *) c->argv[0]);
+    if (engine == FALSE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdServer", FALSE);
+    if (c == NULL ||
+        *((int *) c->argv[2]) == STATSD_SCHEME_UNIX) {
+      continue;
+    }
+
+    host = c->argv[0];
+    port = *((int *) c->argv[1]);
+    resolved = c->argv[5];
+
+    /* Make sure we actually ask the resolver again, rather than using our
+     * cached address.
+     */
+    pr_netaddr_clear_ipcache(host);
+
+    addr = pr_netaddr_get_addr(tmp_pool, host, NULL);
+    if (addr == NULL) {
+      if (resolved != NULL) {
+        pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+          ": Server %s: error resolving '%s' to IP address: %s; using "
+          "previously resolved address %s", s->ServerName, host,
+          strerror(errno), pr_netaddr_get_ipstr(resolved));
+
+      } else {
+        pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+          ": Server %s: error resolving '%s' to IP address: %s",
+          s->ServerName, host, strerror(errno));
+      }
+
+      continue;
+    }
+
+    if (resolved == NULL) {
+      resolved = pr_netaddr_dup(c->pool, addr);
+      c->argv[5] = resolved;
+
+    } else {
+      /* Update the existing address in place, rather than allocating a new
+       * one each time.
+       */
+      pr_netaddr_set_family(resolved, pr_netaddr_get_family(addr));
+      pr_netaddr_set_sockaddr(resolved, pr_netaddr_get_sockaddr(addr));
+    }
+
+    pr_netaddr_set_port2(resolved, port);
+    pr_trace_msg(trace_channel, 9, "resolved StatsdServer '%s' to %s#%d",
+      host, pr_netaddr_get_ipstr(resolved), port);
+  }
+
+  destroy_pool(tmp_pool);
+}
+
+/* Returns the key identifying the given StatsdServer, for its shared socket
+ * and/or arena.
+ */
+static const char *get_server_key(pool *p, config_rec *c) {
+  int scheme;
+  char port[32];
+
+  scheme = *((int *) c->argv[2]);
+  if (scheme == STATSD_SCHEME_UNIX) {
+    return pstrcat(p, "unix://", c->argv[0], NULL);
+  }
+
+  memset(port, '\0', sizeof(port));
+  pr_snprintf(port, sizeof(port)-1, "%d", *((int *) c->argv[1]));
+  return pstrcat(p, scheme == STATSD_SCHEME_TCP ? "tcp://" : "udp://",
+    c->argv[0], ":", port, NULL);
+}
+
+static struct statsd_socket *find_socket(struct statsd_socket *socks,
+    const char *key) {
+  struct statsd_socket *sock;
+
+  for (sock = socks; sock != NULL; sock = sock->next) {
+    if (strcmp(sock->key, key) == 0) {
+      return sock;
+    }
+  }
+
+  return NULL;
+}
+
+/* Opens the sockets to be shared by the sessions, reusing the existing
+ * sockets when possible, and closing any which are no longer needed, e.g.
+ * due to a changed configuration or a newly resolved address.
+ */
+static void share_statsd_sockets(void) {
+  server_rec *s;
+  pool *sock_pool;
+  struct statsd_socket *socks = NULL, *sock;
+
+  sock_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(sock_pool, "Statsd shared sockets pool");
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    const char *key, *path = NULL;
+    const pr_netaddr_t *addr = NULL;
+    unsigned long opts;
+    int engine, fd;
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    engine = *((int *) c->argv[0]);
+    if (engine == FALSE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdOptions", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    opts = *((unsigned long *) c->argv[0]);
+    if (!(opts & STATSD_OPT_SHARED_SOCKET)) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdServer", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    if (*((int *) c->argv[2]) == STATSD_SCHEME_TCP) {
+      pr_log_debug(DEBUG5, MOD_STATSD_VERSION
+        ": Server %s: SharedSocket StatsdOption not supported for TCP, "
+        "ignoring", s->ServerName);
+      continue;
+    }
+
+    key = get_server_key(sock_pool, c);
+
+    /* Multiple servers may use the same statsd server, and thus socket. */
+    if (find_socket(socks, key) != NULL) {
+      continue;
+    }
+
+    if (*((int *) c->argv[2]) == STATSD_SCHEME_UNIX) {
+      path = c->argv[0];
+
+    } else {
+      addr = c->argv[5];
+      if (addr == NULL) {
+        /* Not resolved; sessions will try for themselves. */
+        continue;
+      }
+    }
+
+    fd = -1;
+
+    sock = find_socket(statsd_sockets, key);
+    if (sock != NULL &&
+        sock->fd >= 0 &&
+        (path != NULL || pr_netaddr_cmp(sock->addr, addr) == 0)) {
+      /* Keep using the existing socket. */
+      fd = sock->fd;
+      sock->fd = -1;
+
+    } else {
+      fd = statsd_statsd_open_socket(addr, path);
+      if (fd < 0) {
+        pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+          ": Server %s: error opening shared socket for %s: %s",
+          s->ServerName, key, strerror(errno));
+
+        if (sock != NULL &&
+            sock->fd >= 0) {
+          /* Better the old socket than none at all. */
+          fd = sock->fd;
+          sock->fd = -1;
+        }
+
+      } else {
+        pr_trace_msg(trace_channel, 9, "opened shared socket (fd %d) for %s",
+          fd, key);
+      }
+    }
+
+    if (fd < 0) {
+      continue;
+    }
+
+    sock = pcalloc(sock_pool, sizeof(struct statsd_socket));
+    sock->key = key;
+    if (addr != NULL) {
+      sock->addr = pr_netaddr_dup(sock_pool, addr);
+    }
+    sock->fd = fd;
+    sock->next = socks;
+    socks = sock;
+  }
+
+  /* Close any sockets which we no longer need. */
+  for (sock = statsd_sockets; sock != NULL; sock = sock->next) {
+    if (sock->fd >= 0) {
+      pr_trace_msg(trace_channel, 9, "closing shared socket (fd %d) for %s",
+        sock->fd, sock->key);
+      (void) close(sock->fd);
+    }
+  }
+
+  if (statsd_socket_pool != NULL) {
+    destroy_pool(statsd_socket_pool);
+  }
+
+  statsd_socket_pool = sock_pool;
+  statsd_sockets = socks;
+}
+
+static struct statsd_shared_arena *find_arena(
+    struct statsd_shared_arena *arenas, const char *key) {
+  struct statsd_shared_arena *sa;
+
+  for (sa = arenas; sa != NULL; sa = sa->next) {
+    if (strcmp(sa->key, key) == 0) {
+      return sa;
+    }
+  }
+
+  return NULL;
+}
+
+/* Folds the arena, sending the aggregated metrics using the daemon's client,
+ * which is opened as needed.  If the client cannot be opened, the metrics
+ * remain in the arena, for the next fold.
+ */
+static void fold_shared_arena(struct statsd_shared_arena *sa) {
+  if (sa->statsd == NULL) {
+    if (sa->path != NULL) {
+      sa->statsd = statsd_statsd_open_unix(sa->pool, sa->path, 1.0, NULL,
+        NULL);
+
+    } else {
+      sa->statsd = statsd_statsd_open(sa->pool, sa->addr, sa->use_tcp, 1.0,
+        NULL, NULL);
+    }
+
+    if (sa->statsd == NULL) {
+      pr_trace_msg(trace_channel, 3,
+        "error opening statsd connection to %s: %s", sa->key,
+        strerror(errno));
+      return;
+    }
+  }
+
+  if (statsd_arena_fold(sa->arena, sa->statsd) < 0) {
+    pr_trace_msg(trace_channel, 3, "error folding arena for %s: %s", sa->key,
+      strerror(errno));
+  }
+}
+
+static void destroy_shared_arena(struct statsd_shared_arena *sa) {
+  fold_shared_arena(sa);
+
+  if (sa->statsd != NULL) {
+    statsd_statsd_close(sa->statsd);
+    sa->statsd = NULL;
+  }
+
+  pr_trace_msg(trace_channel, 9, "destroying shared arena for %s", sa->key);
+  (void) statsd_arena_destroy(sa->arena);
+  destroy_pool(sa->pool);
+}
+
+/* Creates the arenas to be shared by the sessions, keeping the existing
+ * arenas when possible, and destroying any which are no longer needed.
+ */
+static void share_statsd_arenas(void) {
+  server_rec *s;
+  pool *tmp_pool;
+  struct statsd_shared_arena *arenas = NULL, *sa, **prev;
+
+  tmp_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(tmp_pool, "Statsd shared arenas pool");
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    const char *key;
+    const pr_netaddr_t *addr = NULL;
+    unsigned long opts;
+    int engine, scheme;
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    engine = *((int *) c->argv[0]);
+    if (engine == FALSE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdOptions", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    opts = *((unsigned long *) c->argv[0]);
+    if (!(opts & STATSD_OPT_SHARED_COUNTERS)) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdServer", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    /* Multiple servers may use the same statsd server, and thus arena. */
+    key = get_server_key(tmp_pool, c);
+    if (find_arena(arenas, key) != NULL) {
+      continue;
+    }
+
+    scheme = *((int *) c->argv[2]);
+    if (scheme != STATSD_SCHEME_UNIX) {
+      addr = c->argv[5];
+      if (addr == NULL) {
+        /* Not resolved; sessions will send their metrics themselves. */
+        continue;
+      }
+    }
+
+    /* Keep using the existing arena, if any. */
+    for (prev = &statsd_arenas, sa = statsd_arenas; sa != NULL;
+         prev = &(sa->next), sa = sa->next) {
+      if (strcmp(sa->key, key) == 0) {
+        *prev = sa->next;
+        break;
+      }
+    }
+
+    if (sa == NULL) {
+      pool *arena_pool;
+      struct statsd_arena *arena;
+
+      arena_pool = make_sub_pool(permanent_pool);
+      pr_pool_tag(arena_pool, "Statsd shared arena pool");
+
+      arena = statsd_arena_create(arena_pool, 0);
+      if (arena == NULL) {
+        pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+          ": Server %s: error creating shared arena for %s: %s",
+          s->ServerName, key, strerror(errno));
+        destroy_pool(arena_pool);
+        continue;
+      }
+
+      sa = pcalloc(arena_pool, sizeof(struct statsd_shared_arena));
+      sa->pool = arena_pool;
+      sa->key = pstrdup(arena_pool, key);
+      sa->arena = arena;
+      sa->use_tcp = (scheme == STATSD_SCHEME_TCP) ? TRUE : FALSE;
+      if (scheme == STATSD_SCHEME_UNIX) {
+        sa->path = pstrdup(arena_pool, c->argv[0]);
+      }
+
+      pr_trace_msg(trace_channel, 9,
+        "created shared arena (%u shards) for %s",
+        statsd_arena_get_shard_count(arena), key);
+    }
+
+    if (addr != NULL &&
+        (sa->addr == NULL || pr_netaddr_cmp(sa->addr, addr) != 0)) {
+      /* The address changed; reopen our client, when next needed. */
+      if (sa->statsd != NULL) {
+        statsd_statsd_close(sa->statsd);
+        sa->statsd = NULL;
+      }
+
+      sa->addr = pr_netaddr_dup(sa->pool, addr);
+    }
+
+    sa->next = arenas;
+    arenas = sa;
+  }
+
+  /* Destroy any arenas which we no longer need. */
+  sa = statsd_arenas;
+  while (sa != NULL) {
+    struct statsd_shared_arena *next;
+
+    next = sa->next;
+    destroy_shared_arena(sa);
+    sa = next;
+  }
+
+  statsd_arenas = arenas;
+  destroy_pool(tmp_pool);
+}
+
+static void fold_statsd_arenas(void) {
+  struct statsd_shared_arena *sa;
+
+  for (sa = statsd_arenas; sa != NULL; sa = sa->next) {
+    fold_shared_arena(sa);
+  }
+}
+
+/* Histograms are keyed by the StatsdServer, and its prefix and suffix, as
+ * those determine the names of the metrics sent.
+ */
+static const char *get_histogram_key(pool *p, config_rec *c) {
+  return pstrcat(p, get_server_key(p, c), " ",
+    c->argv[3] ? (char *) c->argv[3] : "", " ",
+    c->argv[4] ? (char *) c->argv[4] : "", NULL);
+}
+
+static struct statsd_shared_histogram *find_histogram(
+    struct statsd_shared_histogram *hists, const char *key) {
+  struct statsd_shared_histogram *sh;
+
+  for (sh = hists; sh != NULL; sh = sh->next) {
+    if (strcmp(sh->key, key) == 0) {
+      return sh;
+    }
+  }
+
+  return NULL;
+}
+
+/* Folds the histograms, sending their percentiles using the daemon's client,
+ * which is opened as needed.  If the client cannot be opened, the timings
+ * remain in the histograms, for the next fold.
+ */
+static void fold_shared_histogram(struct statsd_shared_histogram *sh) {
+  register unsigned int i;
+
+  if (sh->statsd == NULL) {
+    if (sh->path != NULL) {
+      sh->statsd = statsd_statsd_open_unix(sh->pool, sh->path, 1.0,
+        sh->prefix, sh->suffix);
+
+    } else {
+      sh->statsd = statsd_statsd_open(sh->pool, sh->addr, sh->use_tcp, 1.0,
+        sh->prefix, sh->suffix);
+    }
+
+    if (sh->statsd == NULL) {
+      pr_trace_msg(trace_channel, 3,
+        "error opening statsd connection to %s: %s", sh->key,
+        strerror(errno));
+      return;
+    }
+  }
+
+  for (i = 0; i < STATSD_CMD_FAMILY_COUNT; i++) {
+    if (statsd_histogram_fold(sh->hist, i, sh->statsd,
+        statsd_cmd_families[i].name) < 0) {
+      pr_trace_msg(trace_channel, 3, "error folding histogram %s for %s: %s",
+        statsd_cmd_families[i].name, sh->key, strerror(errno));
+    }
+  }
+
+  statsd_statsd_flush(sh->statsd);
+}
+
+static void destroy_shared_histogram(struct statsd_shared_histogram *sh) {
+  fold_shared_histogram(sh);
+
+  if (sh->statsd != NULL) {
+    statsd_statsd_close(sh->statsd);
+    sh->statsd = NULL;
+  }
+
+  pr_trace_msg(trace_channel, 9, "destroying shared histograms for %s",
+    sh->key);
+  (void) statsd_histogram_destroy(sh->hist);
+  destroy_pool(sh->pool);
+}
+
+/* Creates the histograms to be shared by the sessions, keeping the existing
+ * histograms when possible, and destroying any which are no longer needed.
+ */
+static void share_statsd_histograms(void) {
+  server_rec *s;
+  pool *tmp_pool;
+  struct statsd_shared_histogram *hists = NULL, *sh, **prev;
+
+  tmp_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(tmp_pool, "Statsd shared histograms pool");
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    const char *key;
+    const pr_netaddr_t *addr = NULL;
+    unsigned long opts;
+    int engine, scheme;
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    engine = *((int *) c->argv[0]);
+    if (engine == FALSE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdOptions", FALSE);
+    if (c == NULL) {
+      continue;
+    }
 
-  } else if (strncasecmp(server, "udp://", 6) == 0) {
-    use_tcp = FALSE;
-    server += 6;
-  }
+    opts = *((unsigned long *) c->argv[0]);
+    if (!(opts & STATSD_OPT_SHARED_HISTOGRAMS)) {
+      continue;
+    }
 
-  server_len = strlen(server);
+    c = find_config(s->conf, CONF_PARAM, "StatsdServer", FALSE);
+    if (c == NULL) {
+      continue;
+    }
 
-  ptr = strrchr(server, ':');
-  if (ptr != NULL) {
-    /* We also need to check for IPv6 addresses, e.g. "[::1]" or "[::1]:8125",
-     * before assuming that the text following our discovered ':' is indeed
-     * a port number.
-     */
+    key = get_histogram_key(tmp_pool, c);
+    if (find_histogram(hists, key) != NULL) {
+      continue;
+    }
 
-    if (*server == '[') {
-      if (*(ptr-1) == ']') {
-        /* We have an IPv6 address with an explicit port number. */
-        server = pstrndup(cmd->tmp_pool, server + 1, (ptr - 1) - (server + 1));
-        *ptr = '\0';
-        port = atoi(ptr + 1);
+    scheme = *((int *) c->argv[2]);
+    if (scheme != STATSD_SCHEME_UNIX) {
+      addr = c->argv[5];
+      if (addr == NULL) {
+        /* Not resolved; there is no one to send the percentiles to. */
+        continue;
+      }
+    }
 
-      } else if (server[server_len-1] == ']') {
-        /* We have an IPv6 address without an explicit port number. */
-        server = pstrndup(cmd->tmp_pool, server + 1, server_len - 2);
-        port = STATSD_DEFAULT_PORT;
+    /* Keep using the existing histograms, if any. */
+    for (prev = &statsd_histograms, sh = statsd_histograms; sh != NULL;
+         prev = &(sh->next), sh = sh->next) {
+      if (strcmp(sh->key, key) == 0) {
+        *prev = sh->next;
+        break;
+      }
+    }
+
+    if (sh == NULL) {
+      pool *hist_pool;
+      struct statsd_histogram *hist;
+
+      hist_pool = make_sub_pool(permanent_pool);
+      pr_pool_tag(hist_pool, "Statsd shared histogram pool");
+
+      hist = statsd_histogram_create(hist_pool, STATSD_CMD_FAMILY_COUNT);
+      if (hist == NULL) {
+        pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+          ": Server %s: error creating shared histograms for %s: %s",
+          s->ServerName, key, strerror(errno));
+        destroy_pool(hist_pool);
+        continue;
       }
 
-    } else {
-      *ptr = '\0';
-      port = atoi(ptr + 1);
+      sh = pcalloc(hist_pool, sizeof(struct statsd_shared_histogram));
+      sh->pool = hist_pool;
+      sh->key = pstrdup(hist_pool, key);
+      sh->hist = hist;
+      sh->use_tcp = (scheme == STATSD_SCHEME_TCP) ? TRUE : FALSE;
+      if (scheme == STATSD_SCHEME_UNIX) {
+        sh->path = pstrdup(hist_pool, c->argv[0]);
+      }
+
+      if (c->argv[3] != NULL) {
+        sh->prefix = pstrdup(hist_pool, c->argv[3]);
+      }
+
+      if (c->argv[4] != NULL) {
+        sh->suffix = pstrdup(hist_pool, c->argv[4]);
+      }
+
+      pr_trace_msg(trace_channel, 9, "created shared histograms for %s", key);
+    }
+
+    if (addr != NULL &&
+        (sh->addr == NULL || pr_netaddr_cmp(sh->addr, addr) != 0)) {
+      /* The address changed; reopen our client, when next needed. */
+      if (sh->statsd != NULL) {
+        statsd_statsd_close(sh->statsd);
+        sh->statsd = NULL;
+      }
+
+      sh->addr = pr_netaddr_dup(sh->pool, addr);
     }
+
+    sh->next = hists;
+    hists = sh;
   }
 
-  c = add_config_param(cmd->argv[0], 5, NULL, NULL, NULL, NULL, NULL);
-  c->argv[0] = pstrdup(c->pool, server);
-  c->argv[1] = palloc(c->pool, sizeof(int));
-  *((int *) c->argv[1]) = port;
-  c->argv[2] = pcalloc(c->pool, sizeof(int));
-  *((int *) c->argv[2]) = use_tcp;
+  /* Destroy any histograms which we no longer need. */
+  sh = statsd_histograms;
+  while (sh != NULL) {
+    struct statsd_shared_histogram *next;
 
-  if (cmd->argc > 2) {
-    char *prefix;
+    next = sh->next;
+    destroy_shared_histogram(sh);
+    sh = next;
+  }
 
-    prefix = cmd->argv[2];
-    if (*prefix) {
-      /* Automatically append a '.' here, to make construction of the metric
-       * name easier.
-       */
-      c->argv[3] = pstrcat(c->pool, prefix, ".", NULL);
-    }
+  statsd_histograms = hists;
+  destroy_pool(tmp_pool);
+}
+
+static void fold_statsd_histograms(void) {
+  struct statsd_shared_histogram *sh;
+
+  for (sh = statsd_histograms; sh != NULL; sh = sh->next) {
+    fold_shared_histogram(sh);
   }
+}
 
-  if (cmd->argc == 4) {
-    char *suffix;
+static struct statsd_relay_conn *find_relay_conn(
+    struct statsd_relay_conn *conns, const char *key) {
+  struct statsd_relay_conn *conn;
 
-    suffix = cmd->argv[3];
-    if (*suffix) {
-      /* Automatically prepend a '.' here, to make construction of the metric
-       * name easier.
-       */
-      c->argv[4] = pstrcat(c->pool, ".", suffix, NULL);
+  for (conn = conns; conn != NULL; conn = conn->next) {
+    if (strcmp(conn->key, key) == 0) {
+      return conn;
     }
   }
 
-  return PR_HANDLED(cmd);
+  return NULL;
 }
 
-/* Command handlers
+/* Opens the sockets between the sessions and the relay, keeping the existing
+ * sockets when possible, and closing any which are no longer needed.  Returns
+ * TRUE if the relay needs to be restarted, e.g. due to a new StatsdServer,
+ * or a newly resolved address.
  */
+static int share_statsd_relay_conns(void) {
+  server_rec *s;
+  pool *tmp_pool;
+  struct statsd_relay_conn *conns = NULL, *conn, **prev;
+  int changed = FALSE;
 
-static void log_tls_auth_metrics(cmd_rec *cmd, uint64_t now_ms) {
-  const uint64_t *start_ms;
-  char *handshake_metric, *proto_metric, *protocol_env, *cipher_env;
+  tmp_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(tmp_pool, "Statsd relay pool");
 
-  handshake_metric = get_tls_metric(cmd->tmp_pool, "handshake.ctrl");
-  statsd_metric_counter(statsd, handshake_metric, 1, 0);
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    config_rec *c;
+    const char *key;
+    const pr_netaddr_t *addr = NULL;
+    unsigned long opts;
+    int engine, scheme;
+    size_t max_pktsz = 0;
 
-  proto_metric = get_conn_metric(cmd->tmp_pool, "ftps");
-  statsd_metric_counter(statsd, proto_metric, 1, 0);
-  statsd_metric_gauge(statsd, proto_metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
+    c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
+    if (c == NULL) {
+      continue;
+    }
 
-  start_ms = pr_table_get(cmd->notes, "start_ms", NULL);
-  if (start_ms != NULL) {
-    uint64_t handshake_ms;
+    engine = *((int *) c->argv[0]);
+    if (engine == FALSE) {
+      continue;
+    }
 
-    handshake_ms = now_ms - *start_ms;
-    statsd_metric_timer(statsd, handshake_metric, handshake_ms, 0);
+    c = find_config(s->conf, CONF_PARAM, "StatsdOptions", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    opts = *((unsigned long *) c->argv[0]);
+    if (!(opts & STATSD_OPT_RELAY)) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdMaxPacketSize", FALSE);
+    if (c != NULL) {
+      max_pktsz = *((size_t *) c->argv[0]);
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "StatsdServer", FALSE);
+    if (c == NULL) {
+      continue;
+    }
+
+    /* Multiple servers may use the same statsd server, and thus relay
+     * socket.
+     */
+    key = get_server_key(tmp_pool, c);
+    if (find_relay_conn(conns, key) != NULL) {
+      continue;
+    }
+
+    scheme = *((int *) c->argv[2]);
+    if (scheme != STATSD_SCHEME_UNIX) {
+      addr = c->argv[5];
+      if (addr == NULL) {
+        /* Not resolved; sessions will send their metrics themselves. */
+        continue;
+      }
+    }
+
+    /* Keep using the existing sockets, if any. */
+    for (prev = &statsd_relay_conns, conn = statsd_relay_conns; conn != NULL;
+         prev = &(conn->next), conn = conn->next) {
+      if (strcmp(conn->key, key) == 0) {
+        *prev = conn->next;
+        break;
+      }
+    }
+
+    if (conn == NULL) {
+      pool *conn_pool;
+      int fds[2];
+
+      if (statsd_relay_open(fds) < 0) {
+        pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+          ": Server %s: error opening relay socket for %s: %s", s->ServerName,
+          key, strerror(errno));
+        continue;
+      }
+
+      conn_pool = make_sub_pool(permanent_pool);
+      pr_pool_tag(conn_pool, "Statsd relay socket pool");
+
+      conn = pcalloc(conn_pool, sizeof(struct statsd_relay_conn));
+      conn->pool = conn_pool;
+      conn->key = pstrdup(conn_pool, key);
+      conn->fds[0] = fds[0];
+      conn->fds[1] = fds[1];
+      conn->use_tcp = (scheme == STATSD_SCHEME_TCP) ? TRUE : FALSE;
+      if (scheme == STATSD_SCHEME_UNIX) {
+        conn->path = pstrdup(conn_pool, c->argv[0]);
+      }
+
+      changed = TRUE;
+    }
+
+    if (addr != NULL &&
+        (conn->addr == NULL || pr_netaddr_cmp(conn->addr, addr) != 0)) {
+      conn->addr = pr_netaddr_dup(conn->pool, addr);
+      changed = TRUE;
+    }
+
+    if (conn->max_pktsz != max_pktsz) {
+      conn->max_pktsz = max_pktsz;
+      changed = TRUE;
+    }
+
+    conn->next = conns;
+    conns = conn;
   }
 
-  cipher_env = pr_env_get(cmd->tmp_pool, "TLS_CIPHER");
-  if (cipher_env != NULL) {
-    char *cipher_metric;
+  /* Close any sockets which we no longer need. */
+  conn = statsd_relay_conns;
+  while (conn != NULL) {
+    struct statsd_relay_conn *next;
+
+    next = conn->next;
+    pr_trace_msg(trace_channel, 9, "closing relay socket for %s", conn->key);
+    (void) close(conn->fds[0]);
+    (void) close(conn->fds[1]);
+    destroy_pool(conn->pool);
+    changed = TRUE;
+    conn = next;
+  }
+
+  statsd_relay_conns = conns;
+  destroy_pool(tmp_pool);
+  return changed;
+}
 
-    cipher_metric = get_tls_metric(cmd->tmp_pool,
-      pstrcat(cmd->tmp_pool, "cipher.", cipher_env, NULL));
-    statsd_metric_counter(statsd, cipher_metric, 1, 0);
+static void stop_statsd_relay(void) {
+  if (statsd_relay_pid <= 0) {
+    return;
   }
 
-  protocol_env = pr_env_get(cmd->tmp_pool, "TLS_PROTOCOL");
-  if (protocol_env != NULL) {
-    char *protocol_metric;
+  pr_trace_msg(trace_channel, 9, "stopping relay process (PID %lu)",
+    (unsigned long) statsd_relay_pid);
+
+  if (kill(statsd_relay_pid, SIGTERM) == 0) {
+    /* The daemon may have already reaped the process for us. */
+    while (waitpid(statsd_relay_pid, NULL, 0) < 0) {
+      if (errno != EINTR) {
+        break;
+      }
+    }
+  }
+
+  statsd_relay_pid = 0;
+}
 
-    protocol_metric = get_tls_metric(cmd->tmp_pool,
-      pstrcat(cmd->tmp_pool, "protocol.", protocol_env, NULL));
-    statsd_metric_counter(statsd, protocol_metric, 1, 0);
+static int is_statsd_relay_running(void) {
+  if (statsd_relay_pid <= 0) {
+    return FALSE;
+  }
+
+  /* Sessions may not have the privileges to signal the relay; that it
+   * exists is enough.
+   */
+  if (kill(statsd_relay_pid, 0) < 0 &&
+      errno == ESRCH) {
+    return FALSE;
   }
+
+  return TRUE;
 }
 
-static void log_tls_metrics(cmd_rec *cmd, int had_error, uint64_t now_ms) {
-  if (pr_module_exists("mod_tls.c") != TRUE) {
+/* Closes the descriptors from lowfd to highfd, inclusive. */
+static void close_fd_range(int lowfd, int highfd) {
+  int fd;
+
+#if defined(HAVE_CLOSE_RANGE)
+  if (close_range((unsigned int) lowfd, (unsigned int) highfd, 0) == 0) {
     return;
   }
+#endif /* HAVE_CLOSE_RANGE */
 
-  if (pr_cmd_cmp(cmd, PR_CMD_AUTH_ID) == 0 &&
-      cmd->argc == 2) {
-    char *tls_mode;
+  for (fd = lowfd; fd <= highfd; fd++) {
+    (void) close(fd);
+  }
+}
 
-    /* Find out if the args are one of the mod_tls (vs GSSAPI et al) ones. */
+/* The relay needs only its own sockets, i.e. those given.  It does not
+ * accept connections, nor use the shared sockets, nor the sessions' end of
+ * the relay sockets; nor should it keep e.g. the scoreboard open.
+ */
+static void close_relay_fds(const int *keep, unsigned int nkeep) {
+  register unsigned int i;
+  server_rec *s;
+  struct statsd_relay_conn *conn;
+  struct statsd_socket *sock;
+  int lowfd = 3;
 
-    tls_mode = cmd->argv[1];
-    if (strcasecmp(tls_mode, "TLS") == 0 ||
-        strcasecmp(tls_mode, "TLS-C") == 0 ||
-        strcasecmp(tls_mode, "TLS-P") == 0 ||
-        strcasecmp(tls_mode, "SSL") == 0) {
-      /* We are only interested in tracking successful handshakes here; the
-       * failed handshakes are tracked elsewhere.
-       */
-      if (had_error == FALSE) {
-        log_tls_auth_metrics(cmd, now_ms);
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    if (s->listen != NULL &&
+        s->listen->listen_fd >= 0) {
+      (void) close(s->listen->listen_fd);
+    }
+  }
+
+  for (conn = statsd_relay_conns; conn != NULL; conn = conn->next) {
+    (void) close(conn->fds[0]);
+  }
+
+  for (sock = statsd_sockets; sock != NULL; sock = sock->next) {
+    (void) close(sock->fd);
+  }
+
+  /* Then close everything else: the gaps between the descriptors we keep,
+   * and everything above them.
+   */
+  while (TRUE) {
+    int nextfd = -1;
+
+    for (i = 0; i < nkeep; i++) {
+      if (keep[i] >= lowfd &&
+          (nextfd < 0 || keep[i] < nextfd)) {
+        nextfd = keep[i];
       }
     }
+
+    if (nextfd < 0) {
+      break;
+    }
+
+    if (nextfd > lowfd) {
+      close_fd_range(lowfd, nextfd - 1);
+    }
+
+    lowfd = nextfd + 1;
   }
+
+#if defined(HAVE_CLOSE_RANGE)
+  (void) close_range((unsigned int) lowfd, ~0U, 0);
+#elif defined(HAVE_CLOSEFROM)
+  closefrom(lowfd);
+#endif /* HAVE_CLOSEFROM */
 }
 
-static void log_cmd_metrics(cmd_rec *cmd, int had_error) {
-  char *metric;
-  const uint64_t *start_ms = NULL;
-  uint64_t now_ms = 0;
+/* The relay needs no privileges beyond the sockets it has already opened,
+ * and so runs as the daemon's User and Group.
+ */
+static int drop_relay_privs(void) {
+  if (getuid() != PR_ROOT_UID) {
+    return 0;
+  }
 
-  if (statsd_engine == FALSE) {
-    return;
+  PRIVS_ROOT
+  if (setgroups(1, &daemon_gid) < 0 ||
+      setgid(daemon_gid) < 0 ||
+      setuid(daemon_uid) < 0) {
+    return -1;
   }
 
-  pr_gettimeofday_millis(&now_ms);
+  return 0;
+}
 
-  if (should_exclude(cmd) == TRUE) {
-    pr_trace_msg(trace_channel, 9,
-      "command '%s' excluded by StatsdExcludeFilter '%s'", (char *) cmd->argv[0],
-      statsd_exclude_filter);
-    return;
+/* The relay's end of the relay sockets is only for the relay; of the
+ * sessions' end, a session only needs that of the StatsdServer it uses, if
+ * any.
+ */
+static void close_sess_relay_fds(const struct statsd_relay_conn *used) {
+  struct statsd_relay_conn *conn;
+
+  for (conn = statsd_relay_conns; conn != NULL; conn = conn->next) {
+    if (conn->fds[1] >= 0) {
+      (void) close(conn->fds[1]);
+      conn->fds[1] = -1;
+    }
+
+    if (conn != used &&
+        conn->fds[0] >= 0) {
+      (void) close(conn->fds[0]);
+      conn->fds[0] = -1;
+    }
   }
+}
 
-  if (should_sample(statsd_sampling) != TRUE) {
-    pr_trace_msg(trace_channel, 28, "skipping sampling of metric for '%s'",
-      (char *) cmd->argv[0]);
-    return;
+/* The relay process; this does not return. */
+static void run_statsd_relay(void) {
+  pool *relay_pool;
+  struct statsd_relay_conn *conn;
+  struct statsd **clients;
+  int *fds, *keep;
+  unsigned int count = 0, nconns = 0, nkeep = 0;
+
+  relay_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(relay_pool, "Statsd relay process pool");
+
+  for (conn = statsd_relay_conns; conn != NULL; conn = conn->next) {
+    nconns++;
   }
 
-  metric = get_cmd_metric(cmd->tmp_pool, cmd->argv[0]);
-  statsd_metric_counter(statsd, metric, 1, 0);
+  fds = pcalloc(relay_pool, sizeof(int) * nconns);
+  clients = pcalloc(relay_pool, sizeof(struct statsd *) * nconns);
 
-  start_ms = pr_table_get(cmd->notes, "start_ms", NULL);
-  if (start_ms != NULL) {
-    uint64_t response_ms;
+  /* Each client may have a socket of its own, besides its relay socket. */
+  keep = pcalloc(relay_pool, sizeof(int) * nconns * 2);
 
-    response_ms = now_ms - *start_ms;
-    statsd_metric_timer(statsd, metric, response_ms, 0);
+  for (conn = statsd_relay_conns; conn != NULL; conn = conn->next) {
+    struct statsd *client;
+
+    /* The metrics from the sessions are already namespaced, and sampled. */
+    if (conn->path != NULL) {
+      client = statsd_statsd_open_unix(relay_pool, conn->path, 1.0, NULL,
+        NULL);
+
+    } else {
+      client = statsd_statsd_open(relay_pool, conn->addr, conn->use_tcp, 1.0,
+        NULL, NULL);
+    }
+
+    if (client == NULL) {
+      pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+        ": relay: error opening statsd connection to %s: %s", conn->key,
+        strerror(errno));
+      continue;
+    }
+
+    if (conn->max_pktsz > 0 &&
+        statsd_statsd_set_max_packet_size(client, conn->max_pktsz) < 0) {
+      pr_trace_msg(trace_channel, 5,
+        "relay: error setting max packet size %lu for %s: %s",
+        (unsigned long) conn->max_pktsz, conn->key, strerror(errno));
+    }
+
+    fds[count] = conn->fds[1];
+    clients[count] = client;
+    count++;
+
+    keep[nkeep++] = conn->fds[1];
+    if (statsd_statsd_get_fd(client) >= 0) {
+      keep[nkeep++] = statsd_statsd_get_fd(client);
+    }
   }
 
-  log_tls_metrics(cmd, had_error, now_ms);
+  if (drop_relay_privs() < 0) {
+    pr_log_pri(PR_LOG_WARNING, MOD_STATSD_VERSION
+      ": relay: error switching to UID %s, GID %s: %s",
+      pr_uid2str(relay_pool, daemon_uid), pr_gid2str(relay_pool, daemon_gid),
+      strerror(errno));
+    count = 0;
+  }
 
-  if (pr_cmd_cmp(cmd, PR_CMD_PASS_ID) == 0 &&
-      had_error == FALSE) {
-    const char *proto;
+  /* Note that the log files are closed as well; whatever the relay would log
+   * from here on is lost.
+   */
+  close_relay_fds(keep, nkeep);
+
+  if (count > 0) {
+    (void) statsd_relay_run(relay_pool, fds, clients, count);
+  }
+
+  while (count > 0) {
+    statsd_statsd_close(clients[--count]);
+  }
+
+  _exit(0);
+}
+
+static void start_statsd_relay(void) {
+  pid_t pid;
+
+  if (statsd_relay_enabled == FALSE ||
+      statsd_relay_conns == NULL) {
+    return;
+  }
+
+  if (statsd_relay_pid > 0) {
+    if (is_statsd_relay_running() == TRUE) {
+      return;
+    }
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+      ": relay process (PID %lu) exited unexpectedly, restarting",
+      (unsigned long) statsd_relay_pid);
+    statsd_relay_pid = 0;
+  }
 
-    proto = pr_session_get_protocol(0);
-    if (strcmp(proto, "ftp") == 0) {
-      char *proto_metric;
+  pid = fork();
+  if (pid < 0) {
+    pr_log_pri(PR_LOG_WARNING, MOD_STATSD_VERSION
+      ": error starting relay process: %s", strerror(errno));
+    return;
+  }
 
-      /* At this point in time, we are certain that we have a plain FTP
-       * connection, not FTPS or SFTP or anything else.
-       */
-      proto_metric = get_conn_metric(cmd->tmp_pool, "ftp");
-      statsd_metric_counter(statsd, proto_metric, 1, 0);
-      statsd_metric_gauge(statsd, proto_metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
-    }
+  if (pid == 0) {
+    /* We are the relay. */
+    run_statsd_relay();
   }
 
-  statsd_statsd_flush(statsd);
+  pr_trace_msg(trace_channel, 9, "started relay process (PID %lu)",
+    (unsigned long) pid);
+  statsd_relay_pid = pid;
 }
 
-MODRET statsd_log_any(cmd_rec *cmd) {
-  log_cmd_metrics(cmd, FALSE);
-  return PR_DECLINED(cmd);
-}
+static int statsd_fold_cb(CALLBACK_FRAME) {
+  fold_statsd_arenas();
+  fold_statsd_histograms();
 
-MODRET statsd_log_any_err(cmd_rec *cmd) {
-  log_cmd_metrics(cmd, TRUE);
-  return PR_DECLINED(cmd);
+  /* Always restart the timer. */
+  return 1;
 }
 
-/* Event handlers
- */
-
-static void statsd_exit_ev(const void *event_data, void *user_data) {
+static int statsd_flush_cb(CALLBACK_FRAME) {
   if (statsd != NULL) {
-    char *metric;
-    unsigned char *authenticated;
+    pr_trace_msg(trace_channel, 19,
+      "StatsdFlushInterval (%d secs) reached, flushing pending metrics",
+      statsd_flush_interval);
+    (void) statsd_statsd_flush(statsd);
+  }
 
-    metric = get_conn_metric(session.pool, NULL);
-    statsd_metric_gauge(statsd, metric, -1, STATSD_METRIC_FL_GAUGE_ADJUST);
+  /* Always restart the timer. */
+  return 1;
+}
 
-    authenticated = get_param_ptr(main_server->conf, "authenticated", FALSE);
-    if (authenticated != NULL &&
-        *authenticated == TRUE) {
-      const char *proto;
-      uint64_t now_ms = 0, sess_ms;
+static int statsd_resolve_cb(CALLBACK_FRAME) {
+  resolve_statsd_servers();
+  share_statsd_sockets();
+  share_statsd_arenas();
+  share_statsd_histograms();
 
-      proto = pr_session_get_protocol(0);
-      metric = get_conn_metric(session.pool, proto);
-      statsd_metric_gauge(statsd, metric, -1, STATSD_METRIC_FL_GAUGE_ADJUST);
+  if (share_statsd_relay_conns() == TRUE) {
+    stop_statsd_relay();
+  }
+  start_statsd_relay();
 
-      pr_gettimeofday_millis(&now_ms);
-      sess_ms = now_ms - statsd_sess_start_ms;
-      statsd_metric_timer(statsd, metric, sess_ms, 0);
-    }
+  /* Always restart the timer. */
+  return 1;
+}
 
-    if (statsd_sql_conn_count > 0) {
-      metric = get_conn_metric(session.pool, "sql");
-      statsd_metric_gauge(statsd, metric, statsd_sql_conn_count * -1,
-        STATSD_METRIC_FL_GAUGE_ADJUST);
-      statsd_sql_conn_count = 0;
-    }
+/* Creates the set of client-controlled metric names shared by the sessions,
+ * keeping the existing set when possible.  Without a shared set, each
+ * session limits its own names.
+ */
+static void share_statsd_names(int engine) {
+  config_rec *c;
+  unsigned int max_names = STATSD_DEFAULT_MAX_NAMES;
 
-    statsd_statsd_close(statsd);
-    statsd = NULL;
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdMaxMetricNames",
+    FALSE);
+  if (c != NULL) {
+    max_names = *((unsigned int *) c->argv[0]);
   }
-}
-
-static void statsd_log_ev(const void *event_data, void *user_data) {
-  const pr_log_event_t *le;
-  pool *tmp_pool;
-  char *metric;
 
-  le = event_data;
+  statsd_max_names = max_names;
 
-  tmp_pool = make_sub_pool(session.pool);
+  if (statsd_names != NULL) {
+    if (engine == TRUE &&
+        statsd_cardinality_get_max(statsd_names) == max_names) {
+      return;
+    }
 
-  /* Unlike other common metrics, for now the log level counters are NOT
-   * subject to the sampling frequency.
-   */
+    (void) statsd_cardinality_destroy(statsd_names);
+    statsd_names = NULL;
+  }
 
-  metric = get_log_level_metric(tmp_pool, le->log_level);
-  statsd_metric_counter(statsd, metric, 1, STATSD_METRIC_FL_IGNORE_SAMPLING);
-  destroy_pool(tmp_pool);
-}
+  if (engine == FALSE ||
+      max_names == 0) {
+    return;
+  }
 
-#if defined(PR_SHARED_MODULE)
-static void statsd_mod_unload_ev(const void *event_data, void *user_data) {
-  if (strcmp("mod_statsd.c", (const char *) event_data) == 0) {
-    pr_event_unregister(&statsd_module, NULL, NULL);
+  statsd_names = statsd_cardinality_create(permanent_pool, max_names);
+  if (statsd_names == NULL) {
+    pr_log_debug(DEBUG3, MOD_STATSD_VERSION
+      ": error creating shared set of %u metric names: %s", max_names,
+      strerror(errno));
   }
 }
-#endif /* PR_SHARED_MODULE */
 
 static void statsd_postparse_ev(const void *event_data, void *user_data) {
+  config_rec *c;
   server_rec *s;
+  int ttl = STATSD_DEFAULT_SERVER_TTL, have_engine = FALSE;
 
   for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
-    config_rec *c;
     int engine;
 
     c = find_config(s->conf, CONF_PARAM, "StatsdEngine", FALSE);
@@ -591,7 +2812,61 @@ static void statsd_postparse_ev(const void *event_data, void *user_data) {
       pr_session_disconnect(&statsd_module, PR_SESS_DISCONNECT_BAD_CONFIG,
         NULL);
     }
+
+    have_engine = TRUE;
+  }
+
+  share_statsd_names(have_engine);
+  resolve_statsd_servers();
+  share_statsd_sockets();
+  share_statsd_arenas();
+  share_statsd_histograms();
+
+  if (share_statsd_relay_conns() == TRUE) {
+    stop_statsd_relay();
+  }
+  start_statsd_relay();
+
+  if (statsd_fold_timer_id > 0) {
+    (void) pr_timer_remove(statsd_fold_timer_id, &statsd_module);
+    statsd_fold_timer_id = -1;
+  }
+
+  if (statsd_arenas != NULL ||
+      statsd_histograms != NULL) {
+    statsd_fold_timer_id = pr_timer_add(STATSD_ARENA_FOLD_INTERVAL, -1,
+      &statsd_module, statsd_fold_cb, "Statsd shared metrics");
   }
+
+  if (statsd_resolve_timer_id > 0) {
+    (void) pr_timer_remove(statsd_resolve_timer_id, &statsd_module);
+    statsd_resolve_timer_id = -1;
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdServerTTL", FALSE);
+  if (c != NULL) {
+    ttl = *((int *) c->argv[0]);
+  }
+
+  if (ttl > 0) {
+    statsd_resolve_timer_id = pr_timer_add(ttl, -1, &statsd_module,
+      statsd_resolve_cb, "StatsdServer resolution");
+  }
+}
+
+static void statsd_restart_ev(const void *event_data, void *user_data) {
+  if (statsd_resolve_timer_id > 0) {
+    (void) pr_timer_remove(statsd_resolve_timer_id, &statsd_module);
+    statsd_resolve_timer_id = -1;
+  }
+
+  if (statsd_fold_timer_id > 0) {
+    (void) pr_timer_remove(statsd_fold_timer_id, &statsd_module);
+    statsd_fold_timer_id = -1;
+  }
+
+  /* The relay is restarted, with the new configuration, once parsed. */
+  stop_statsd_relay();
 }
 
 static void statsd_sess_reinit_ev(const void *event_data, void *user_data) {
@@ -605,13 +2880,42 @@ static void statsd_sess_reinit_ev(const void *event_data, void *user_data) {
 
   /* Reset internal state. */
   statsd_engine = STATSD_DEFAULT_ENGINE;
+  statsd_opts = 0UL;
   statsd_exclude_filter = NULL;
 #if defined(PR_USE_REGEX)
   statsd_exclude_pre = NULL;
 #endif /* PR_USE_REGEX */
+  memset(statsd_exclude_resolved, 0, sizeof(statsd_exclude_resolved));
+  memset(statsd_exclude_ids, 0, sizeof(statsd_exclude_ids));
+  statsd_exclude_names = NULL;
+  clear_metric_handles();
+  statsd_sess_names = NULL;
   statsd_sampling = STATSD_DEFAULT_SAMPLING;
+  statsd_sampling_mode = STATSD_SAMPLING_MODE_COMMAND;
+  statsd_cmd_sampling_rules = NULL;
+  statsd_cmd_sampling = NULL;
+  statsd_cmd_sampling_names = NULL;
+  statsd_tail_sampling = FALSE;
+  statsd_tail_slow_ms = 0;
+  statsd_histogram = NULL;
+  statsd_flush_interval = 0;
+  statsd_flush_fill = STATSD_DEFAULT_FLUSH_FILL;
+
+  if (statsd_flush_timer_id > 0) {
+    (void) pr_timer_remove(statsd_flush_timer_id, &statsd_module);
+    statsd_flush_timer_id = -1;
+  }
+
+  /* The new configuration may or may not sample this session. */
+  if (statsd_sess_sampled == FALSE) {
+    adjust_unsampled_gauge(-1);
+    statsd_sess_sampled = TRUE;
+    statsd_unsampled_arena = NULL;
+    statsd_unsampled_gauge = NULL;
+  }
 
   if (statsd != NULL) {
+    statsd_metric_flush(statsd);
     statsd_statsd_close(statsd);
     statsd = NULL;
   }
@@ -623,7 +2927,24 @@ static void statsd_sess_reinit_ev(const void *event_data, void *user_data) {
   }
 }
 
+static void statsd_startup_ev(const void *event_data, void *user_data) {
+  if (ServerType != SERVER_STANDALONE) {
+    return;
+  }
+
+  /* The relay's lifetime is tied to its sockets, not to the process which
+   * forks it, so it is unaffected by the daemon detaching.
+   */
+  statsd_relay_enabled = TRUE;
+  start_statsd_relay();
+}
+
 static void statsd_shutdown_ev(const void *event_data, void *user_data) {
+  /* Send whatever the sessions have added since the last fold. */
+  fold_statsd_arenas();
+  fold_statsd_histograms();
+  stop_statsd_relay();
+
   if (statsd != NULL) {
     statsd_statsd_close(statsd);
     statsd = NULL;
@@ -632,18 +2953,12 @@ static void statsd_shutdown_ev(const void *event_data, void *user_data) {
 
 static void statsd_sql_db_conn_closed_ev(const void *event_data,
     void *user_data) {
-  pool *tmp_pool;
-  char *metric;
-
   /* Unlike other common metrics, for now the SQL database counters are NOT
    * subject to the sampling frequency.
    */
 
-  tmp_pool = make_sub_pool(session.pool);
-  metric = get_conn_metric(tmp_pool, "sql");
-  statsd_metric_gauge(statsd, metric, -1, STATSD_METRIC_FL_GAUGE_ADJUST);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(STATSD_FIXED_SQL_GAUGE, -1);
+  flush_metrics();
 
   if (statsd_sql_conn_count > 0) {
     statsd_sql_conn_count--;
@@ -652,19 +2967,13 @@ static void statsd_sql_db_conn_closed_ev(const void *event_data,
 
 static void statsd_sql_db_conn_opened_ev(const void *event_data,
     void *user_data) {
-  pool *tmp_pool;
-  char *metric;
-
   /* Unlike other common metrics, for now the SQL database counters are NOT
    * subject to the sampling frequency.
    */
 
-  tmp_pool = make_sub_pool(session.pool);
-  metric = get_conn_metric(tmp_pool, "sql");
-  statsd_metric_counter(statsd, metric, 1, STATSD_METRIC_FL_IGNORE_SAMPLING);
-  statsd_metric_gauge(statsd, metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(STATSD_FIXED_SQL_COUNTER, 1);
+  write_fixed_metric(STATSD_FIXED_SQL_GAUGE, 1);
+  flush_metrics();
 
   /* We keep our own internal count of opened database connections.  That way,
    * if the session dies/closes before the database connections are closed
@@ -674,192 +2983,437 @@ static void statsd_sql_db_conn_opened_ev(const void *event_data,
 }
 
 static void statsd_sql_db_error_ev(const void *event_data, void *user_data) {
-  pool *tmp_pool;
-  char *metric;
-
-  tmp_pool = make_sub_pool(session.pool);
-
   /* Unlike other common metrics, for now the SQL database counters are NOT
    * subject to the sampling frequency.
    */
 
-  metric = get_sql_metric(tmp_pool, "database.error");
-  statsd_metric_counter(statsd, metric, 1, STATSD_METRIC_FL_IGNORE_SAMPLING);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(STATSD_FIXED_SQL_ERROR, 1);
+  flush_metrics();
 }
 
 static void statsd_ssh2_sftp_sess_opened_ev(const void *event_data,
     void *user_data) {
-  pool *tmp_pool;
-  char *proto_metric;
-
-  if (should_sample(statsd_sampling) == FALSE) {
+  if (should_sample(&statsd_default_sampling) == FALSE) {
     return;
   }
 
-  tmp_pool = make_sub_pool(session.pool);
-  proto_metric = get_conn_metric(tmp_pool, "sftp");
-  statsd_metric_counter(statsd, proto_metric, 1, 0);
-  statsd_metric_gauge(statsd, proto_metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(STATSD_FIXED_SFTP_COUNTER, 1);
+  write_fixed_metric(STATSD_FIXED_SFTP_GAUGE, 1);
+  flush_metrics();
 }
 
 static void statsd_ssh2_scp_sess_opened_ev(const void *event_data,
     void *user_data) {
-  pool *tmp_pool;
-  char *proto_metric;
-
-  if (should_sample(statsd_sampling) == FALSE) {
+  if (should_sample(&statsd_default_sampling) == FALSE) {
     return;
   }
 
-  tmp_pool = make_sub_pool(session.pool);
-  proto_metric = get_conn_metric(tmp_pool, "scp");
-  statsd_metric_counter(statsd, proto_metric, 1, 0);
-  statsd_metric_gauge(statsd, proto_metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(STATSD_FIXED_SCP_COUNTER, 1);
+  write_fixed_metric(STATSD_FIXED_SCP_GAUGE, 1);
+  flush_metrics();
 }
 
-static void incr_timeout_metric(const char *name) {
-  pool *tmp_pool;
-  char *metric;
-
+static void incr_timeout_metric(unsigned int idx) {
   /* Unlike other common metrics, for now the timeout counters are NOT subject
    * to the sampling frequency.
    */
 
-  tmp_pool = make_sub_pool(session.pool);
-  metric = get_timeout_metric(tmp_pool, name);
-  statsd_metric_counter(statsd, metric, 1, STATSD_METRIC_FL_IGNORE_SAMPLING);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(idx, 1);
+  flush_metrics();
 }
 
 static void statsd_timeout_idle_ev(const void *event_data, void *user_data) {
-  incr_timeout_metric("TimeoutIdle");
+  incr_timeout_metric(STATSD_FIXED_TIMEOUT_IDLE);
 }
 
 static void statsd_timeout_login_ev(const void *event_data, void *user_data) {
-  incr_timeout_metric("TimeoutLogin");
+  incr_timeout_metric(STATSD_FIXED_TIMEOUT_LOGIN);
 }
 
 static void statsd_timeout_noxfer_ev(const void *event_data, void *user_data) {
-  incr_timeout_metric("TimeoutNoTransfer");
+  incr_timeout_metric(STATSD_FIXED_TIMEOUT_NOXFER);
 }
 
 static void statsd_timeout_session_ev(const void *event_data, void *user_data) {
-  incr_timeout_metric("TimeoutSession");
+  incr_timeout_metric(STATSD_FIXED_TIMEOUT_SESSION);
 }
 
 static void statsd_timeout_stalled_ev(const void *event_data, void *user_data) {
-  incr_timeout_metric("TimeoutStalled");
+  incr_timeout_metric(STATSD_FIXED_TIMEOUT_STALLED);
 }
 
-static void incr_tls_handshake_error_metric(const char *name) {
-  pool *tmp_pool;
-  char *metric;
-
-  tmp_pool = make_sub_pool(session.pool);
-
+static void incr_tls_handshake_error_metric(unsigned int idx) {
   /* Unlike other common metrics, for now the TLS handshake counters are NOT
    * subject to the sampling frequency.
    */
 
-  metric = get_tls_metric(tmp_pool, name);
-  statsd_metric_counter(statsd, metric, 1, STATSD_METRIC_FL_IGNORE_SAMPLING);
-  statsd_statsd_flush(statsd);
-  destroy_pool(tmp_pool);
+  write_fixed_metric(idx, 1);
+  flush_metrics();
 }
 
 static void statsd_tls_ctrl_handshake_error_ev(const void *event_data,
     void *user_data) {
-  incr_tls_handshake_error_metric("handshake.ctrl.error");
+  incr_tls_handshake_error_metric(STATSD_FIXED_TLS_CTRL_ERROR);
 }
 
 static void statsd_tls_data_handshake_error_ev(const void *event_data,
     void *user_data) {
-  incr_tls_handshake_error_metric("handshake.data.error");
+  incr_tls_handshake_error_metric(STATSD_FIXED_TLS_DATA_ERROR);
 }
 
 /* Initialization functions
  */
 
+/* Sets up a session not selected by whole-session sampling: apart from the
+ * "connection.unsampled" gauge, none of the session's handlers do anything.
+ */
+static int init_unsampled_sess(void) {
+  /* Note that disabling the engine makes the command handlers no-ops. */
+  statsd_engine = FALSE;
+
+  adjust_unsampled_gauge(1);
+  pr_event_register(&statsd_module, "core.exit", statsd_exit_ev, NULL);
+
+  return 0;
+}
+
 static int statsd_sess_init(void) {
   config_rec *c;
-  char *host, *metric, *prefix = NULL, *suffix = NULL;
-  int port, use_tcp = FALSE;
-  const pr_netaddr_t *addr;
+  const struct statsd_relay_conn *relay_conn = NULL;
+  char *host, *prefix = NULL, *suffix = NULL;
+  const char *key;
+  int port, scheme = STATSD_SCHEME_UDP;
 
   pr_event_register(&statsd_module, "core.session-reinit", statsd_sess_reinit_ev,
     NULL);
 
+  /* The resolution and fold timers are only for the daemon. */
+  if (statsd_resolve_timer_id > 0) {
+    (void) pr_timer_remove(statsd_resolve_timer_id, &statsd_module);
+    statsd_resolve_timer_id = -1;
+  }
+
+  if (statsd_fold_timer_id > 0) {
+    (void) pr_timer_remove(statsd_fold_timer_id, &statsd_module);
+    statsd_fold_timer_id = -1;
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "StatsdEngine", FALSE);
   if (c != NULL) {
     statsd_engine = *((int *) c->argv[0]);
   }
 
   if (statsd_engine == FALSE) {
+    close_sess_relay_fds(NULL);
     return 0;
   }
 
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdOptions", FALSE);
+  while (c != NULL) {
+    unsigned long opts;
+
+    pr_signals_handle();
+
+    opts = *((unsigned long *) c->argv[0]);
+    statsd_opts |= opts;
+
+    c = find_config_next(c, c->next, CONF_PARAM, "StatsdOptions", FALSE);
+  }
+
+  /* The sampling percentage is needed when opening the client. */
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdSampling", FALSE);
+  if (c != NULL) {
+    statsd_sampling = *((float *) c->argv[0]);
+    statsd_sampling_mode = *((int *) c->argv[1]);
+  }
+
+  (void) statsd_statsd_prepare_sampling(&statsd_default_sampling,
+    statsd_sampling);
+  (void) statsd_statsd_prepare_sampling(&statsd_full_sampling, 1.0);
+
+  if (statsd_sampling_mode == STATSD_SAMPLING_MODE_SESSION &&
+      statsd_sampling < 1.0) {
+    statsd_sess_sampled = statsd_statsd_sample_once(statsd_sampling);
+    pr_trace_msg(trace_channel, 9, "session %s for sampling (%g%%)",
+      statsd_sess_sampled == TRUE ? "selected" : "not selected",
+      statsd_sampling * 100.0);
+  }
+
+  /* The StatsdCommandSampling rules only apply to per-command sampling. */
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdCommandSampling",
+    FALSE);
+  if (c != NULL) {
+    if (statsd_sampling_mode == STATSD_SAMPLING_MODE_COMMAND) {
+      resolve_cmd_sampling(c);
+
+    } else {
+      pr_log_debug(DEBUG5, MOD_STATSD_VERSION
+        ": StatsdCommandSampling ignored for whole-session sampling");
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdTailSampling", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) == TRUE) {
+    if (statsd_sampling_mode == STATSD_SAMPLING_MODE_COMMAND) {
+      statsd_tail_sampling = TRUE;
+      statsd_tail_slow_ms = *((unsigned long *) c->argv[1]);
+
+    } else {
+      pr_log_debug(DEBUG5, MOD_STATSD_VERSION
+        ": StatsdTailSampling ignored for whole-session sampling");
+    }
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "StatsdServer", FALSE);
   if (c == NULL) {
     pr_log_debug(DEBUG10, MOD_STATSD_VERSION
       ": missing required StatsdServer directive, disabling module");
     statsd_engine = FALSE;
+    close_sess_relay_fds(NULL);
     return 0;
   }
 
   host = c->argv[0];
-  addr = pr_netaddr_get_addr(session.pool, host, NULL);
-  if (addr == NULL) {
-    pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
-      ": error resolving '%s' to IP address: %s", host, strerror(errno));
-    statsd_engine = FALSE;
-    return 0;
-  }
-
   port = *((int *) c->argv[1]);
-  pr_netaddr_set_port2((pr_netaddr_t *) addr, port);
-
-  use_tcp = *((int *) c->argv[2]);
+  scheme = *((int *) c->argv[2]);
   prefix = c->argv[3];
   suffix = c->argv[4];
 
-  statsd = statsd_statsd_open(session.pool, addr, use_tcp, statsd_sampling,
-    prefix, suffix);
-  if (statsd == NULL) {
-    pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
-      ": error opening statsd connection to %s%s:%d: %s",
-      use_tcp ? "tcp://" : "udp://", host, port, strerror(errno));
-    statsd_engine = FALSE;
-    return 0;
+  key = get_server_key(session.pool, c);
+
+  if (statsd_sess_sampled == FALSE &&
+      (statsd_opts & STATSD_OPT_SHARED_COUNTERS)) {
+    struct statsd_shared_arena *sa;
+
+    /* With a shared arena, an unsampled session needs no client at all. */
+    sa = find_arena(statsd_arenas, key);
+    if (sa != NULL) {
+      statsd_unsampled_arena = sa->arena;
+
+      /* Note that the names in the arena include the namespacing. */
+      statsd_unsampled_gauge = pstrcat(session.pool, prefix ? prefix : "",
+        "connection.unsampled", suffix ? suffix : "",
+        NULL);
+      close_sess_relay_fds(NULL);
+      return init_unsampled_sess();
+    }
   }
 
-#if defined(HAVE_SRANDOM)
-  srandom((unsigned int) (time(NULL) ^ getpid()));
-#else
-  srand((unsigned int) (time(NULL) ^ getpid()));
-#endif /* HAVE_SRANDOM */
+  if (statsd_opts & STATSD_OPT_RELAY) {
+    struct statsd_relay_conn *conn;
+
+    conn = find_relay_conn(statsd_relay_conns, key);
+    if (conn != NULL &&
+        conn->fds[0] >= 0 &&
+        is_statsd_relay_running() == TRUE) {
+      statsd = statsd_statsd_open_relay(session.pool, conn->fds[0],
+        statsd_sampling, prefix, suffix);
+      if (statsd == NULL) {
+        pr_trace_msg(trace_channel, 3,
+          "error using relay for %s: %s", key, strerror(errno));
+
+      } else {
+        pr_trace_msg(trace_channel, 17, "using relay for StatsdServer");
+        relay_conn = conn;
+      }
+    }
+  }
+
+  close_sess_relay_fds(relay_conn);
+
+  if (statsd == NULL &&
+      (statsd_opts & STATSD_OPT_SHARED_SOCKET)) {
+    struct statsd_socket *sock = NULL;
+
+    if (scheme != STATSD_SCHEME_TCP) {
+      sock = find_socket(statsd_sockets, key);
+    }
+
+    if (sock != NULL) {
+      statsd = statsd_statsd_open_fd(session.pool, sock->fd, c->argv[5],
+        scheme == STATSD_SCHEME_UNIX ? host : NULL, statsd_sampling, prefix,
+        suffix);
+      if (statsd == NULL) {
+        pr_trace_msg(trace_channel, 3,
+          "error using shared socket for %s: %s", key, strerror(errno));
+
+      } else {
+        pr_trace_msg(trace_channel, 17,
+          "using shared socket for StatsdServer");
+      }
+    }
+  }
+
+  if (statsd != NULL) {
+    /* Already opened, using the relay or a shared socket. */
+
+  } else if (scheme == STATSD_SCHEME_UNIX) {
+    statsd = statsd_statsd_open_unix(session.pool, host, statsd_sampling,
+      prefix, suffix);
+    if (statsd == NULL) {
+      pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+        ": error opening statsd connection to unix://%s: %s", host,
+        strerror(errno));
+      statsd_engine = FALSE;
+      return 0;
+    }
+
+  } else {
+    const pr_netaddr_t *addr;
+    int use_tcp;
+
+    /* Use the address resolved by the daemon, if we can. */
+    addr = c->argv[5];
+    if (addr == NULL) {
+      addr = pr_netaddr_get_addr(session.pool, host, NULL);
+      if (addr == NULL) {
+        pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+          ": error resolving '%s' to IP address: %s", host, strerror(errno));
+        statsd_engine = FALSE;
+        return 0;
+      }
+
+      pr_netaddr_set_port2((pr_netaddr_t *) addr, port);
+    }
+
+    use_tcp = (scheme == STATSD_SCHEME_TCP) ? TRUE : FALSE;
+    statsd = statsd_statsd_open(session.pool, addr, use_tcp, statsd_sampling,
+      prefix, suffix);
+    if (statsd == NULL) {
+      pr_log_pri(PR_LOG_NOTICE, MOD_STATSD_VERSION
+        ": error opening statsd connection to %s%s:%d: %s",
+        use_tcp ? "tcp://" : "udp://", host, port, strerror(errno));
+      statsd_engine = FALSE;
+      return 0;
+    }
+  }
+
+  if (statsd_opts & STATSD_OPT_SHARED_COUNTERS) {
+    struct statsd_shared_arena *sa;
+
+    sa = find_arena(statsd_arenas, key);
+    if (sa != NULL) {
+      statsd_statsd_set_arena(statsd, sa->arena);
+      pr_trace_msg(trace_channel, 17, "using shared arena for StatsdServer");
+
+    } else {
+      pr_trace_msg(trace_channel, 9,
+        "no shared arena available for %s, sending counters directly", key);
+    }
+  }
+
+  if (statsd_sess_sampled == FALSE) {
+    /* Unsampled sessions use the client only for their gauge. */
+    statsd_unsampled_gauge = "connection.unsampled";
+    return init_unsampled_sess();
+  }
+
+  if (statsd_opts & STATSD_OPT_SHARED_HISTOGRAMS) {
+    struct statsd_shared_histogram *sh;
+
+    sh = find_histogram(statsd_histograms, get_histogram_key(session.pool, c));
+    if (sh != NULL) {
+      statsd_histogram = sh->hist;
+      pr_trace_msg(trace_channel, 17,
+        "using shared histograms for StatsdServer");
+    }
+  }
+
+  if (statsd_opts & STATSD_OPT_AGGREGATE) {
+    struct statsd_aggregate *agg;
+
+    /* The aggregate is destroyed along with the client. */
+    agg = statsd_aggregate_create(statsd_statsd_get_pool(statsd));
+    if (agg != NULL) {
+      statsd_statsd_set_aggregate(statsd, agg);
+      pr_trace_msg(trace_channel, 17, "aggregating counters");
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdTimerSketch", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) == TRUE) {
+    struct statsd_sketch_table *tab;
+    float accuracy;
+
+    accuracy = *((float *) c->argv[1]);
+
+    /* The sketch table is destroyed along with the client. */
+    tab = statsd_sketch_table_create(statsd_statsd_get_pool(statsd), accuracy);
+    if (tab != NULL) {
+      statsd_statsd_set_sketches(statsd, tab);
+      pr_trace_msg(trace_channel, 17,
+        "summarizing timers using sketches, with %g%% accuracy",
+        accuracy * 100.0);
+
+    } else {
+      pr_trace_msg(trace_channel, 3, "error creating timer sketches: %s",
+        strerror(errno));
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdMaxPacketSize", FALSE);
+  if (c != NULL) {
+    size_t pktsz;
+
+    pktsz = *((size_t *) c->argv[0]);
+    if (statsd_statsd_set_max_packet_size(statsd, pktsz) < 0) {
+      pr_log_debug(DEBUG5, MOD_STATSD_VERSION
+        ": error setting max packet size %lu: %s", (unsigned long) pktsz,
+        strerror(errno));
+
+    } else {
+      pr_trace_msg(trace_channel, 9, "using max packet size of %lu bytes",
+        (unsigned long) statsd_statsd_get_max_packet_size(statsd));
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "StatsdFlushInterval", FALSE);
+  if (c != NULL) {
+    statsd_flush_interval = *((int *) c->argv[0]);
+    statsd_flush_fill = *((unsigned int *) c->argv[1]);
+  }
+
+  if (statsd_flush_interval > 0) {
+    statsd_flush_timer_id = pr_timer_add(statsd_flush_interval, -1,
+      &statsd_module, statsd_flush_cb, "StatsdFlushInterval");
+    if (statsd_flush_timer_id < 0) {
+      pr_log_debug(DEBUG5, MOD_STATSD_VERSION
+        ": error adding StatsdFlushInterval timer: %s", strerror(errno));
+
+      /* Without the timer, fall back to sending metrics after every
+       * command.
+       */
+      statsd_flush_interval = 0;
+
+    } else {
+      pr_trace_msg(trace_channel, 9,
+        "flushing metrics every %d secs, or at %u%% packet fill",
+        statsd_flush_interval, statsd_flush_fill);
+    }
+  }
 
   c = find_config(main_server->conf, CONF_PARAM, "StatsdExcludeFilter", FALSE);
   if (c != NULL &&
       c->argc == 2) {
     statsd_exclude_filter = c->argv[0];
     statsd_exclude_pre = c->argv[1];
+    statsd_exclude_names = pr_table_alloc(session.pool, 0);
   }
 
-  c = find_config(main_server->conf, CONF_PARAM, "StatsdSampling", FALSE);
-  if (c != NULL) {
-    statsd_sampling = *((float *) c->argv[0]);
+  statsd_metric_pool = make_sub_pool(statsd_statsd_get_pool(statsd));
+  pr_pool_tag(statsd_metric_pool, "Statsd metric handles pool");
+
+  statsd_cmd_metrics = pcalloc(statsd_metric_pool,
+    sizeof(struct statsd_cmd_metric *) * STATSD_MAX_CMD_IDS);
+  if (statsd_max_names > 0) {
+    statsd_sess_names = pr_table_alloc(session.pool, 0);
   }
+  register_fixed_metrics();
 
-  metric = get_conn_metric(session.pool, NULL);
-  statsd_metric_gauge(statsd, metric, 1, STATSD_METRIC_FL_GAUGE_ADJUST);
-  statsd_statsd_flush(statsd);
+  write_fixed_metric(STATSD_FIXED_CONN_GAUGE, 1);
+  flush_metrics();
 
   pr_event_register(&statsd_module, "core.exit", statsd_exit_ev, NULL);
   pr_event_register(&statsd_module, "core.log.systemlog", statsd_log_ev, NULL);
@@ -916,8 +3470,12 @@ static int statsd_init(void) {
 #endif
   pr_event_register(&statsd_module, "core.postparse", statsd_postparse_ev,
     NULL);
+  pr_event_register(&statsd_module, "core.restart", statsd_restart_ev,
+    NULL);
   pr_event_register(&statsd_module, "core.shutdown", statsd_shutdown_ev,
     NULL);
+  pr_event_register(&statsd_module, "core.startup", statsd_startup_ev,
+    NULL);
 
   return 0;
 }
@@ -926,10 +3484,18 @@ static int statsd_init(void) {
  */
 
 static conftable statsd_conftab[] = {
+  { "StatsdCommandSampling",	set_statsdcommandsampling,	NULL },
   { "StatsdEngine",		set_statsdengine,		NULL },
   { "StatsdExcludeFilter",	set_statsdexcludefilter,	NULL },
+  { "StatsdFlushInterval",	set_statsdflushinterval,	NULL },
+  { "StatsdMaxMetricNames",	set_statsdmaxmetricnames,	NULL },
+  { "StatsdMaxPacketSize",	set_statsdmaxpacketsize,	NULL },
+  { "StatsdOptions",		set_statsdoptions,		NULL },
   { "StatsdSampling",		set_statsdsampling,		NULL },
   { "StatsdServer",		set_statsdserver,		NULL },
+  { "StatsdServerTTL",		set_statsdserverttl,		NULL },
+  { "StatsdTailSampling",	set_statsdtailsampling,		NULL },
+  { "StatsdTimerSketch",	set_statsdtimersketch,		NULL },
 
   { NULL }
 };
@@ -937,6 +3503,13 @@ static conftable statsd_conftab[] = {
 static cmdtable statsd_cmdtab[] = {
   { LOG_CMD,		C_ANY,	G_NONE,	statsd_log_any,		FALSE,	FALSE },
   { LOG_CMD_ERR,	C_ANY,	G_NONE,	statsd_log_any_err,	FALSE,	FALSE },
+  { PRE_CMD,		C_APPE,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_LIST,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_MLSD,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_NLST,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_RETR,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_STOR,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
+  { PRE_CMD,		C_STOU,	G_NONE,	statsd_pre_xfer,	FALSE,	FALSE },
 
   { 0, NULL }
 };
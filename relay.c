@@ -0,0 +1,237 @@
+/*
+ * ProFTPD - mod_statsd relay implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "relay.h"
+
+#include <poll.h>
+#include <signal.h>
+
+/* How many messages to read from a socket, before moving on to the next. */
+#define STATSD_RELAY_MAX_READS		64
+
+static volatile sig_atomic_t relay_stopping = 0;
+
+static const char *trace_channel = "statsd.relay";
+
+static void relay_stop(int signo) {
+  relay_stopping = 1;
+}
+
+int statsd_relay_open(int fds[2]) {
+  int flags, res, type = SOCK_DGRAM;
+
+  if (fds == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(SOCK_SEQPACKET)
+  type = SOCK_SEQPACKET;
+#endif /* SOCK_SEQPACKET */
+
+  res = socketpair(AF_UNIX, type, 0, fds);
+  if (res < 0 &&
+      type != SOCK_DGRAM &&
+      (errno == EPROTONOSUPPORT || errno == EOPNOTSUPP)) {
+    /* Not all platforms support SOCK_SEQPACKET for Unix domain sockets;
+     * datagrams likewise preserve message boundaries.
+     */
+    pr_trace_msg(trace_channel, 9,
+      "SOCK_SEQPACKET not supported (%s), using SOCK_DGRAM", strerror(errno));
+    type = SOCK_DGRAM;
+    res = socketpair(AF_UNIX, type, 0, fds);
+  }
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 1, "error opening relay socket pair: %s",
+      strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  flags = fcntl(fds[0], F_GETFL);
+  if (fcntl(fds[0], F_SETFL, flags|O_NONBLOCK) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "error making relay socket (fd %d) non-blocking: %s", fds[0],
+      strerror(errno));
+  }
+
+  (void) fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  (void) fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pr_trace_msg(trace_channel, 9, "opened relay %s socket pair (fds %d, %d)",
+    type == SOCK_DGRAM ? "SOCK_DGRAM" : "SOCK_SEQPACKET", fds[0], fds[1]);
+  return 0;
+}
+
+/* Writes each of the newline-separated metrics in the message to the client,
+ * which batches them into its own packets.
+ */
+static void relay_metrics(struct statsd *statsd, const char *buf,
+    size_t buflen) {
+  const char *ptr, *end;
+
+  ptr = buf;
+  end = buf + buflen;
+
+  while (ptr < end) {
+    const char *eol;
+    size_t len;
+
+    eol = memchr(ptr, '\n', end - ptr);
+    len = (eol != NULL ? eol : end) - ptr;
+
+    if (len > 0 &&
+        statsd_statsd_write(statsd, ptr, len, 0) < 0) {
+      pr_trace_msg(trace_channel, 12, "error relaying metric '%.*s': %s",
+        (int) len, ptr, strerror(errno));
+    }
+
+    ptr += len + 1;
+  }
+}
+
+/* Reads the pending messages from the socket.  Returns the number of messages
+ * read, or -1 if the socket should no longer be read.
+ */
+static int relay_read(int fd, struct statsd *statsd, char *buf,
+    size_t bufsz) {
+  register unsigned int i;
+
+  for (i = 0; i < STATSD_RELAY_MAX_READS; i++) {
+    ssize_t len;
+
+    len = recv(fd, buf, bufsz, MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN ||
+          errno == EWOULDBLOCK) {
+        break;
+      }
+
+      pr_trace_msg(trace_channel, 3, "error reading relay socket (fd %d): %s",
+        fd, strerror(errno));
+      return -1;
+    }
+
+    if (len == 0) {
+      /* For SOCK_SEQPACKET, this means that all sessions (and the daemon)
+       * have closed their ends.
+       */
+      return -1;
+    }
+
+    relay_metrics(statsd, buf, len);
+  }
+
+  return i;
+}
+
+int statsd_relay_run(pool *p, int *fds, struct statsd **clients,
+    unsigned int count) {
+  register unsigned int i;
+  char *buf;
+  size_t bufsz;
+  unsigned int nactive;
+  struct pollfd *pfds;
+
+  if (p == NULL ||
+      fds == NULL ||
+      clients == NULL ||
+      count == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  bufsz = STATSD_MAX_PACKET_SIZE_LIMIT;
+  buf = palloc(p, bufsz);
+
+  /* Sockets which are no longer read have a negative fd, which poll(2)
+   * ignores.
+   */
+  pfds = pcalloc(p, sizeof(struct pollfd) * count);
+  for (i = 0; i < count; i++) {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLIN;
+  }
+
+  relay_stopping = 0;
+  signal(SIGTERM, relay_stop);
+
+  pr_trace_msg(trace_channel, 9, "relaying metrics for %u %s", count,
+    count != 1 ? "servers" : "server");
+
+  nactive = count;
+  while (relay_stopping == 0 &&
+         nactive > 0) {
+    int res;
+
+    res = poll(pfds, count, STATSD_RELAY_POLL_INTERVAL * 1000);
+    if (res < 0 &&
+        errno != EINTR) {
+      int xerrno = errno;
+
+      pr_trace_msg(trace_channel, 1, "error waiting for metrics: %s",
+        strerror(xerrno));
+      errno = xerrno;
+      return -1;
+    }
+
+    for (i = 0; res > 0 && i < count; i++) {
+      if (pfds[i].fd < 0 ||
+          pfds[i].revents == 0) {
+        continue;
+      }
+
+      if (relay_read(pfds[i].fd, clients[i], buf, bufsz) < 0) {
+        pfds[i].fd = -1;
+        nactive--;
+      }
+    }
+
+    /* Send what we have; this is also when a TCP client reconnects, and
+     * retries its queued metrics.
+     */
+    for (i = 0; i < count; i++) {
+      (void) statsd_statsd_flush(clients[i]);
+    }
+  }
+
+  /* Relay any remaining metrics, before we go. */
+  for (i = 0; i < count; i++) {
+    if (pfds[i].fd >= 0) {
+      (void) relay_read(pfds[i].fd, clients[i], buf, bufsz);
+    }
+
+    (void) statsd_statsd_flush(clients[i]);
+  }
+
+  pr_trace_msg(trace_channel, 9, "relay stopped");
+  return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * ProFTPD - mod_statsd relay API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_RELAY_H
+#define MOD_STATSD_RELAY_H
+
+#include "mod_statsd.h"
+#include "statsd.h"
+
+/* The relay is a process, forked by the daemon, which receives metrics from
+ * the sessions over local sockets, and sends them on to the statsd servers
+ * using its own, long-lived clients.
+ */
+
+/* How often, in seconds, the relay flushes its clients when otherwise idle. */
+#define STATSD_RELAY_POLL_INTERVAL		1
+
+/* Opens the socket pair between the sessions and the relay.  The sessions
+ * use fds[0], which is non-blocking, so that sessions drop metrics rather
+ * than wait, should the relay fall behind; the relay uses fds[1].
+ */
+int statsd_relay_open(int fds[2]);
+
+/* Runs the relay: metrics received on each of the given sockets are written
+ * to the corresponding client.  Returns when the relay is told to stop,
+ * via SIGTERM, or once every other end of its sockets has been closed, i.e.
+ * when the daemon and all of its sessions have gone away.
+ */
+int statsd_relay_run(pool *p, int *fds, struct statsd **clients,
+  unsigned int count);
+
+#endif /* MOD_STATSD_RELAY_H */
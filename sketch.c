@@ -0,0 +1,540 @@
+/*
+ * ProFTPD - mod_statsd timer sketch implementation
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "sketch.h"
+
+#include <math.h>
+
+struct statsd_sketch {
+  float accuracy;
+
+  /* gamma = (1 + accuracy) / (1 - accuracy); a timing v falls into the bucket
+   * with key ceil(log_gamma(v)).
+   */
+  double gamma;
+  double multiplier;
+
+  uint64_t count;
+  uint64_t zero_count;
+  uint64_t min;
+  uint64_t max;
+
+  /* The key of the first bucket, and the range of keys of non-empty buckets,
+   * valid only when bucket_count is non-zero.
+   */
+  int32_t offset;
+  int32_t lo_key;
+  int32_t hi_key;
+  uint64_t bucket_count;
+
+  uint32_t buckets[STATSD_SKETCH_MAX_BUCKETS];
+};
+
+struct sketch_slot {
+  uint32_t hash;
+  int used;
+  float sampling;
+  size_t namelen;
+  char name[STATSD_SKETCH_MAX_NAME_SIZE];
+
+  /* Allocated on first use of the slot, and reused thereafter. */
+  struct statsd_sketch *sketch;
+};
+
+struct statsd_sketch_table {
+  pool *pool;
+  float accuracy;
+  struct sketch_slot *slots;
+  unsigned int count;
+  time_t flushed;
+};
+
+static const char *trace_channel = "statsd.sketch";
+
+static void sketch_init(struct statsd_sketch *sketch, float accuracy) {
+  memset(sketch, 0, sizeof(struct statsd_sketch));
+
+  sketch->accuracy = accuracy;
+  sketch->gamma = (1.0 + accuracy) / (1.0 - accuracy);
+  sketch->multiplier = 1.0 / log(sketch->gamma);
+}
+
+struct statsd_sketch *statsd_sketch_create(pool *p, float accuracy) {
+  struct statsd_sketch *sketch;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (accuracy < STATSD_SKETCH_MIN_ACCURACY ||
+      accuracy > STATSD_SKETCH_MAX_ACCURACY) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sketch = palloc(p, sizeof(struct statsd_sketch));
+  sketch_init(sketch, accuracy);
+
+  return sketch;
+}
+
+/* Moves the window of buckets so that it starts at the given key.  When
+ * moving up, any buckets falling below the window are collapsed into its
+ * first bucket.  When moving down, the caller ensures that the highest
+ * non-empty bucket remains within the window.
+ */
+static void sketch_set_offset(struct statsd_sketch *sketch, int32_t offset) {
+  uint32_t shift;
+
+  if (offset > sketch->offset) {
+    uint64_t collapsed = 0;
+    int32_t key;
+
+    for (key = sketch->lo_key; key < offset && key <= sketch->hi_key; key++) {
+      collapsed += sketch->buckets[key - sketch->offset];
+    }
+
+    shift = (uint32_t) (offset - sketch->offset);
+    if (shift < STATSD_SKETCH_MAX_BUCKETS) {
+      memmove(sketch->buckets, sketch->buckets + shift,
+        sizeof(uint32_t) * (STATSD_SKETCH_MAX_BUCKETS - shift));
+      memset(sketch->buckets + (STATSD_SKETCH_MAX_BUCKETS - shift), 0,
+        sizeof(uint32_t) * shift);
+
+    } else {
+      memset(sketch->buckets, 0, sizeof(sketch->buckets));
+    }
+
+    sketch->offset = offset;
+    sketch->buckets[0] += (uint32_t) collapsed;
+
+    if (sketch->lo_key < offset) {
+      sketch->lo_key = offset;
+    }
+
+    if (sketch->hi_key < offset) {
+      sketch->hi_key = offset;
+    }
+
+  } else if (offset < sketch->offset) {
+    shift = (uint32_t) (sketch->offset - offset);
+
+    memmove(sketch->buckets + shift, sketch->buckets,
+      sizeof(uint32_t) * (STATSD_SKETCH_MAX_BUCKETS - shift));
+    memset(sketch->buckets, 0, sizeof(uint32_t) * shift);
+
+    sketch->offset = offset;
+  }
+}
+
+static void sketch_add_key(struct statsd_sketch *sketch, int32_t key,
+    uint64_t n) {
+  if (sketch->bucket_count == 0) {
+    memset(sketch->buckets, 0, sizeof(sketch->buckets));
+    sketch->offset = sketch->lo_key = sketch->hi_key = key;
+
+  } else if (key < sketch->offset) {
+    int32_t offset;
+
+    /* Extend the window down as far as we can, while keeping the highest
+     * buckets; anything lower still is collapsed into the first bucket.
+     */
+    offset = sketch->hi_key - (STATSD_SKETCH_MAX_BUCKETS - 1);
+    if (offset < key) {
+      offset = key;
+    }
+
+    sketch_set_offset(sketch, offset);
+    if (key < offset) {
+      key = offset;
+    }
+
+  } else if (key - sketch->offset >= STATSD_SKETCH_MAX_BUCKETS) {
+    sketch_set_offset(sketch, key - (STATSD_SKETCH_MAX_BUCKETS - 1));
+  }
+
+  sketch->buckets[key - sketch->offset] += (uint32_t) n;
+  sketch->bucket_count += n;
+
+  if (key < sketch->lo_key) {
+    sketch->lo_key = key;
+  }
+
+  if (key > sketch->hi_key) {
+    sketch->hi_key = key;
+  }
+}
+
+int statsd_sketch_add(struct statsd_sketch *sketch, uint64_t val) {
+  if (sketch == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sketch->count == 0 ||
+      val < sketch->min) {
+    sketch->min = val;
+  }
+
+  if (val > sketch->max) {
+    sketch->max = val;
+  }
+
+  sketch->count++;
+
+  if (val == 0) {
+    sketch->zero_count++;
+    return 0;
+  }
+
+  sketch_add_key(sketch, (int32_t) ceil(log((double) val) * sketch->multiplier),
+    1);
+  return 0;
+}
+
+int statsd_sketch_merge(struct statsd_sketch *dst,
+    const struct statsd_sketch *src) {
+  int32_t key;
+
+  if (dst == NULL ||
+      src == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (dst->accuracy != src->accuracy) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (src->count == 0) {
+    return 0;
+  }
+
+  if (dst->count == 0 ||
+      src->min < dst->min) {
+    dst->min = src->min;
+  }
+
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+
+  dst->count += src->count;
+  dst->zero_count += src->zero_count;
+
+  if (src->bucket_count > 0) {
+    /* Add the highest buckets first, so that the destination window settles
+     * around them.
+     */
+    for (key = src->hi_key; key >= src->lo_key; key--) {
+      uint32_t n;
+
+      n = src->buckets[key - src->offset];
+      if (n > 0) {
+        sketch_add_key(dst, key, n);
+      }
+    }
+  }
+
+  return 0;
+}
+
+int statsd_sketch_get_quantile(const struct statsd_sketch *sketch, double q,
+    uint64_t *val) {
+  uint64_t rank, n;
+  int32_t key;
+  double estimate;
+
+  if (sketch == NULL ||
+      val == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (q < 0.0 ||
+      q > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sketch->count == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  rank = (uint64_t) (q * (sketch->count - 1));
+
+  n = sketch->zero_count;
+  if (rank < n) {
+    *val = 0;
+    return 0;
+  }
+
+  key = sketch->hi_key;
+  if (sketch->bucket_count > 0) {
+    for (key = sketch->lo_key; key < sketch->hi_key; key++) {
+      n += sketch->buckets[key - sketch->offset];
+      if (rank < n) {
+        break;
+      }
+    }
+  }
+
+  /* The estimate is the value within the bucket which has the same relative
+   * error against both of the bucket's bounds.
+   */
+  estimate = (2.0 * pow(sketch->gamma, (double) key)) / (1.0 + sketch->gamma);
+
+  if (estimate <= (double) sketch->min) {
+    *val = sketch->min;
+
+  } else if (estimate >= (double) sketch->max) {
+    *val = sketch->max;
+
+  } else {
+    *val = (uint64_t) (estimate + 0.5);
+  }
+
+  return 0;
+}
+
+uint64_t statsd_sketch_get_count(const struct statsd_sketch *sketch) {
+  if (sketch == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return sketch->count;
+}
+
+uint64_t statsd_sketch_get_max(const struct statsd_sketch *sketch) {
+  if (sketch == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return sketch->max;
+}
+
+int statsd_sketch_reset(struct statsd_sketch *sketch) {
+  if (sketch == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* The buckets are cleared on the next add. */
+  sketch->count = sketch->zero_count = sketch->bucket_count = 0;
+  sketch->min = sketch->max = 0;
+
+  return 0;
+}
+
+/* FNV-1a */
+static uint32_t get_name_hash(float sampling, const char *name,
+    size_t namelen) {
+  register unsigned int i;
+  uint32_t h = 2166136261UL;
+
+  h ^= (uint32_t) (sampling * 1000000.0);
+  h *= 16777619UL;
+
+  for (i = 0; i < namelen; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619UL;
+  }
+
+  return h;
+}
+
+struct statsd_sketch_table *statsd_sketch_table_create(pool *p,
+    float accuracy) {
+  pool *sub_pool;
+  struct statsd_sketch_table *tab;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (accuracy < STATSD_SKETCH_MIN_ACCURACY ||
+      accuracy > STATSD_SKETCH_MAX_ACCURACY) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  sub_pool = make_sub_pool(p);
+  pr_pool_tag(sub_pool, "Statsd Sketch Table Pool");
+
+  tab = pcalloc(sub_pool, sizeof(struct statsd_sketch_table));
+  tab->pool = sub_pool;
+  tab->accuracy = accuracy;
+  tab->slots = pcalloc(sub_pool,
+    sizeof(struct sketch_slot) * STATSD_SKETCH_MAX_SERIES);
+  tab->flushed = time(NULL);
+
+  return tab;
+}
+
+int statsd_sketch_table_destroy(struct statsd_sketch_table *tab) {
+  if (tab == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  destroy_pool(tab->pool);
+  return 0;
+}
+
+int statsd_sketch_table_add(struct statsd_sketch_table *tab, float sampling,
+    const char *name, uint64_t val) {
+  register unsigned int i;
+  size_t namelen;
+  uint32_t h;
+  unsigned int idx;
+
+  if (tab == NULL ||
+      name == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sampling <= 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  namelen = strlen(name);
+  if (namelen >= STATSD_SKETCH_MAX_NAME_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  h = get_name_hash(sampling, name, namelen);
+  idx = h % STATSD_SKETCH_MAX_SERIES;
+
+  for (i = 0; i < STATSD_SKETCH_MAX_SERIES; i++) {
+    struct sketch_slot *slot;
+
+    slot = &(tab->slots[idx]);
+
+    if (slot->used == FALSE) {
+      if (slot->sketch == NULL) {
+        slot->sketch = statsd_sketch_create(tab->pool, tab->accuracy);
+        if (slot->sketch == NULL) {
+          return -1;
+        }
+      }
+
+      slot->used = TRUE;
+      slot->hash = h;
+      slot->sampling = sampling;
+      slot->namelen = namelen;
+      memcpy(slot->name, name, namelen + 1);
+
+      tab->count++;
+      return statsd_sketch_add(slot->sketch, val);
+    }
+
+    if (slot->hash == h &&
+        slot->sampling == sampling &&
+        slot->namelen == namelen &&
+        memcmp(slot->name, name, namelen) == 0) {
+      return statsd_sketch_add(slot->sketch, val);
+    }
+
+    idx = (idx + 1) % STATSD_SKETCH_MAX_SERIES;
+  }
+
+  errno = ENOSPC;
+  return -1;
+}
+
+int statsd_sketch_table_should_flush(struct statsd_sketch_table *tab) {
+  if (tab == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (tab->count == 0) {
+    return FALSE;
+  }
+
+  if (time(NULL) - tab->flushed >= STATSD_SKETCH_FLUSH_INTERVAL) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+int statsd_sketch_table_flush(struct statsd_sketch_table *tab,
+    int (*cb)(const char *, size_t, float, const struct statsd_sketch *,
+      void *),
+    void *user_data) {
+  register unsigned int i;
+  unsigned int nseries;
+
+  if (tab == NULL ||
+      cb == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  nseries = tab->count;
+
+  for (i = 0; tab->count > 0 && i < STATSD_SKETCH_MAX_SERIES; i++) {
+    struct sketch_slot *slot;
+
+    slot = &(tab->slots[i]);
+    if (slot->used == FALSE) {
+      continue;
+    }
+
+    (void) (cb)(slot->name, slot->namelen, slot->sampling, slot->sketch,
+      user_data);
+
+    statsd_sketch_reset(slot->sketch);
+    slot->used = FALSE;
+    tab->count--;
+  }
+
+  tab->flushed = time(NULL);
+
+  if (nseries > 0) {
+    pr_trace_msg(trace_channel, 19, "flushed %u timer sketches", nseries);
+  }
+
+  return 0;
+}
+
+unsigned int statsd_sketch_table_get_count(struct statsd_sketch_table *tab) {
+  if (tab == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return tab->count;
+}
@@ -0,0 +1,107 @@
+/*
+ * ProFTPD - mod_statsd timer sketch API
+ * Copyright (c) 2026 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#ifndef MOD_STATSD_SKETCH_H
+#define MOD_STATSD_SKETCH_H
+
+#include "mod_statsd.h"
+
+struct statsd_sketch;
+struct statsd_sketch_table;
+
+/* A sketch is a DDSketch: timings are counted in logarithmically sized
+ * buckets, such that any quantile is reported to within the configured
+ * relative accuracy.  The number of buckets is fixed; should the timings
+ * span more buckets than that, the lowest buckets are collapsed together,
+ * sacrificing the accuracy of the lowest quantiles first.
+ */
+#define STATSD_SKETCH_MAX_BUCKETS		1024
+
+/* Relative accuracy limits, and default, as fractions.  With the fixed
+ * number of buckets, the lower limit still covers timings spanning more
+ * than four orders of magnitude.
+ */
+#define STATSD_SKETCH_MIN_ACCURACY		0.005
+#define STATSD_SKETCH_MAX_ACCURACY		0.1
+#define STATSD_SKETCH_DEFAULT_ACCURACY		0.01
+
+struct statsd_sketch *statsd_sketch_create(pool *p, float accuracy);
+
+int statsd_sketch_add(struct statsd_sketch *sketch, uint64_t val);
+
+/* Adds the timings of the source sketch into the destination sketch; both
+ * sketches MUST have the same accuracy.
+ */
+int statsd_sketch_merge(struct statsd_sketch *dst,
+  const struct statsd_sketch *src);
+
+/* Provides the estimated value of the given quantile, between 0.0 and 1.0.
+ * Returns -1, with errno set to ENOENT, if the sketch is empty.
+ */
+int statsd_sketch_get_quantile(const struct statsd_sketch *sketch, double q,
+  uint64_t *val);
+
+uint64_t statsd_sketch_get_count(const struct statsd_sketch *sketch);
+uint64_t statsd_sketch_get_max(const struct statsd_sketch *sketch);
+
+int statsd_sketch_reset(struct statsd_sketch *sketch);
+
+/* The sketch table is a fixed-size, open addressing hash table of sketches,
+ * keyed by timer name, in which a session summarizes its timers between
+ * flushes.
+ */
+#define STATSD_SKETCH_MAX_SERIES		64
+#define STATSD_SKETCH_MAX_NAME_SIZE		128
+
+/* The sketch table should be flushed once this many seconds have passed
+ * since the last flush.
+ */
+#define STATSD_SKETCH_FLUSH_INTERVAL		10
+
+struct statsd_sketch_table *statsd_sketch_table_create(pool *p,
+  float accuracy);
+int statsd_sketch_table_destroy(struct statsd_sketch_table *tab);
+
+/* Adds the timing, sampled at the given rate (1.0 if not sampled), to the
+ * named sketch.  Returns -1, with errno set to ENOSPC, if there is no room for
+ * a new sketch, in which case the caller should flush the table.
+ */
+int statsd_sketch_table_add(struct statsd_sketch_table *tab, float sampling,
+  const char *name, uint64_t val);
+
+/* Returns TRUE if the table should be flushed, per the interval threshold. */
+int statsd_sketch_table_should_flush(struct statsd_sketch_table *tab);
+
+/* Calls the given callback for each non-empty sketch, then empties the
+ * table.
+ */
+int statsd_sketch_table_flush(struct statsd_sketch_table *tab,
+  int (*cb)(const char *, size_t, float, const struct statsd_sketch *,
+    void *),
+  void *user_data);
+
+/* Returns the number of sketches in the table. */
+unsigned int statsd_sketch_table_get_count(struct statsd_sketch_table *tab);
+
+#endif /* MOD_STATSD_SKETCH_H */
@@ -1,6 +1,6 @@
 /*
  * ProFTPD: mod_statsd Statsd API
- * Copyright (c) 2017-2025 TJ Saunders
+ * Copyright (c) 2017-2026 TJ Saunders
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -22,313 +22,1766 @@
  * distribution.
  */
 
+/* For sendmmsg(2) and struct mmsghdr. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
+
 #include "statsd.h"
 
+#include <poll.h>
+
+#if defined(HAVE_IFADDRS_H)
+# include <ifaddrs.h>
+#endif /* HAVE_IFADDRS_H */
+
+#if defined(HAVE_NET_IF_H)
+# include <net/if.h>
+#endif /* HAVE_NET_IF_H */
+
+#if defined(HAVE_SYS_IOCTL_H)
+# include <sys/ioctl.h>
+#endif /* HAVE_SYS_IOCTL_H */
+
+#if defined(HAVE_SYS_RANDOM_H)
+# include <sys/random.h>
+#endif /* HAVE_SYS_RANDOM_H */
+
+/* The max number of decimal places used when formatting sampling rates. */
+#define STATSD_SAMPLING_MAX_PRECISION	12
+
 struct statsd {
   pool *pool;
 
+  /* The statsd server address, or the path to its Unix domain socket. */
   const pr_netaddr_t *addr;
+  const char *path;
+  const char *server;
   int fd;
 
+  /* Whether the socket was provided by the caller, e.g. inherited from the
+   * daemon process, and may thus be shared with other processes.
+   */
+  int fd_shared;
+
   /* For knowing how to handle newlines in the metrics. */
   int use_tcp;
 
-  /* Sampling */
-  float sampling;
+  /* Sampling, prepared once; the random values for sampling decisions come
+   * from a per-client xorshift64* generator.
+   */
+  struct statsd_sampling sampling;
+  uint64_t prng_state;
 
   /* Namespacing */
   const char *prefix;
+  size_t prefixlen;
   const char *suffix;
+  size_t suffixlen;
 
-  /* Pending metrics */
-  pool *metrics_pool;
+  /* Pending metrics; this buffer is allocated once, when the client is
+   * opened, and reused for the lifetime of the client.  For UDP, the buffer
+   * holds a batch of packets, laid out back to back; the packet currently
+   * being filled starts at the metrics_pktstart offset.
+   */
   char *metrics_buf;
+  size_t metrics_bufsz;
   size_t metrics_buflen;
+
+  size_t max_pktsz;
+  size_t metrics_pktsz;
+  unsigned int metrics_maxpkts;
+  size_t metrics_pktstart;
+  size_t metrics_pktends[STATSD_MAX_BATCH_PACKETS];
+  unsigned int metrics_npkts;
+
+  /* Whether to try sending batches of packets using sendmmsg(2). */
+  int use_sendmmsg;
+
+  /* When the statsd server was last found to be unreachable, we do not try
+   * to send metrics again until this time.
+   */
+  time_t unreachable_until;
+
+  /* For TCP, metrics are queued in a fixed-size ring buffer, which is drained
+   * whenever the (non-blocking) socket is writable.  Metrics which do not fit
+   * are dropped, and counted.
+   */
+  char *tcp_ring;
+  size_t tcp_ring_head;
+  size_t tcp_ring_len;
+
+  /* Metrics are coalesced in the ring buffer, and sent with a single write,
+   * at flush time or once this many bytes (up to the max packet size) have
+   * been queued since the last write.
+   */
+  size_t tcp_unsent;
+  int tcp_state;
+  int tcp_midline;
+  unsigned int tcp_backoff;
+  time_t tcp_reconnect_at;
+  unsigned long dropped;
+
+  /* The shared arena, if any, for counters and gauges. */
+  struct statsd_arena *arena;
+
+  /* The aggregate, if any, for counters and timers. */
+  struct statsd_aggregate *aggregate;
+
+  /* The sketch table, if any, for timers. */
+  struct statsd_sketch_table *sketches;
 };
 
+#define STATSD_TCP_STATE_DISCONNECTED	0
+#define STATSD_TCP_STATE_CONNECTING	1
+#define STATSD_TCP_STATE_CONNECTED	2
+
 static int statsd_proto_tcp = IPPROTO_TCP;
 static int statsd_proto_udp = IPPROTO_UDP;
 
 static const char *trace_channel = "statsd.statsd";
 
-struct statsd *statsd_statsd_open(pool *p, const pr_netaddr_t *addr,
-    int use_tcp, float sampling, const char *prefix, const char *suffix) {
-  int family, fd, xerrno;
-  pool *sub_pool;
-  struct statsd *statsd;
+/* Sizes the pending metrics buffer for the given max packet size.  The
+ * buffer is only (re)allocated if the existing buffer is too small.
+ */
+static void set_metrics_bufsz(struct statsd *statsd, size_t max_pktsz) {
+  size_t bufsz;
 
-  if (p == NULL ||
-      addr == NULL) {
-    errno = EINVAL;
-    return NULL;
+  statsd->max_pktsz = max_pktsz;
+
+  if (statsd->use_tcp == TRUE) {
+    /* For TCP, each metric is encoded individually, then queued, with a
+     * trailing newline, in the TCP ring buffer.
+     */
+    statsd->metrics_pktsz = max_pktsz + 1;
+    statsd->metrics_maxpkts = 1;
+
+  } else {
+    statsd->metrics_pktsz = max_pktsz;
+
+    /* Limit the number of batched packets, lest large packet sizes lead to
+     * a very large buffer.
+     */
+    statsd->metrics_maxpkts = STATSD_MAX_BATCH_BUFSZ / max_pktsz;
+    if (statsd->metrics_maxpkts > STATSD_MAX_BATCH_PACKETS) {
+      statsd->metrics_maxpkts = STATSD_MAX_BATCH_PACKETS;
+
+    } else if (statsd->metrics_maxpkts == 0) {
+      statsd->metrics_maxpkts = 1;
+    }
   }
 
-  if (sampling < 0.0 ||
-      sampling > 1.0) {
-    errno = EINVAL;
-    return NULL;
+  bufsz = statsd->metrics_pktsz * statsd->metrics_maxpkts;
+  if (bufsz > statsd->metrics_bufsz) {
+    statsd->metrics_buf = palloc(statsd->pool, bufsz);
+    statsd->metrics_bufsz = bufsz;
   }
 
-  family = pr_netaddr_get_family(addr);
+  statsd->metrics_buflen = 0;
+  statsd->metrics_pktstart = 0;
+  statsd->metrics_npkts = 0;
+}
 
-  if (use_tcp == TRUE) {
-    fd = socket(family, SOCK_STREAM, statsd_proto_tcp);
+#if defined(HAVE_GETIFADDRS) && defined(SIOCGIFMTU)
+static int get_ifaddr_mtu(int fd, const char *ifname) {
+  struct ifreq ifr;
 
-  } else {
-    fd = socket(family, SOCK_DGRAM, statsd_proto_udp);
+  memset(&ifr, 0, sizeof(ifr));
+  sstrncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+
+  if (ioctl(fd, SIOCGIFMTU, &ifr) < 0) {
+    pr_trace_msg(trace_channel, 3, "error getting MTU for interface '%s': %s",
+      ifname, strerror(errno));
+    return -1;
   }
 
-  xerrno = errno;
+  return ifr.ifr_mtu;
+}
+
+/* Returns TRUE if the given address is on the network of the given interface
+ * address/netmask.
+ */
+static int ifaddr_has_addr(const struct ifaddrs *ifa,
+    const struct sockaddr *sa) {
+  register unsigned int i;
+  const unsigned char *addr, *ifaddr, *netmask;
+  size_t addrlen;
+
+  if (ifa->ifa_netmask == NULL) {
+    return FALSE;
+  }
+
+  switch (sa->sa_family) {
+    case AF_INET:
+      addr = (const unsigned char *)
+        &(((const struct sockaddr_in *) sa)->sin_addr);
+      ifaddr = (const unsigned char *)
+        &(((const struct sockaddr_in *) ifa->ifa_addr)->sin_addr);
+      netmask = (const unsigned char *)
+        &(((const struct sockaddr_in *) ifa->ifa_netmask)->sin_addr);
+      addrlen = sizeof(struct in_addr);
+      break;
+
+#if defined(PR_USE_IPV6)
+    case AF_INET6:
+      addr = (const unsigned char *)
+        &(((const struct sockaddr_in6 *) sa)->sin6_addr);
+      ifaddr = (const unsigned char *)
+        &(((const struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr);
+      netmask = (const unsigned char *)
+        &(((const struct sockaddr_in6 *) ifa->ifa_netmask)->sin6_addr);
+      addrlen = sizeof(struct in6_addr);
+      break;
+#endif /* PR_USE_IPV6 */
+
+    default:
+      return FALSE;
+  }
+
+  for (i = 0; i < addrlen; i++) {
+    if ((addr[i] & netmask[i]) != (ifaddr[i] & netmask[i])) {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+#endif /* HAVE_GETIFADDRS and SIOCGIFMTU */
 
+/* Determines the max packet size to use, based on the MTU of the interface
+ * used to reach the statsd server, if that server is on the loopback or
+ * on a directly connected network.  Otherwise, the default packet size is
+ * used, as the path MTU is unknown.  Unix domain sockets, including the
+ * relay socket, have no MTU, and use their own default.
+ */
+static size_t get_auto_packet_size(struct statsd *statsd) {
+  size_t pktsz = STATSD_MAX_UDP_PACKET_SIZE;
+#if defined(HAVE_GETIFADDRS) && defined(SIOCGIFMTU)
+  struct ifaddrs *ifaddrs = NULL, *ifa;
+  const struct sockaddr *sa;
+  int family, fd, is_loopback, mtu = -1;
+#endif /* HAVE_GETIFADDRS and SIOCGIFMTU */
+
+  if (statsd->path != NULL ||
+      statsd->addr == NULL) {
+    return STATSD_MAX_UNIX_PACKET_SIZE;
+  }
+
+#if defined(HAVE_GETIFADDRS) && defined(SIOCGIFMTU)
+
+  if (getifaddrs(&ifaddrs) < 0) {
+    pr_trace_msg(trace_channel, 3, "error getting interface addresses: %s",
+      strerror(errno));
+    return pktsz;
+  }
+
+  family = pr_netaddr_get_family(statsd->addr);
+  sa = pr_netaddr_get_sockaddr(statsd->addr);
+  is_loopback = pr_netaddr_is_loopback(statsd->addr);
+
+  /* A TCP client may not have a socket yet, e.g. while waiting to
+   * reconnect; any socket will do for querying the interface MTU.
+   */
+  fd = statsd->fd;
   if (fd < 0) {
-    pr_trace_msg(trace_channel, 1, "error opening %s %s socket: %s",
-      family == AF_INET ? "IPv4" : "IPv6", use_tcp ? "TCP" : "UDP",
-      strerror(xerrno));
-    errno = xerrno;
-    return NULL;
+    fd = socket(family, SOCK_DGRAM, statsd_proto_udp);
   }
 
-  if (use_tcp == TRUE) {
-    int res;
-#if defined(TCP_NODELAY)
-    int nodelay = 1;
-#endif /* TCP_NODELAY */
+  for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL ||
+        ifa->ifa_addr->sa_family != family ||
+        !(ifa->ifa_flags & IFF_UP)) {
+      continue;
+    }
 
-    res = connect(fd, pr_netaddr_get_sockaddr(addr),
-      pr_netaddr_get_sockaddr_len(addr));
-    xerrno = errno;
+    if (is_loopback == TRUE) {
+      if (!(ifa->ifa_flags & IFF_LOOPBACK)) {
+        continue;
+      }
 
-    if (res < 0) {
-      pr_trace_msg(trace_channel, 1,
-        "error connecting %s TCP socket to %s:%d: %s",
-        family == AF_INET ? "IPv4" : "IPv6", pr_netaddr_get_ipstr(addr),
-        ntohs(pr_netaddr_get_port(addr)), strerror(xerrno));
-      (void) close(fd);
-      errno = xerrno;
-      return NULL;
+    } else if (ifaddr_has_addr(ifa, sa) != TRUE) {
+      continue;
     }
 
-#if defined(TCP_NODELAY)
-    /* Disable Nagle by default. */
-    res = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &nodelay,
-      sizeof(nodelay));
-    if (res < 0) {
-      pr_trace_msg(trace_channel, 1,
-        "error setting TCP_NODELAY=%d on TCP socket: %s", nodelay,
-        strerror(errno));
+    mtu = get_ifaddr_mtu(fd, ifa->ifa_name);
+    if (mtu > 0) {
+      pr_trace_msg(trace_channel, 9,
+        "using MTU %d of interface '%s' for statsd server %s", mtu,
+        ifa->ifa_name, statsd->server);
+      break;
     }
-#endif /* TCP_NODELAY */
   }
 
+  freeifaddrs(ifaddrs);
+
+  if (fd != statsd->fd &&
+      fd >= 0) {
+    (void) close(fd);
+  }
+
+  if (mtu > 0) {
+    size_t hdrsz;
+
+    /* Account for the IP and UDP/TCP headers. */
+    hdrsz = (family == AF_INET ? 20 : 40) + (statsd->use_tcp == TRUE ? 20 : 8);
+    if ((size_t) mtu > hdrsz) {
+      pktsz = mtu - hdrsz;
+    }
+
+    if (pktsz > STATSD_MAX_PACKET_SIZE_LIMIT) {
+      pktsz = STATSD_MAX_PACKET_SIZE_LIMIT;
+
+    } else if (pktsz < STATSD_MAX_UDP_PACKET_SIZE) {
+      pktsz = STATSD_MAX_UDP_PACKET_SIZE;
+    }
+  }
+#endif /* HAVE_GETIFADDRS and SIOCGIFMTU */
+
+  return pktsz;
+}
+
+static const char *get_port_text(pool *p, int port) {
+  char buf[32];
+
+  memset(buf, '\0', sizeof(buf));
+  snprintf(buf, sizeof(buf)-1, "%d", port);
+  return pstrdup(p, buf);
+}
+
+/* Seeds the sampling PRNG, preferably from the kernel; otherwise, from the
+ * time and process ID, which is still distinct for each session.
+ */
+static uint64_t get_prng_seed(struct statsd *statsd) {
+  uint64_t seed = 0;
+  struct timeval tv;
+
+#if defined(HAVE_GETRANDOM)
+  if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != sizeof(seed)) {
+    seed = 0;
+  }
+#endif /* HAVE_GETRANDOM */
+
+  if (seed == 0) {
+    gettimeofday(&tv, NULL);
+    seed = (((uint64_t) tv.tv_sec) << 32) ^ ((uint64_t) tv.tv_usec) ^
+      (((uint64_t) getpid()) << 16) ^ ((uint64_t) (uintptr_t) statsd);
+  }
+
+  /* Mix the seed (splitmix64), so that similar seeds, e.g. from sessions
+   * started at the same time, still lead to unrelated sequences.
+   */
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  seed ^= (seed >> 31);
+
+  /* The xorshift state must never be zero. */
+  if (seed == 0) {
+    seed = 0x9e3779b97f4a7c15ULL;
+  }
+
+  return seed;
+}
+
+static uint32_t get_prng_next(struct statsd *statsd) {
+  uint64_t x;
+
+  x = statsd->prng_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  statsd->prng_state = x;
+
+  return (uint32_t) ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static void prepare_sampling(struct statsd_sampling *sampling, float rate) {
+  sampling->rate = rate;
+  sampling->suffixlen = 0;
+
+  /* Format the sampling rate text once, rather than for every metric. */
+  if (rate < 1.0) {
+    int res;
+
+    res = statsd_statsd_format_sampling(sampling->suffix,
+      sizeof(sampling->suffix), rate);
+    if (res > 0) {
+      sampling->suffixlen = res;
+    }
+
+    sampling->threshold = (uint64_t) (rate * 4294967296.0);
+
+  } else {
+    sampling->suffix[0] = '\0';
+    sampling->threshold = ((uint64_t) 1) << 32;
+  }
+}
+
+static void set_sampling(struct statsd *statsd, float sampling) {
+  prepare_sampling(&(statsd->sampling), sampling);
+
+  if (sampling < 1.0 &&
+      statsd->prng_state == 0) {
+    statsd->prng_state = get_prng_seed(statsd);
+  }
+}
+
+static struct statsd *alloc_statsd(pool *p, int fd, int use_tcp,
+    size_t max_pktsz, float sampling, const char *prefix, const char *suffix) {
+  pool *sub_pool;
+  struct statsd *statsd;
+
   sub_pool = make_sub_pool(p);
   pr_pool_tag(sub_pool, "Statsd Client Pool");
 
   statsd = pcalloc(sub_pool, sizeof(struct statsd));
   statsd->pool = sub_pool;
-  statsd->addr = addr;
   statsd->fd = fd;
   statsd->use_tcp = use_tcp;
-  statsd->sampling = sampling;
+
+#if defined(HAVE_SENDMMSG)
+  if (use_tcp == FALSE) {
+    statsd->use_sendmmsg = TRUE;
+  }
+#endif /* HAVE_SENDMMSG */
+
+  set_metrics_bufsz(statsd, max_pktsz);
+
+  set_sampling(statsd, sampling);
 
   if (prefix != NULL) {
     statsd->prefix = pstrdup(statsd->pool, prefix);
+    statsd->prefixlen = strlen(prefix);
   }
 
   if (suffix != NULL) {
     statsd->suffix = pstrdup(statsd->pool, suffix);
+    statsd->suffixlen = strlen(suffix);
   }
 
   return statsd;
 }
 
-int statsd_statsd_close(struct statsd *statsd) {
-  if (statsd == NULL) {
-    errno = EINVAL;
-    return -1;
+static void tcp_disconnect(struct statsd *statsd) {
+  if (statsd->fd >= 0) {
+    (void) close(statsd->fd);
+    statsd->fd = -1;
   }
 
-  /* Flush any pending metrics. */
-  (void) statsd_statsd_flush(statsd);
+  statsd->tcp_state = STATSD_TCP_STATE_DISCONNECTED;
 
-  (void) close(statsd->fd);
-  destroy_pool(statsd->pool);
+  /* If we only sent part of a metric, the remainder of that metric is useless
+   * on a new connection; discard it.
+   */
+  if (statsd->tcp_midline == TRUE) {
+    while (statsd->tcp_ring_len > 0) {
+      char c;
 
-  return 0;
+      c = statsd->tcp_ring[statsd->tcp_ring_head];
+      statsd->tcp_ring_head = (statsd->tcp_ring_head + 1) % STATSD_TCP_RING_SIZE;
+      statsd->tcp_ring_len--;
+
+      if (c == '\n') {
+        break;
+      }
+    }
+
+    statsd->tcp_midline = FALSE;
+  }
+
+  statsd->tcp_reconnect_at = time(NULL) + statsd->tcp_backoff;
+  pr_trace_msg(trace_channel, 3,
+    "no connection to statsd server %s, reconnecting in %u secs",
+    statsd->server, statsd->tcp_backoff);
+
+  statsd->tcp_backoff *= 2;
+  if (statsd->tcp_backoff > STATSD_TCP_MAX_BACKOFF_SECS) {
+    statsd->tcp_backoff = STATSD_TCP_MAX_BACKOFF_SECS;
+  }
 }
 
-int statsd_statsd_get_namespacing(struct statsd *statsd, const char **prefix,
-    const char **suffix) {
+static void tcp_connected(struct statsd *statsd) {
+  pr_trace_msg(trace_channel, 9, "connected to statsd server %s",
+    statsd->server);
+  statsd->tcp_state = STATSD_TCP_STATE_CONNECTED;
+  statsd->tcp_backoff = STATSD_TCP_MIN_BACKOFF_SECS;
+}
 
-  if (statsd == NULL) {
-    errno = EINVAL;
+/* Starts a non-blocking connect to the statsd server.  The connection will
+ * usually still be in progress when this returns.
+ */
+static int tcp_connect(struct statsd *statsd) {
+  int family, fd, flags, res, xerrno;
+
+  family = pr_netaddr_get_family(statsd->addr);
+  fd = socket(family, SOCK_STREAM, statsd_proto_tcp);
+  xerrno = errno;
+
+  if (fd < 0) {
+    pr_trace_msg(trace_channel, 1, "error opening %s TCP socket: %s",
+      family == AF_INET ? "IPv4" : "IPv6", strerror(xerrno));
+    tcp_disconnect(statsd);
+    errno = xerrno;
     return -1;
   }
 
-  if (prefix == NULL &&
-      suffix == NULL) {
-    errno = EINVAL;
+  flags = fcntl(fd, F_GETFL);
+  if (fcntl(fd, F_SETFL, flags|O_NONBLOCK) < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 1,
+      "error making TCP socket non-blocking: %s", strerror(xerrno));
+    (void) close(fd);
+    tcp_disconnect(statsd);
+    errno = xerrno;
     return -1;
   }
 
-  if (prefix != NULL) {
-    *prefix = statsd->prefix;
+#if defined(TCP_NODELAY)
+  {
+    int nodelay = 1;
+
+    /* Disable Nagle by default. */
+    res = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &nodelay,
+      sizeof(nodelay));
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 1,
+        "error setting TCP_NODELAY=%d on TCP socket: %s", nodelay,
+        strerror(errno));
+    }
   }
+#endif /* TCP_NODELAY */
 
-  if (suffix != NULL) {
-    *suffix = statsd->suffix;
+  statsd->fd = fd;
+
+  res = connect(fd, pr_netaddr_get_sockaddr(statsd->addr),
+    pr_netaddr_get_sockaddr_len(statsd->addr));
+  xerrno = errno;
+
+  if (res == 0) {
+    tcp_connected(statsd);
+    return 0;
   }
 
-  return 0;
+  if (xerrno == EINPROGRESS ||
+      xerrno == EINTR) {
+    pr_trace_msg(trace_channel, 19, "connecting to statsd server %s",
+      statsd->server);
+    statsd->tcp_state = STATSD_TCP_STATE_CONNECTING;
+    return 0;
+  }
+
+  pr_trace_msg(trace_channel, 5, "error connecting to statsd server %s: %s",
+    statsd->server, strerror(xerrno));
+  tcp_disconnect(statsd);
+  errno = xerrno;
+  return -1;
 }
 
-pool *statsd_statsd_get_pool(struct statsd *statsd) {
-  if (statsd == NULL) {
-    errno = EINVAL;
-    return NULL;
+/* Checks, without blocking, whether a pending connect has completed.  Returns
+ * TRUE if connected, FALSE if still connecting, and -1 on error.
+ */
+static int tcp_check_connect(struct statsd *statsd) {
+  int res, xerrno = 0;
+  struct pollfd pfd;
+  socklen_t errlen;
+
+  /* Use poll(2), not select(2); a long-lived session may well have fds
+   * beyond FD_SETSIZE.
+   */
+  pfd.fd = statsd->fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  res = poll(&pfd, 1, 0);
+  if (res <= 0) {
+    return FALSE;
   }
 
-  return statsd->pool;
-}
+  errlen = sizeof(xerrno);
+  if (getsockopt(statsd->fd, SOL_SOCKET, SO_ERROR, (void *) &xerrno,
+      &errlen) < 0) {
+    xerrno = errno;
+  }
 
-float statsd_statsd_get_sampling(struct statsd *statsd) {
-  if (statsd == NULL) {
-    errno = EINVAL;
-    return -1.0;
+  if (xerrno != 0) {
+    pr_trace_msg(trace_channel, 5, "error connecting to statsd server %s: %s",
+      statsd->server, strerror(xerrno));
+    tcp_disconnect(statsd);
+    errno = xerrno;
+    return -1;
   }
 
-  return statsd->sampling;
+  tcp_connected(statsd);
+  return TRUE;
 }
 
-int statsd_statsd_set_fd(struct statsd *statsd, int fd) {
-  if (statsd == NULL) {
-    errno = EINVAL;
+/* Queues the given data in the TCP ring buffer.  Data which does not fit is
+ * dropped, rather than waiting for the statsd server.
+ */
+static int tcp_enqueue(struct statsd *statsd, const char *data, size_t len) {
+  size_t tail, taillen;
+
+  if (len > (STATSD_TCP_RING_SIZE - statsd->tcp_ring_len)) {
+    statsd->dropped++;
+    pr_trace_msg(trace_channel, 17,
+      "TCP queue for statsd server %s full (%lu bytes), dropping metric "
+      "(%lu dropped)", statsd->server, (unsigned long) statsd->tcp_ring_len,
+      statsd->dropped);
+    errno = ENOSPC;
     return -1;
   }
 
-  (void) close(statsd->fd);
-  statsd->fd = fd;
+  tail = (statsd->tcp_ring_head + statsd->tcp_ring_len) % STATSD_TCP_RING_SIZE;
+  taillen = STATSD_TCP_RING_SIZE - tail;
+  if (taillen > len) {
+    taillen = len;
+  }
 
+  memcpy(statsd->tcp_ring + tail, data, taillen);
+  if (taillen < len) {
+    memcpy(statsd->tcp_ring, data + taillen, len - taillen);
+  }
+
+  statsd->tcp_ring_len += len;
   return 0;
 }
 
-static void send_metrics(struct statsd *statsd, const void *buf, size_t len) {
-  if (statsd->addr != NULL) {
-    int res, xerrno;
+/* Sends as much of the TCP ring buffer as the socket will take, without
+ * blocking, (re)connecting to the statsd server as needed.
+ */
+static int tcp_drain(struct statsd *statsd) {
+  statsd->tcp_unsent = 0;
 
-    while (TRUE) {
-      res = sendto(statsd->fd, buf, len, 0, pr_netaddr_get_sockaddr(statsd->addr),
-        pr_netaddr_get_sockaddr_len(statsd->addr));
-      xerrno = errno;
+  if (statsd->tcp_ring_len == 0) {
+    return 0;
+  }
 
-      if (res < 0) {
-        if (xerrno == EINTR) {
-          pr_signals_handle();
-          continue;
-        }
+  if (statsd->tcp_state == STATSD_TCP_STATE_DISCONNECTED) {
+    if (time(NULL) < statsd->tcp_reconnect_at) {
+      errno = ECONNREFUSED;
+      return -1;
+    }
 
-        pr_trace_msg(trace_channel, 5,
-          "error sending %lu bytes of metrics data to %s:%d: %s",
-          (unsigned long) len, pr_netaddr_get_ipstr(statsd->addr),
-          ntohs(pr_netaddr_get_port(statsd->addr)), strerror(xerrno));
-        errno = xerrno;
+    if (tcp_connect(statsd) < 0) {
+      return -1;
+    }
+  }
 
-      } else {
-        /* XXX Should we watch for short writes? */
-        pr_trace_msg(trace_channel, 19,
-          "sent %d bytes of metrics data (of %lu bytes pending) to %s:%d", res,
-          (unsigned long) len, pr_netaddr_get_ipstr(statsd->addr),
-          ntohs(pr_netaddr_get_port(statsd->addr)));
-      }
+  if (statsd->tcp_state == STATSD_TCP_STATE_CONNECTING) {
+    int res;
 
-      break;
+    res = tcp_check_connect(statsd);
+    if (res != TRUE) {
+      return res < 0 ? -1 : 0;
     }
   }
-}
 
-static void clear_metrics(struct statsd *statsd) {
-  if (statsd->metrics_pool != NULL) {
-    destroy_pool(statsd->metrics_pool);
-  }
-  statsd->metrics_pool = NULL;
-  statsd->metrics_buf = NULL;
-  statsd->metrics_buflen = 0;
-}
+  while (statsd->tcp_ring_len > 0) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    int iovlen = 1, flags = 0;
+    ssize_t res;
+    size_t headlen, last;
 
-int statsd_statsd_write(struct statsd *statsd, const char *metric,
-    size_t metric_len, int flags) {
+    headlen = STATSD_TCP_RING_SIZE - statsd->tcp_ring_head;
+    iov[0].iov_base = statsd->tcp_ring + statsd->tcp_ring_head;
 
-  if (statsd == NULL ||
-      metric == NULL ||
-      metric_len == 0) {
-    errno = EINVAL;
-    return -1;
-  }
+    if (statsd->tcp_ring_len > headlen) {
+      iov[0].iov_len = headlen;
+      iov[1].iov_base = statsd->tcp_ring;
+      iov[1].iov_len = statsd->tcp_ring_len - headlen;
+      iovlen = 2;
 
-  pr_trace_msg(trace_channel, 19, "adding statsd metric: '%.*s'",
-    (int) metric_len, metric);
+    } else {
+      iov[0].iov_len = statsd->tcp_ring_len;
+    }
 
-  if (statsd->use_tcp == TRUE) {
-    /* When we have a TCP connection, there is no need/value in buffering
-     * the metrics into fewer packets.  Is there?
-     */
-    flags |= STATSD_STATSD_FL_SEND_NOW;
-  }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
 
-  if (statsd->use_tcp == TRUE) {
-    /* No need to worry about existing buffered metrics; for TCP we will have
-     * sent them already.
-     */
-    statsd->metrics_pool = make_sub_pool(statsd->pool);
-    pr_pool_tag(statsd->metrics_pool, "Statsd buffered metrics pool");
+#if defined(MSG_NOSIGNAL)
+    flags |= MSG_NOSIGNAL;
+#endif /* MSG_NOSIGNAL */
 
-    /* Note that we MUST add a newline for TCP-sent metrics; there are no
-     * packet boundaries (it's a stream, not a datagram) for delimiting.
-     */
-    statsd->metrics_buf = pstrcat(statsd->pool,
-      pstrndup(statsd->metrics_pool, metric, metric_len), "\n", NULL);
-    statsd->metrics_buflen = metric_len + 1;
+    res = sendmsg(statsd->fd, &msg, flags);
+    if (res < 0) {
+      int xerrno = errno;
 
-  } else {
-    /* Would this metric put us over the max packet size?  If so, flush the
-     * metrics now.
-     */
-    if (statsd->metrics_buf != NULL) {
-      if ((statsd->metrics_buflen + metric_len + 1) > STATSD_MAX_UDP_PACKET_SIZE) {
-        send_metrics(statsd, statsd->metrics_buf, statsd->metrics_buflen);
-        clear_metrics(statsd);
+      if (xerrno == EINTR) {
+        pr_signals_handle();
+        continue;
       }
-    }
 
-    if (statsd->metrics_buf != NULL) {
-      statsd->metrics_buf = pstrcat(statsd->metrics_pool, statsd->metrics_buf,
-        "\n", metric, NULL);
-      statsd->metrics_buflen += (metric_len + 1);
+      if (xerrno == EAGAIN ||
+          xerrno == EWOULDBLOCK) {
+        pr_trace_msg(trace_channel, 19,
+          "statsd server %s not ready, %lu bytes of metrics data queued",
+          statsd->server, (unsigned long) statsd->tcp_ring_len);
+        break;
+      }
+
+      pr_trace_msg(trace_channel, 5,
+        "error sending %lu bytes of metrics data to %s: %s",
+        (unsigned long) statsd->tcp_ring_len, statsd->server,
+        strerror(xerrno));
+      tcp_disconnect(statsd);
+      errno = xerrno;
+      return -1;
+    }
+
+    pr_trace_msg(trace_channel, 19,
+      "sent %ld bytes of metrics data (of %lu bytes pending) to %s",
+      (long) res, (unsigned long) statsd->tcp_ring_len, statsd->server);
+
+    last = (statsd->tcp_ring_head + res - 1) % STATSD_TCP_RING_SIZE;
+    statsd->tcp_midline = (statsd->tcp_ring[last] != '\n');
+
+    statsd->tcp_ring_head = (statsd->tcp_ring_head + res) % STATSD_TCP_RING_SIZE;
+    statsd->tcp_ring_len -= res;
+  }
+
+  return 0;
+}
+
+/* Opens a UDP socket, connected to the given address.  Connecting the UDP
+ * socket means that the destination address is not passed, and the route
+ * looked up, for every packet; it also means that ICMP errors, e.g. when the
+ * statsd server is not running, are reported to us as ECONNREFUSED.
+ */
+static int open_udp_socket(const pr_netaddr_t *addr) {
+  int family, fd, res, xerrno;
+
+  family = pr_netaddr_get_family(addr);
+  fd = socket(family, SOCK_DGRAM, statsd_proto_udp);
+  xerrno = errno;
+
+  if (fd < 0) {
+    pr_trace_msg(trace_channel, 1, "error opening %s UDP socket: %s",
+      family == AF_INET ? "IPv4" : "IPv6", strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  res = connect(fd, pr_netaddr_get_sockaddr(addr),
+    pr_netaddr_get_sockaddr_len(addr));
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "error connecting %s UDP socket to %s:%d: %s",
+      family == AF_INET ? "IPv4" : "IPv6", pr_netaddr_get_ipstr(addr),
+      ntohs(pr_netaddr_get_port(addr)), strerror(xerrno));
+    (void) close(fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Opens a Unix domain datagram socket, connected to the given path. */
+static int open_unix_socket(const char *path) {
+  int fd, res, xerrno;
+  struct sockaddr_un unix_addr;
+
+  if (strlen(path) >= sizeof(unix_addr.sun_path)) {
+    pr_trace_msg(trace_channel, 1, "Unix domain socket path '%s' too long",
+      path);
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  xerrno = errno;
+
+  if (fd < 0) {
+    pr_trace_msg(trace_channel, 1, "error opening Unix domain socket: %s",
+      strerror(xerrno));
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  sstrncpy(unix_addr.sun_path, path, sizeof(unix_addr.sun_path));
+
+  res = connect(fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr));
+  xerrno = errno;
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 1,
+      "error connecting Unix domain socket to '%s': %s", path,
+      strerror(xerrno));
+    (void) close(fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  return fd;
+}
+
+static struct statsd *alloc_udp_statsd(pool *p, int fd,
+    const pr_netaddr_t *addr, float sampling, const char *prefix,
+    const char *suffix) {
+  struct statsd *statsd;
+
+  statsd = alloc_statsd(p, fd, FALSE, STATSD_MAX_UDP_PACKET_SIZE, sampling,
+    prefix, suffix);
+  statsd->addr = addr;
+  statsd->server = pstrcat(statsd->pool, pr_netaddr_get_ipstr(addr), ":",
+    get_port_text(statsd->pool, ntohs(pr_netaddr_get_port(addr))), NULL);
+
+  return statsd;
+}
+
+static struct statsd *alloc_unix_statsd(pool *p, int fd, const char *path,
+    float sampling, const char *prefix, const char *suffix) {
+  struct statsd *statsd;
+
+  /* Unix domain datagram sockets are not subject to network MTUs, and thus
+   * support larger packets by default.
+   */
+  statsd = alloc_statsd(p, fd, FALSE, STATSD_MAX_UNIX_PACKET_SIZE, sampling,
+    prefix, suffix);
+  statsd->path = pstrdup(statsd->pool, path);
+  statsd->server = statsd->path;
+
+  return statsd;
+}
+
+struct statsd *statsd_statsd_open(pool *p, const pr_netaddr_t *addr,
+    int use_tcp, float sampling, const char *prefix, const char *suffix) {
+  int fd;
+  struct statsd *statsd;
+
+  if (p == NULL ||
+      addr == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sampling < 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (use_tcp == TRUE) {
+    /* Never wait for the statsd server; a slow or dead server must not add
+     * latency to the session.  The connect is completed, and reattempted
+     * with backoff if need be, as metrics are sent; thus any connect error
+     * here is not fatal.
+     */
+    statsd = alloc_statsd(p, -1, TRUE, STATSD_MAX_UDP_PACKET_SIZE, sampling,
+      prefix, suffix);
+    statsd->addr = pr_netaddr_dup(statsd->pool, addr);
+    statsd->server = pstrcat(statsd->pool, pr_netaddr_get_ipstr(addr), ":",
+      get_port_text(statsd->pool, ntohs(pr_netaddr_get_port(addr))), NULL);
+    statsd->tcp_ring = palloc(statsd->pool, STATSD_TCP_RING_SIZE);
+    statsd->tcp_backoff = STATSD_TCP_MIN_BACKOFF_SECS;
+
+    (void) tcp_connect(statsd);
+    return statsd;
+  }
+
+  fd = open_udp_socket(addr);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  return alloc_udp_statsd(p, fd, addr, sampling, prefix, suffix);
+}
+
+struct statsd *statsd_statsd_open_unix(pool *p, const char *path,
+    float sampling, const char *prefix, const char *suffix) {
+  int fd;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sampling < 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  fd = open_unix_socket(path);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  return alloc_unix_statsd(p, fd, path, sampling, prefix, suffix);
+}
+
+int statsd_statsd_open_socket(const pr_netaddr_t *addr, const char *path) {
+  if (addr == NULL &&
+      path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (path != NULL) {
+    return open_unix_socket(path);
+  }
+
+  return open_udp_socket(addr);
+}
+
+struct statsd *statsd_statsd_open_fd(pool *p, int fd,
+    const pr_netaddr_t *addr, const char *path, float sampling,
+    const char *prefix, const char *suffix) {
+  struct statsd *statsd;
+
+  if (p == NULL ||
+      fd < 0 ||
+      (addr == NULL && path == NULL)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sampling < 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (path != NULL) {
+    statsd = alloc_unix_statsd(p, fd, path, sampling, prefix, suffix);
+
+  } else {
+    statsd = alloc_udp_statsd(p, fd, addr, sampling, prefix, suffix);
+  }
+
+  /* The socket belongs to the caller; it is not closed with the client. */
+  statsd->fd_shared = TRUE;
+  return statsd;
+}
+
+struct statsd *statsd_statsd_open_relay(pool *p, int fd, float sampling,
+    const char *prefix, const char *suffix) {
+  struct statsd *statsd;
+
+  if (p == NULL ||
+      fd < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (sampling < 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  statsd = alloc_statsd(p, fd, FALSE, STATSD_MAX_UNIX_PACKET_SIZE, sampling,
+    prefix, suffix);
+  statsd->server = "relay";
+
+  /* The socket belongs to the caller; it is not closed with the client. */
+  statsd->fd_shared = TRUE;
+  return statsd;
+}
+
+int statsd_statsd_close(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Flush any pending metrics. */
+  (void) statsd_statsd_flush(statsd);
+
+  if (statsd->use_tcp == TRUE) {
+    if (statsd->tcp_ring_len > 0) {
+      pr_trace_msg(trace_channel, 5,
+        "discarding %lu bytes of unsent metrics data for statsd server %s",
+        (unsigned long) statsd->tcp_ring_len, statsd->server);
+    }
+
+    if (statsd->dropped > 0) {
+      pr_trace_msg(trace_channel, 5,
+        "dropped %lu metrics for statsd server %s due to full TCP queue",
+        statsd->dropped, statsd->server);
+    }
+  }
+
+  if (statsd->fd >= 0 &&
+      statsd->fd_shared == FALSE) {
+    (void) close(statsd->fd);
+  }
+
+  destroy_pool(statsd->pool);
+
+  return 0;
+}
+
+int statsd_statsd_get_namespacing(struct statsd *statsd, const char **prefix,
+    const char **suffix) {
+
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefix == NULL &&
+      suffix == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefix != NULL) {
+    *prefix = statsd->prefix;
+  }
+
+  if (suffix != NULL) {
+    *suffix = statsd->suffix;
+  }
+
+  return 0;
+}
+
+int statsd_statsd_get_namespacing_len(struct statsd *statsd,
+    size_t *prefixlen, size_t *suffixlen) {
+
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefixlen == NULL &&
+      suffixlen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (prefixlen != NULL) {
+    *prefixlen = statsd->prefixlen;
+  }
+
+  if (suffixlen != NULL) {
+    *suffixlen = statsd->suffixlen;
+  }
+
+  return 0;
+}
+
+int statsd_statsd_get_fd(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return statsd->fd;
+}
+
+pool *statsd_statsd_get_pool(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return statsd->pool;
+}
+
+int statsd_statsd_set_sampling(struct statsd *statsd, float sampling) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sampling <= 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sampling != statsd->sampling.rate) {
+    set_sampling(statsd, sampling);
+  }
+
+  return 0;
+}
+
+float statsd_statsd_get_sampling(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1.0;
+  }
+
+  return statsd->sampling.rate;
+}
+
+const struct statsd_sampling *statsd_statsd_get_prepared_sampling(
+    struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return &(statsd->sampling);
+}
+
+int statsd_statsd_prepare_sampling(struct statsd_sampling *sampling,
+    float rate) {
+  if (sampling == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (rate <= 0.0 ||
+      rate > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  prepare_sampling(sampling, rate);
+  return 0;
+}
+
+int statsd_statsd_should_sample_at(struct statsd *statsd,
+    const struct statsd_sampling *sampling) {
+  if (statsd == NULL ||
+      sampling == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sampling->threshold > 0xffffffffULL) {
+    return TRUE;
+  }
+
+  if (statsd->prng_state == 0) {
+    statsd->prng_state = get_prng_seed(statsd);
+  }
+
+  if ((uint64_t) get_prng_next(statsd) < sampling->threshold) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+int statsd_statsd_should_sample(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return statsd_statsd_should_sample_at(statsd, &(statsd->sampling));
+}
+
+int statsd_statsd_sample_once(float sampling) {
+  uint64_t threshold;
+
+  if (sampling < 0.0 ||
+      sampling > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  threshold = (uint64_t) (sampling * 4294967296.0);
+  if ((get_prng_seed(NULL) >> 32) < threshold) {
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+int statsd_statsd_format_sampling(char *buf, size_t bufsz, double rate) {
+  unsigned int precision = 2;
+  double scaled;
+  int len;
+
+  if (buf == NULL ||
+      rate <= 0.0 ||
+      rate > 1.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Use as many decimal places as needed for three significant digits, so
+   * that small rates are not rounded to zero; exponents are avoided, as not
+   * all statsd servers parse them.
+   */
+  scaled = rate * 100.0;
+  while (scaled < 100.0 &&
+         precision < STATSD_SAMPLING_MAX_PRECISION) {
+    scaled *= 10.0;
+    precision++;
+  }
+
+  len = snprintf(buf, bufsz, "|@%.*f", (int) precision, rate);
+  if (len < 0 ||
+      (size_t) len >= bufsz) {
+    errno = ENOSPC;
+    return -1;
+  }
+
+  /* Trim any trailing zeros, and then any trailing decimal point. */
+  while (buf[len-1] == '0') {
+    len--;
+  }
+
+  if (buf[len-1] == '.') {
+    len--;
+  }
+
+  buf[len] = '\0';
+  return len;
+}
+
+int statsd_statsd_set_arena(struct statsd *statsd,
+    struct statsd_arena *arena) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  statsd->arena = arena;
+  return 0;
+}
+
+struct statsd_arena *statsd_statsd_get_arena(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return statsd->arena;
+}
+
+int statsd_statsd_set_aggregate(struct statsd *statsd,
+    struct statsd_aggregate *agg) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  statsd->aggregate = agg;
+  return 0;
+}
+
+struct statsd_aggregate *statsd_statsd_get_aggregate(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
 
-    } else {
-      statsd->metrics_pool = make_sub_pool(statsd->pool);
-      pr_pool_tag(statsd->metrics_pool, "Statsd buffered metrics pool");
+  return statsd->aggregate;
+}
+
+int statsd_statsd_set_sketches(struct statsd *statsd,
+    struct statsd_sketch_table *tab) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  statsd->sketches = tab;
+  return 0;
+}
+
+struct statsd_sketch_table *statsd_statsd_get_sketches(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return statsd->sketches;
+}
+
+const char *statsd_statsd_get_sampling_suffix(struct statsd *statsd,
+    size_t *suffixlen) {
+  if (statsd == NULL ||
+      suffixlen == NULL) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  *suffixlen = statsd->sampling.suffixlen;
+  return statsd->sampling.suffix;
+}
+
+size_t statsd_statsd_get_max_packet_size(struct statsd *statsd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return 0;
+  }
+
+  return statsd->max_pktsz;
+}
+
+int statsd_statsd_set_max_packet_size(struct statsd *statsd, size_t pktsz) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (pktsz == 0) {
+    pktsz = get_auto_packet_size(statsd);
+  }
+
+  if (pktsz < STATSD_MIN_PACKET_SIZE_LIMIT ||
+      pktsz > STATSD_MAX_PACKET_SIZE_LIMIT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Flush any metrics buffered using the previous packet size. */
+  (void) statsd_statsd_flush(statsd);
+
+  pr_trace_msg(trace_channel, 17, "using max packet size of %lu bytes",
+    (unsigned long) pktsz);
+  set_metrics_bufsz(statsd, pktsz);
+
+  return 0;
+}
+
+int statsd_statsd_get_pending(struct statsd *statsd, const char **buf,
+    size_t *buflen) {
+  if (statsd == NULL ||
+      buf == NULL ||
+      buflen == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *buf = statsd->metrics_buf;
+  *buflen = statsd->metrics_buflen;
+  return 0;
+}
+
+int statsd_statsd_get_fill(struct statsd *statsd, unsigned int *fill_pct) {
+  size_t pendinglen;
+
+  if (statsd == NULL ||
+      fill_pct == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* For TCP, the pending metrics are those queued, but not yet written. */
+  if (statsd->use_tcp == TRUE) {
+    pendinglen = statsd->tcp_unsent;
+
+  } else {
+    pendinglen = statsd->metrics_buflen;
+  }
+
+  *fill_pct = (unsigned int) ((pendinglen * 100) / statsd->max_pktsz);
+  return 0;
+}
+
+int statsd_statsd_set_fd(struct statsd *statsd, int fd) {
+  if (statsd == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (statsd->fd >= 0 &&
+      statsd->fd_shared == FALSE) {
+    (void) close(statsd->fd);
+  }
+
+  statsd->fd = fd;
+  statsd->fd_shared = FALSE;
+
+  if (statsd->use_tcp == TRUE) {
+    statsd->tcp_state = fd >= 0 ? STATSD_TCP_STATE_CONNECTED :
+      STATSD_TCP_STATE_DISCONNECTED;
+  }
+
+  return 0;
+}
+
+int statsd_statsd_get_dropped(struct statsd *statsd, unsigned long *dropped) {
+  if (statsd == NULL ||
+      dropped == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  *dropped = statsd->dropped;
+  return 0;
+}
+
+static void set_unreachable(struct statsd *statsd) {
+  pr_trace_msg(trace_channel, 3,
+    "statsd server %s unreachable, not sending metrics for %d secs",
+    statsd->server, STATSD_UNREACHABLE_RETRY_SECS);
+  statsd->unreachable_until = time(NULL) + STATSD_UNREACHABLE_RETRY_SECS;
+}
+
+static int send_metrics(struct statsd *statsd, const void *buf, size_t len) {
+  int res, xerrno;
+
+  while (TRUE) {
+    res = send(statsd->fd, buf, len, 0);
+    xerrno = errno;
+
+    if (res < 0) {
+      if (xerrno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      pr_trace_msg(trace_channel, 5,
+        "error sending %lu bytes of metrics data to %s: %s",
+        (unsigned long) len, statsd->server, strerror(xerrno));
+
+      if (xerrno == ECONNREFUSED) {
+        set_unreachable(statsd);
+      }
+
+      errno = xerrno;
+      return -1;
+    }
+
+    /* XXX Should we watch for short writes? */
+    pr_trace_msg(trace_channel, 19,
+      "sent %d bytes of metrics data (of %lu bytes pending) to %s", res,
+      (unsigned long) len, statsd->server);
+    break;
+  }
+
+  return 0;
+}
+
+#if defined(HAVE_SENDMMSG)
+/* Sends the given packets using as few sendmmsg(2) calls as possible.
+ * Returns the number of packets handled, or -1 if sendmmsg(2) is not
+ * supported, in which case the caller should fall back to sending each
+ * packet individually.
+ */
+static int send_batch(struct statsd *statsd, struct iovec *iovs,
+    unsigned int npkts) {
+  register unsigned int i;
+  struct mmsghdr msgs[STATSD_MAX_BATCH_PACKETS];
+  unsigned int nsent = 0;
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < npkts; i++) {
+    msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (nsent < npkts) {
+    int res, xerrno;
+
+    res = sendmmsg(statsd->fd, msgs + nsent, npkts - nsent, 0);
+    xerrno = errno;
+
+    if (res < 0) {
+      if (xerrno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      if (xerrno == ENOSYS) {
+        pr_trace_msg(trace_channel, 9,
+          "sendmmsg(2) not supported, sending packets individually");
+        statsd->use_sendmmsg = FALSE;
+
+        if (nsent == 0) {
+          errno = xerrno;
+          return -1;
+        }
 
-      statsd->metrics_buf = pstrndup(statsd->metrics_pool, metric, metric_len);
-      statsd->metrics_buflen = metric_len;
+        /* Let the caller send the remaining packets. */
+        return nsent;
+      }
+
+      pr_trace_msg(trace_channel, 5,
+        "error sending %u packets of metrics data to %s: %s",
+        npkts - nsent, statsd->server, strerror(xerrno));
+
+      if (xerrno == ECONNREFUSED) {
+        /* No point in sending the rest of the packets. */
+        set_unreachable(statsd);
+        errno = xerrno;
+        return npkts;
+      }
+
+      /* Skip the packet which caused the error, and try the rest. */
+      nsent++;
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 19,
+      "sent %d packets (of %u packets pending) of metrics data to %s",
+      res, npkts - nsent, statsd->server);
+    nsent += res;
+  }
+
+  return nsent;
+}
+#endif /* HAVE_SENDMMSG */
+
+static int reconnect_unix(struct statsd *statsd) {
+  int res;
+  struct sockaddr_un unix_addr;
+
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  sstrncpy(unix_addr.sun_path, statsd->path, sizeof(unix_addr.sun_path));
+
+  res = connect(statsd->fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr));
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 5,
+      "error reconnecting Unix domain socket to '%s': %s", statsd->path,
+      strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Sends all of the pending packets.  Returns -1, with errno set to
+ * ECONNREFUSED, if the statsd server is known to be unreachable.
+ */
+static int send_pending(struct statsd *statsd) {
+  register unsigned int i;
+  struct iovec iovs[STATSD_MAX_BATCH_PACKETS];
+  unsigned int npkts = 0;
+  size_t pktstart = 0;
+
+  if (statsd->metrics_buflen == 0) {
+    return 0;
+  }
+
+  if (statsd->unreachable_until > 0) {
+    if (time(NULL) < statsd->unreachable_until) {
+      pr_trace_msg(trace_channel, 17,
+        "statsd server %s unreachable, dropping %lu bytes of metrics data",
+        statsd->server, (unsigned long) statsd->metrics_buflen);
+      errno = ECONNREFUSED;
+      return -1;
+    }
+
+    statsd->unreachable_until = 0;
+
+    if (statsd->path != NULL) {
+      /* The statsd server may have been restarted, with a new socket;
+       * reconnect to it.
+       */
+      if (reconnect_unix(statsd) < 0) {
+        set_unreachable(statsd);
+        errno = ECONNREFUSED;
+        return -1;
+      }
+    }
+  }
+
+  for (i = 0; i < statsd->metrics_npkts; i++) {
+    iovs[npkts].iov_base = statsd->metrics_buf + pktstart;
+    iovs[npkts].iov_len = statsd->metrics_pktends[i] - pktstart;
+    pktstart = statsd->metrics_pktends[i];
+    npkts++;
+  }
+
+  if (statsd->metrics_buflen > statsd->metrics_pktstart) {
+    iovs[npkts].iov_base = statsd->metrics_buf + statsd->metrics_pktstart;
+    iovs[npkts].iov_len = statsd->metrics_buflen - statsd->metrics_pktstart;
+    npkts++;
+  }
+
+  i = 0;
+
+#if defined(HAVE_SENDMMSG)
+  if (npkts > 1 &&
+      statsd->use_sendmmsg == TRUE) {
+    int res;
+
+    res = send_batch(statsd, iovs, npkts);
+    if (res > 0) {
+      i = res;
+    }
+  }
+#endif /* HAVE_SENDMMSG */
+
+  for (; i < npkts; i++) {
+    if (send_metrics(statsd, iovs[i].iov_base, iovs[i].iov_len) < 0 &&
+        errno == ECONNREFUSED) {
+      break;
+    }
+  }
+
+  if (statsd->unreachable_until > 0) {
+    errno = ECONNREFUSED;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void clear_metrics(struct statsd *statsd) {
+  statsd->metrics_buflen = 0;
+  statsd->metrics_pktstart = 0;
+  statsd->metrics_npkts = 0;
+}
+
+char *statsd_statsd_reserve(struct statsd *statsd, size_t metric_len) {
+  size_t need_len, pktlen;
+
+  if (statsd == NULL ||
+      metric_len == 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* Note that we MUST add a newline for TCP-sent metrics; there are no
+   * packet boundaries (it's a stream, not a datagram) for delimiting.
+   */
+  need_len = metric_len;
+  if (statsd->use_tcp == TRUE) {
+    need_len++;
+  }
+
+  if (need_len > statsd->metrics_pktsz) {
+    pr_trace_msg(trace_channel, 3,
+      "metric length (%lu bytes) exceeds max metric size (%lu bytes), "
+      "ignoring", (unsigned long) metric_len,
+      (unsigned long) statsd->metrics_pktsz);
+    errno = EMSGSIZE;
+    return NULL;
+  }
+
+  if (statsd->use_tcp == TRUE) {
+    /* For TCP, any previous metric will already have been sent. */
+    return statsd->metrics_buf;
+  }
+
+  /* Would this metric put us over the max packet size?  If so, start a new
+   * packet, sending the pending batch of packets if it is full.
+   */
+  pktlen = statsd->metrics_buflen - statsd->metrics_pktstart;
+  if (pktlen > 0 &&
+      (pktlen + metric_len + 1) > statsd->metrics_pktsz) {
+    statsd->metrics_pktends[statsd->metrics_npkts++] = statsd->metrics_buflen;
+    statsd->metrics_pktstart = statsd->metrics_buflen;
+    pktlen = 0;
+
+    if (statsd->metrics_npkts == statsd->metrics_maxpkts) {
+      (void) send_pending(statsd);
+      clear_metrics(statsd);
+    }
+  }
+
+  /* Leave room for the newline separating this metric from any pending
+   * metrics in the packet; it is written when the metric is committed.
+   */
+  if (pktlen > 0) {
+    return statsd->metrics_buf + statsd->metrics_buflen + 1;
+  }
+
+  return statsd->metrics_buf + statsd->metrics_buflen;
+}
+
+int statsd_statsd_commit(struct statsd *statsd, size_t metric_len,
+    int flags) {
+
+  if (statsd == NULL ||
+      metric_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (statsd->use_tcp == TRUE) {
+    pr_trace_msg(trace_channel, 19, "adding statsd metric: '%.*s'",
+      (int) metric_len, statsd->metrics_buf);
+
+    statsd->metrics_buf[metric_len] = '\n';
+    if (tcp_enqueue(statsd, statsd->metrics_buf, metric_len + 1) < 0) {
+      return -1;
+    }
+
+    /* Rather than one write per metric, coalesce the queued metrics into
+     * fewer, larger writes.
+     */
+    statsd->tcp_unsent += (metric_len + 1);
+    if ((flags & STATSD_STATSD_FL_SEND_NOW) ||
+        statsd->tcp_unsent >= statsd->max_pktsz) {
+
+      /* The metric is queued; any error in sending it now is not the
+       * caller's concern.
+       */
+      (void) tcp_drain(statsd);
     }
+
+    return 0;
+  }
+
+  if (statsd->metrics_buflen > statsd->metrics_pktstart) {
+    statsd->metrics_buf[statsd->metrics_buflen++] = '\n';
   }
 
+  pr_trace_msg(trace_channel, 19, "adding statsd metric: '%.*s'",
+    (int) metric_len, statsd->metrics_buf + statsd->metrics_buflen);
+
+  statsd->metrics_buflen += metric_len;
+
   if (flags & STATSD_STATSD_FL_SEND_NOW) {
-    send_metrics(statsd, statsd->metrics_buf, statsd->metrics_buflen);
+    int res, xerrno;
+
+    res = send_pending(statsd);
+    xerrno = errno;
+
     clear_metrics(statsd);
+
+    errno = xerrno;
+    return res;
   }
 
   return 0;
 }
 
+int statsd_statsd_write(struct statsd *statsd, const char *metric,
+    size_t metric_len, int flags) {
+  char *ptr;
+
+  if (statsd == NULL ||
+      metric == NULL ||
+      metric_len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ptr = statsd_statsd_reserve(statsd, metric_len);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  memcpy(ptr, metric, metric_len);
+  return statsd_statsd_commit(statsd, metric_len, flags);
+}
+
 int statsd_statsd_flush(struct statsd *statsd) {
   if (statsd == NULL) {
     errno = EINVAL;
     return -1;
   }
 
-  send_metrics(statsd, statsd->metrics_buf, statsd->metrics_buflen);
-  clear_metrics(statsd);
+  if (statsd->use_tcp == TRUE) {
+    return tcp_drain(statsd);
+  }
+
+  if (statsd->metrics_buflen > 0) {
+    int res, xerrno;
+
+    res = send_pending(statsd);
+    xerrno = errno;
+
+    clear_metrics(statsd);
+
+    errno = xerrno;
+    return res;
+  }
+
   return 0;
 }
 
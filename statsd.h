@@ -28,42 +28,206 @@
 #include "mod_statsd.h"
 
 struct statsd;
+struct statsd_arena;
+struct statsd_aggregate;
+struct statsd_sketch_table;
+
+/* A sampling rate, prepared once for use: the threshold against which
+ * sampling decisions are made, and the "|@rate" text for sampled metrics.
+ */
+struct statsd_sampling {
+  float rate;
+  uint64_t threshold;
+  char suffix[24];
+  size_t suffixlen;
+};
 
 /* Per the excellent documentation on multi-metric packets here:
  *
  *  https://github.com/etsy/statsd/blob/master/docs/metric_types.md#multi-metric-packets
  *
- * We'll use a maximum UDP packet size of 512 bytes, for interoperability.
+ * We'll use a default maximum UDP packet size of 512 bytes, for
+ * interoperability.  The max packet size can be configured, up to the largest
+ * possible UDP payload.
  */
 #define STATSD_MAX_UDP_PACKET_SIZE		512
+#define STATSD_MIN_PACKET_SIZE_LIMIT		64
+#define STATSD_MAX_PACKET_SIZE_LIMIT		65507
+
+/* Unix domain datagram sockets, not being subject to network MTUs, use
+ * larger packets by default; this matches the default buffer size of e.g.
+ * DogStatsD's Unix domain socket.
+ */
+#define STATSD_MAX_UNIX_PACKET_SIZE		8192
+
+/* The max number of UDP packets which are buffered, and sent together as a
+ * batch when possible, and the max size of that buffer.
+ */
+#define STATSD_MAX_BATCH_PACKETS		16
+#define STATSD_MAX_BATCH_BUFSZ			(64 * 1024)
 
-/* The max length of a single metric is the same as the max packet size. */
-#define STATSD_MAX_METRIC_SIZE			STATSD_MAX_UDP_PACKET_SIZE
+/* When the statsd server is found to be unreachable, e.g. due to an ICMP
+ * "port unreachable" error, metrics are dropped, rather than sent, for this
+ * many seconds.
+ */
+#define STATSD_UNREACHABLE_RETRY_SECS		5
+
+/* For TCP, metrics are queued in a fixed-size ring buffer, which is drained
+ * without blocking.  When the connection to the statsd server is lost, we
+ * reconnect with an exponential backoff, between these limits.
+ */
+#define STATSD_TCP_RING_SIZE			(64 * 1024)
+#define STATSD_TCP_MIN_BACKOFF_SECS		1
+#define STATSD_TCP_MAX_BACKOFF_SECS		60
 
 struct statsd *statsd_statsd_open(pool *p, const pr_netaddr_t *addr,
   int use_tcp, float sampling, const char *prefix, const char *suffix);
+
+/* Opens a client for a statsd server listening on the Unix domain datagram
+ * socket at the given path.
+ */
+struct statsd *statsd_statsd_open_unix(pool *p, const char *path,
+  float sampling, const char *prefix, const char *suffix);
+
+/* Opens a connected UDP socket to the given address, or Unix domain datagram
+ * socket to the given path, e.g. for the daemon process to share with its
+ * session processes.
+ */
+int statsd_statsd_open_socket(const pr_netaddr_t *addr, const char *path);
+
+/* Opens a client using the given socket, as opened by
+ * statsd_statsd_open_socket().  The socket is not closed when the client is
+ * closed.
+ */
+struct statsd *statsd_statsd_open_fd(pool *p, int fd, const pr_netaddr_t *addr,
+  const char *path, float sampling, const char *prefix, const char *suffix);
+
+/* Opens a client using the given relay socket, as opened by
+ * statsd_relay_open().  The socket is not closed when the client is closed.
+ */
+struct statsd *statsd_statsd_open_relay(pool *p, int fd, float sampling,
+  const char *prefix, const char *suffix);
 int statsd_statsd_close(struct statsd *statsd);
 
 int statsd_statsd_write(struct statsd *statsd, const char *metric,
   size_t metric_len, int flags);
 #define STATSD_STATSD_FL_SEND_NOW	0x0001
 
-/* Flush any buffered pending metrics */
+/* Reserves space for a metric of the given length directly in the client's
+ * pending buffer, flushing any pending metrics as necessary, and returns a
+ * pointer to where the metric is to be written.  Once written, the metric is
+ * added to the pending buffer via statsd_statsd_commit().
+ */
+char *statsd_statsd_reserve(struct statsd *statsd, size_t metric_len);
+int statsd_statsd_commit(struct statsd *statsd, size_t metric_len, int flags);
+
+/* Flush any buffered pending metrics.  Returns -1, with errno set to
+ * ECONNREFUSED, if the statsd server is unreachable.  For TCP, this sends as
+ * much of the queued data as the socket will take without blocking.
+ */
 int statsd_statsd_flush(struct statsd *statsd);
 
+/* Returns the amount of pending metrics data, as a percentage of the max
+ * packet size.  A fill of 100% or more means that at least one full packet
+ * is waiting to be sent.
+ */
+int statsd_statsd_get_fill(struct statsd *statsd, unsigned int *fill_pct);
+
+/* Returns the number of metrics dropped because the TCP queue was full. */
+int statsd_statsd_get_dropped(struct statsd *statsd, unsigned long *dropped);
+
 /* Returns a reference to the prefix/suffix labels, if any, for this statsd
  * client.
  */
 int statsd_statsd_get_namespacing(struct statsd *statsd, const char **prefix,
   const char **suffix);
 
+/* Returns the lengths of the prefix/suffix labels, if any. */
+int statsd_statsd_get_namespacing_len(struct statsd *statsd,
+  size_t *prefixlen, size_t *suffixlen);
+
+/* Configures the max packet size (and thus max metric size) for the client;
+ * use zero to select the packet size automatically, based on the MTU of the
+ * interface used to reach a local statsd server.
+ */
+int statsd_statsd_set_max_packet_size(struct statsd *statsd, size_t pktsz);
+size_t statsd_statsd_get_max_packet_size(struct statsd *statsd);
+
+/* Returns the client's socket, or -1 if it has none, e.g. while a TCP
+ * client is reconnecting.
+ */
+int statsd_statsd_get_fd(struct statsd *statsd);
+
 /* Returns a reference to pool used for the statsd client. */
 pool *statsd_statsd_get_pool(struct statsd *statsd);
 
+/* Changes the sampling percentage for the statsd client. */
+int statsd_statsd_set_sampling(struct statsd *statsd, float sampling);
+
 /* Returns the sampling percentage for the statsd client. */
 float statsd_statsd_get_sampling(struct statsd *statsd);
 
-/* This is for testing purposes. */
+/* Returns the prepared sampling for the statsd client. */
+const struct statsd_sampling *statsd_statsd_get_prepared_sampling(
+  struct statsd *statsd);
+
+/* Prepares the given sampling rate, e.g. for the metrics of a command with
+ * its own sampling rate, without changing that of any statsd client.
+ */
+int statsd_statsd_prepare_sampling(struct statsd_sampling *sampling,
+  float rate);
+
+/* Returns the preformatted "|@rate" text for sampled metrics; this will be
+ * empty if no sampling is configured.
+ */
+const char *statsd_statsd_get_sampling_suffix(struct statsd *statsd,
+  size_t *suffixlen);
+
+/* Returns TRUE if the next metric (or event) is to be sampled, per the
+ * sampling percentage for the statsd client, otherwise FALSE.
+ */
+int statsd_statsd_should_sample(struct statsd *statsd);
+
+/* Returns TRUE if the next metric (or event) is to be sampled, per the given
+ * prepared sampling, otherwise FALSE.
+ */
+int statsd_statsd_should_sample_at(struct statsd *statsd,
+  const struct statsd_sampling *sampling);
+
+/* Returns TRUE if a one-off event, e.g. a whole session, is to be sampled
+ * at the given sampling rate, otherwise FALSE.
+ */
+int statsd_statsd_sample_once(float sampling);
+
+/* Formats the given sampling rate as "|@rate" text, into the given buffer,
+ * returning the length of the text.
+ */
+int statsd_statsd_format_sampling(char *buf, size_t bufsz, double rate);
+
+/* Configures a shared arena, to which the client's counters and gauges are
+ * added, rather than being sent individually; use NULL to clear it.  The
+ * daemon process folds the arena, and sends the aggregated metrics.
+ */
+int statsd_statsd_set_arena(struct statsd *statsd, struct statsd_arena *arena);
+struct statsd_arena *statsd_statsd_get_arena(struct statsd *statsd);
+
+/* Configures an aggregate, in which the client's counters are summed between
+ * flushes, rather than being sent individually; use NULL to clear it.
+ */
+int statsd_statsd_set_aggregate(struct statsd *statsd,
+  struct statsd_aggregate *agg);
+struct statsd_aggregate *statsd_statsd_get_aggregate(struct statsd *statsd);
+
+/* Configures a sketch table, in which the client's timers are summarized
+ * between flushes, and sent as percentile gauges; use NULL to clear it.
+ */
+int statsd_statsd_set_sketches(struct statsd *statsd,
+  struct statsd_sketch_table *tab);
+struct statsd_sketch_table *statsd_statsd_get_sketches(struct statsd *statsd);
+
+/* These are for testing purposes. */
+int statsd_statsd_get_pending(struct statsd *statsd, const char **buf,
+  size_t *buflen);
 int statsd_statsd_set_fd(struct statsd *statsd, int fd);
 
 int statsd_statsd_init(void);
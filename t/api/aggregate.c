@@ -0,0 +1,334 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Aggregate tests. */
+
+#include "tests.h"
+#include "statsd.h"
+#include "metric.h"
+#include "aggregate.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.aggregate", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.aggregate", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+static int count_entries(const struct statsd_aggregate_entry *entry,
+    void *user_data) {
+  unsigned int *count;
+
+  count = user_data;
+  (*count)++;
+  return 0;
+}
+
+static int get_entry(const struct statsd_aggregate_entry *entry,
+    void *user_data) {
+  struct statsd_aggregate_entry *copy;
+
+  copy = user_data;
+  memcpy(copy, entry, sizeof(struct statsd_aggregate_entry));
+  return 0;
+}
+
+START_TEST (aggregate_create_test) {
+  int res;
+  struct statsd_aggregate *agg;
+
+  mark_point();
+  agg = statsd_aggregate_create(NULL);
+  ck_assert_msg(agg == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_aggregate_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null aggregate");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  agg = statsd_aggregate_create(p);
+  ck_assert_msg(agg != NULL, "Failed to create aggregate: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_aggregate_get_count(agg) == 0,
+    "Expected 0 series, got %u", statsd_aggregate_get_count(agg));
+  ck_assert_msg(statsd_aggregate_should_flush(agg) == FALSE,
+    "Expected empty aggregate to not need flushing");
+
+  res = statsd_aggregate_destroy(agg);
+  ck_assert_msg(res == 0, "Failed to destroy aggregate: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (aggregate_add_test) {
+  int res;
+  struct statsd_aggregate *agg;
+  struct statsd_aggregate_entry entry;
+
+  mark_point();
+  res = statsd_aggregate_add(NULL, 0, 1.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null aggregate");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  agg = statsd_aggregate_create(p);
+
+  mark_point();
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, NULL,
+    0);
+  ck_assert_msg(res < 0, "Failed to handle null name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_aggregate_add(agg, -1, 1.0, "foo", 0);
+  ck_assert_msg(res < 0, "Failed to handle invalid type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Timers are not aggregated. */
+  mark_point();
+  res = statsd_aggregate_add(agg, 2, 1.0, "foo", 0);
+  ck_assert_msg(res < 0, "Failed to handle timer type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 0.0, "foo",
+    0);
+  ck_assert_msg(res < 0, "Failed to handle invalid sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, "foo",
+    5);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, "foo",
+    2);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, "foo",
+    9);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  ck_assert_msg(statsd_aggregate_get_count(agg) == 1,
+    "Expected 1 series, got %u", statsd_aggregate_get_count(agg));
+
+  mark_point();
+  res = statsd_aggregate_flush(agg, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null callback");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(&entry, 0, sizeof(entry));
+  res = statsd_aggregate_flush(agg, get_entry, &entry);
+  ck_assert_msg(res == 0, "Failed to flush aggregate: %s", strerror(errno));
+
+  ck_assert_msg(entry.type == STATSD_AGGREGATE_TYPE_COUNTER,
+    "Expected counter type, got %d", entry.type);
+  ck_assert_msg(entry.count == 3, "Expected count 3, got %lu",
+    (unsigned long) entry.count);
+  ck_assert_msg(entry.sum == 16, "Expected sum 16, got %ld", (long) entry.sum);
+
+  ck_assert_msg(statsd_aggregate_get_count(agg) == 0,
+    "Expected 0 series after flush, got %u", statsd_aggregate_get_count(agg));
+
+  /* Values sampled at different rates are in different series. */
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, "foo",
+    5);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 0.5, "foo",
+    5);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  ck_assert_msg(statsd_aggregate_get_count(agg) == 2,
+    "Expected 2 series, got %u", statsd_aggregate_get_count(agg));
+
+  (void) statsd_aggregate_destroy(agg);
+}
+END_TEST
+
+START_TEST (aggregate_add_full_test) {
+  register unsigned int i;
+  int res;
+  unsigned int count = 0;
+  struct statsd_aggregate *agg;
+  char name[32];
+
+  agg = statsd_aggregate_create(p);
+
+  for (i = 0; i < STATSD_AGGREGATE_MAX_SERIES; i++) {
+    snprintf(name, sizeof(name), "metric.%u", i);
+
+    res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, name,
+      1);
+    ck_assert_msg(res == 0, "Failed to add counter '%s': %s", name,
+      strerror(errno));
+  }
+
+  ck_assert_msg(statsd_aggregate_should_flush(agg) == TRUE,
+    "Expected full aggregate to need flushing");
+
+  mark_point();
+  res = statsd_aggregate_add(agg, STATSD_AGGREGATE_TYPE_COUNTER, 1.0, "foo",
+    1);
+  ck_assert_msg(res < 0, "Failed to handle full aggregate");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  res = statsd_aggregate_flush(agg, count_entries, &count);
+  ck_assert_msg(res == 0, "Failed to flush aggregate: %s", strerror(errno));
+  ck_assert_msg(count == STATSD_AGGREGATE_MAX_SERIES,
+    "Expected %u series, got %u", STATSD_AGGREGATE_MAX_SERIES, count);
+
+  (void) statsd_aggregate_destroy(agg);
+}
+END_TEST
+
+START_TEST (aggregate_metric_test) {
+  register unsigned int i;
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  char buf[1024];
+  ssize_t len;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  struct statsd_aggregate *agg;
+  const char *expected, *pending = NULL;
+  size_t pendinglen = 0;
+  uint64_t timings[] = { 5, 1, 3, 10 };
+
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ck_assert_msg(fd >= 0, "Failed to open UDP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind UDP socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get UDP socket name: %s", strerror(errno));
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  ck_assert_msg(addr != NULL, "Failed to resolve 127.0.0.1: %s",
+    strerror(errno));
+  pr_netaddr_set_port2((pr_netaddr_t *) addr, ntohs(sin.sin_port));
+
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  agg = statsd_aggregate_create(statsd_statsd_get_pool(statsd));
+
+  mark_point();
+  res = statsd_statsd_set_aggregate(NULL, agg);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_statsd_set_aggregate(statsd, agg);
+  ck_assert_msg(res == 0, "Failed to set aggregate: %s", strerror(errno));
+
+  for (i = 0; i < 4; i++) {
+    res = statsd_metric_timer(statsd, "foo", timings[i], 0);
+    ck_assert_msg(res == 0, "Failed to add timer: %s", strerror(errno));
+
+    res = statsd_metric_counter(statsd, "bar", 1, 0);
+    ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+  }
+
+  /* Only the timers are written to the client, until the aggregate is
+   * flushed.
+   */
+  res = statsd_statsd_get_pending(statsd, &pending, &pendinglen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+    strerror(errno));
+  expected = "foo:5|ms\nfoo:1|ms\nfoo:3|ms\nfoo:10|ms";
+  ck_assert_msg(pendinglen == strlen(expected) &&
+    strncmp(pending, expected, pendinglen) == 0,
+    "Expected '%s' pending, got '%.*s'", expected, (int) pendinglen, pending);
+
+  mark_point();
+  res = statsd_metric_flush(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_metric_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  len = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT);
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+
+  expected = "foo:5|ms\nfoo:1|ms\nfoo:3|ms\nfoo:10|ms\nbar:4|c";
+  ck_assert_msg(strcmp(buf, expected) == 0, "Expected '%s', got '%s'",
+    expected, buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_aggregate_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("aggregate");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, aggregate_create_test);
+  tcase_add_test(testcase, aggregate_add_test);
+  tcase_add_test(testcase, aggregate_add_full_test);
+  tcase_add_test(testcase, aggregate_metric_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,416 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Arena tests. */
+
+#include "tests.h"
+#include "statsd.h"
+#include "metric.h"
+#include "arena.h"
+
+#include <sys/wait.h>
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.arena", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.arena", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Opens a UDP socket on the loopback address, for receiving the folded
+ * metrics, and a client sending to it.
+ */
+static struct statsd *statsd_listen(int *fd) {
+  int res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  *fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ck_assert_msg(*fd >= 0, "Failed to open UDP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(*fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind UDP socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(*fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get UDP socket name: %s", strerror(errno));
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  ck_assert_msg(addr != NULL, "Failed to resolve 127.0.0.1: %s",
+    strerror(errno));
+  pr_netaddr_set_port2((pr_netaddr_t *) addr, ntohs(sin.sin_port));
+
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  return statsd;
+}
+
+static ssize_t recv_metrics(int fd, char *buf, size_t bufsz) {
+  ssize_t len;
+
+  memset(buf, '\0', bufsz);
+  len = recv(fd, buf, bufsz - 1, MSG_DONTWAIT);
+  return len;
+}
+
+START_TEST (arena_create_test) {
+  int res;
+  struct statsd_arena *arena;
+  unsigned int nshards;
+
+  mark_point();
+  arena = statsd_arena_create(NULL, 0);
+  ck_assert_msg(arena == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_arena_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null arena");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  arena = statsd_arena_create(p, 0);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  nshards = statsd_arena_get_shard_count(arena);
+  ck_assert_msg(nshards >= 1 && nshards <= STATSD_ARENA_MAX_SHARDS,
+    "Expected 1-%u shards, got %u", STATSD_ARENA_MAX_SHARDS, nshards);
+
+  res = statsd_arena_destroy(arena);
+  ck_assert_msg(res == 0, "Failed to destroy arena: %s", strerror(errno));
+
+  mark_point();
+  arena = statsd_arena_create(p, 1000);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  nshards = statsd_arena_get_shard_count(arena);
+  ck_assert_msg(nshards == STATSD_ARENA_MAX_SHARDS,
+    "Expected %u shards, got %u", STATSD_ARENA_MAX_SHARDS, nshards);
+
+  (void) statsd_arena_destroy(arena);
+}
+END_TEST
+
+START_TEST (arena_add_test) {
+  int res;
+  struct statsd_arena *arena;
+  char name[STATSD_ARENA_MAX_NAME_SIZE + 1];
+
+  mark_point();
+  res = statsd_arena_add(NULL, 0, NULL, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle null arena");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  arena = statsd_arena_create(p, 2);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, NULL, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle null name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_arena_add(arena, -1, "foo", 3, 1);
+  ck_assert_msg(res < 0, "Failed to handle invalid type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(name, 'a', sizeof(name)-1);
+  name[sizeof(name)-1] = '\0';
+
+  mark_point();
+  res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, name,
+    strlen(name), 1);
+  ck_assert_msg(res < 0, "Failed to handle too-long name");
+  ck_assert_msg(errno == ENAMETOOLONG, "Expected ENAMETOOLONG (%d), got %s (%d)",
+    ENAMETOOLONG, strerror(errno), errno);
+
+  mark_point();
+  res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "foo", 3, 1);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  (void) statsd_arena_destroy(arena);
+}
+END_TEST
+
+START_TEST (arena_add_full_test) {
+  register unsigned int i;
+  int res;
+  struct statsd_arena *arena;
+  char name[32];
+
+  arena = statsd_arena_create(p, 1);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  for (i = 0; i < STATSD_ARENA_MAX_SLOTS; i++) {
+    snprintf(name, sizeof(name), "metric.%u", i);
+
+    res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, name,
+      strlen(name), 1);
+    ck_assert_msg(res == 0, "Failed to add counter '%s': %s", name,
+      strerror(errno));
+  }
+
+  /* Existing metrics can still be added to, but new ones cannot. */
+  mark_point();
+  res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "metric.0", 8, 1);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "foo", 3, 1);
+  ck_assert_msg(res < 0, "Failed to handle full arena");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  (void) statsd_arena_destroy(arena);
+}
+END_TEST
+
+START_TEST (arena_fold_test) {
+  int fd, res;
+  struct statsd_arena *arena;
+  struct statsd *statsd;
+  char buf[1024];
+  ssize_t len;
+
+  mark_point();
+  res = statsd_arena_fold(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null arena");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  arena = statsd_arena_create(p, 4);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_arena_fold(arena, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  statsd = statsd_listen(&fd);
+
+  (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "foo", 3, 2);
+  (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "foo", 3, 3);
+  (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_GAUGE, "bar", 3, 1);
+  (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_GAUGE, "bar", 3, -3);
+  (void) statsd_arena_set_gauge(arena, "baz", 3, 7);
+  (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_GAUGE, "baz", 3, 1);
+
+  mark_point();
+  res = statsd_arena_fold(arena, statsd);
+  ck_assert_msg(res == 0, "Failed to fold arena: %s", strerror(errno));
+
+  len = recv_metrics(fd, buf, sizeof(buf));
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+
+  ck_assert_msg(strstr(buf, "foo:5|c") != NULL,
+    "Expected 'foo:5|c' in '%s'", buf);
+  ck_assert_msg(strstr(buf, "bar:-2|g") != NULL,
+    "Expected 'bar:-2|g' in '%s'", buf);
+  ck_assert_msg(strstr(buf, "baz:7|g\nbaz:+1|g") != NULL,
+    "Expected 'baz:7|g', 'baz:+1|g' in '%s'", buf);
+
+  /* Folding resets the arena; there is nothing more to send. */
+  mark_point();
+  res = statsd_arena_fold(arena, statsd);
+  ck_assert_msg(res == 0, "Failed to fold arena: %s", strerror(errno));
+
+  len = recv_metrics(fd, buf, sizeof(buf));
+  ck_assert_msg(len < 0, "Received unexpected metrics '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) statsd_arena_destroy(arena);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (arena_fold_forked_test) {
+  register unsigned int i;
+  int fd, res, status;
+  struct statsd_arena *arena;
+  struct statsd *statsd;
+  pid_t pids[4];
+  char buf[1024];
+  ssize_t len;
+
+  arena = statsd_arena_create(p, 0);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  for (i = 0; i < 4; i++) {
+    pids[i] = fork();
+    ck_assert_msg(pids[i] >= 0, "Failed to fork: %s", strerror(errno));
+
+    if (pids[i] == 0) {
+      register unsigned int j;
+
+      for (j = 0; j < 1000; j++) {
+        (void) statsd_arena_add(arena, STATSD_ARENA_TYPE_COUNTER, "foo", 3, 1);
+      }
+
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
+    res = waitpid(pids[i], &status, 0);
+    ck_assert_msg(res == pids[i], "Failed to wait for child: %s",
+      strerror(errno));
+  }
+
+  statsd = statsd_listen(&fd);
+
+  mark_point();
+  res = statsd_arena_fold(arena, statsd);
+  ck_assert_msg(res == 0, "Failed to fold arena: %s", strerror(errno));
+
+  len = recv_metrics(fd, buf, sizeof(buf));
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+  ck_assert_msg(strcmp(buf, "foo:4000|c") == 0,
+    "Expected 'foo:4000|c', got '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) statsd_arena_destroy(arena);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (arena_metric_test) {
+  int fd, res;
+  const pr_netaddr_t *addr;
+  struct statsd_arena *arena;
+  struct statsd *statsd, *folder;
+  char buf[1024];
+  ssize_t len;
+
+  arena = statsd_arena_create(p, 1);
+  ck_assert_msg(arena != NULL, "Failed to create arena: %s", strerror(errno));
+
+  folder = statsd_listen(&fd);
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  ck_assert_msg(addr != NULL, "Failed to resolve 127.0.0.1: %s",
+    strerror(errno));
+  pr_netaddr_set_port2((pr_netaddr_t *) addr, STATSD_DEFAULT_PORT);
+
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, "pre.", ".suf");
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_set_arena(NULL, arena);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_set_arena(statsd, arena);
+  ck_assert_msg(res == 0, "Failed to set arena: %s", strerror(errno));
+  ck_assert_msg(statsd_statsd_get_arena(statsd) == arena,
+    "Expected arena %p, got %p", arena, statsd_statsd_get_arena(statsd));
+
+  res = statsd_metric_counter(statsd, "foo:bar", 1, 0);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  res = statsd_metric_gauge(statsd, "baz", 3, 0);
+  ck_assert_msg(res == 0, "Failed to set gauge: %s", strerror(errno));
+
+  /* Nothing is pending for the session client. */
+  {
+    const char *pending = NULL;
+    size_t pendinglen = 0;
+
+    res = statsd_statsd_get_pending(statsd, &pending, &pendinglen);
+    ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+      strerror(errno));
+    ck_assert_msg(pendinglen == 0, "Expected no pending metrics, got '%.*s'",
+      (int) pendinglen, pending);
+  }
+
+  mark_point();
+  res = statsd_arena_fold(arena, folder);
+  ck_assert_msg(res == 0, "Failed to fold arena: %s", strerror(errno));
+
+  len = recv_metrics(fd, buf, sizeof(buf));
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+  ck_assert_msg(strstr(buf, "pre.foo_bar.suf:1|c") != NULL,
+    "Expected 'pre.foo_bar.suf:1|c' in '%s'", buf);
+  ck_assert_msg(strstr(buf, "pre.baz.suf:3|g") != NULL,
+    "Expected 'pre.baz.suf:3|g' in '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) statsd_statsd_close(folder);
+  (void) statsd_arena_destroy(arena);
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_arena_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("arena");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, arena_create_test);
+  tcase_add_test(testcase, arena_add_test);
+  tcase_add_test(testcase, arena_add_full_test);
+  tcase_add_test(testcase, arena_fold_test);
+  tcase_add_test(testcase, arena_fold_forked_test);
+  tcase_add_test(testcase, arena_metric_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,187 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Cardinality tests. */
+
+#include "tests.h"
+#include "cardinality.h"
+
+#include <sys/wait.h>
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.cardinality", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.cardinality", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (cardinality_create_test) {
+  int res;
+  struct statsd_cardinality *card;
+
+  mark_point();
+  card = statsd_cardinality_create(NULL, 1);
+  ck_assert_msg(card == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  card = statsd_cardinality_create(p, 0);
+  ck_assert_msg(card == NULL, "Failed to handle zero names");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  card = statsd_cardinality_create(p, STATSD_CARDINALITY_MAX_NAMES + 1);
+  ck_assert_msg(card == NULL, "Failed to handle too many names");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_cardinality_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null set");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  card = statsd_cardinality_create(p, 3);
+  ck_assert_msg(card != NULL, "Failed to create set: %s", strerror(errno));
+  ck_assert_msg(statsd_cardinality_get_max(card) == 3,
+    "Expected max 3 names, got %u", statsd_cardinality_get_max(card));
+  ck_assert_msg(statsd_cardinality_get_count(card) == 0,
+    "Expected 0 names, got %u", statsd_cardinality_get_count(card));
+
+  mark_point();
+  res = statsd_cardinality_admit(NULL, "foo", 3);
+  ck_assert_msg(res < 0, "Failed to handle null set");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_cardinality_admit(card, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_cardinality_destroy(card);
+  ck_assert_msg(res == 0, "Failed to destroy set: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (cardinality_admit_test) {
+  register unsigned int i;
+  int res;
+  struct statsd_cardinality *card;
+
+  card = statsd_cardinality_create(p, 8);
+  ck_assert_msg(card != NULL, "Failed to create set: %s", strerror(errno));
+
+  /* Have several processes, as sessions would, add the same names, and more
+   * names than fit.
+   */
+  for (i = 0; i < 4; i++) {
+    pid_t pid;
+
+    pid = fork();
+    ck_assert_msg(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+    if (pid == 0) {
+      unsigned int j;
+
+      for (j = 0; j < 6; j++) {
+        char name[32];
+
+        pr_snprintf(name, sizeof(name), "CMD%u", j);
+        if (statsd_cardinality_admit(card, name, strlen(name)) != TRUE) {
+          _exit(1);
+        }
+      }
+
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
+    int status;
+
+    res = wait(&status);
+    ck_assert_msg(res > 0, "Failed to wait for child: %s", strerror(errno));
+    ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+      "Child failed, status %d", status);
+  }
+
+  ck_assert_msg(statsd_cardinality_get_count(card) == 6,
+    "Expected 6 names, got %u", statsd_cardinality_get_count(card));
+
+  res = statsd_cardinality_admit(card, "CMD6", 4);
+  ck_assert_msg(res == TRUE, "Expected CMD6 admitted, got %d", res);
+
+  res = statsd_cardinality_admit(card, "CMD7", 4);
+  ck_assert_msg(res == TRUE, "Expected CMD7 admitted, got %d", res);
+
+  /* The set is now full; known names are still admitted. */
+  res = statsd_cardinality_admit(card, "CMD8", 4);
+  ck_assert_msg(res == FALSE, "Expected CMD8 not admitted, got %d", res);
+
+  res = statsd_cardinality_admit(card, "CMD0", 4);
+  ck_assert_msg(res == TRUE, "Expected CMD0 admitted, got %d", res);
+
+  ck_assert_msg(statsd_cardinality_get_count(card) == 8,
+    "Expected 8 names, got %u", statsd_cardinality_get_count(card));
+
+  (void) statsd_cardinality_destroy(card);
+}
+END_TEST
+
+Suite *tests_get_cardinality_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("cardinality");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, cardinality_create_test);
+  tcase_add_test(testcase, cardinality_admit_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
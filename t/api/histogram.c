@@ -0,0 +1,270 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Histogram tests. */
+
+#include "tests.h"
+#include "statsd.h"
+#include "histogram.h"
+
+#include <sys/wait.h>
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.histogram", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.histogram", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+START_TEST (histogram_bucket_test) {
+  uint64_t val;
+  unsigned int prev_bucket = 0;
+
+  /* Check every timing in the linear range, and beyond, against the timing
+   * reported for its bucket.
+   */
+  for (val = 0; val <= STATSD_HISTOGRAM_MAX_VALUE;
+       val = (val < 100000 ? val + 1 : val + (val / 97))) {
+    unsigned int bucket;
+    uint64_t reported, err;
+
+    bucket = statsd_histogram_get_bucket(val);
+    ck_assert_msg(bucket < STATSD_HISTOGRAM_MAX_BUCKETS,
+      "Expected bucket for %lu below %u, got %u", (unsigned long) val,
+      STATSD_HISTOGRAM_MAX_BUCKETS, bucket);
+    ck_assert_msg(bucket >= prev_bucket,
+      "Expected bucket for %lu at least %u, got %u", (unsigned long) val,
+      prev_bucket, bucket);
+    prev_bucket = bucket;
+
+    reported = statsd_histogram_get_bucket_value(bucket);
+    err = reported > val ? reported - val : val - reported;
+
+    if (val < 128) {
+      ck_assert_msg(err == 0, "Expected exact bucket value %lu, got %lu",
+        (unsigned long) val, (unsigned long) reported);
+
+    } else {
+      /* Half of a bucket, i.e. 1/128 of the power of two. */
+      ck_assert_msg(err * 128 <= val,
+        "Expected bucket value within 1/128 of %lu, got %lu",
+        (unsigned long) val, (unsigned long) reported);
+    }
+  }
+
+  ck_assert_msg(
+    statsd_histogram_get_bucket(STATSD_HISTOGRAM_MAX_VALUE) ==
+      STATSD_HISTOGRAM_MAX_BUCKETS - 1,
+    "Expected max value in last bucket, got %u",
+    statsd_histogram_get_bucket(STATSD_HISTOGRAM_MAX_VALUE));
+
+  /* Longer timings are clamped to the last bucket. */
+  ck_assert_msg(
+    statsd_histogram_get_bucket(STATSD_HISTOGRAM_MAX_VALUE * 2) ==
+      STATSD_HISTOGRAM_MAX_BUCKETS - 1,
+    "Expected longer timing in last bucket, got %u",
+    statsd_histogram_get_bucket(STATSD_HISTOGRAM_MAX_VALUE * 2));
+}
+END_TEST
+
+START_TEST (histogram_create_test) {
+  int res;
+  struct statsd_histogram *hist;
+
+  mark_point();
+  hist = statsd_histogram_create(NULL, 1);
+  ck_assert_msg(hist == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  hist = statsd_histogram_create(p, 0);
+  ck_assert_msg(hist == NULL, "Failed to handle zero count");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  hist = statsd_histogram_create(p, STATSD_HISTOGRAM_MAX_COUNT + 1);
+  ck_assert_msg(hist == NULL, "Failed to handle too many histograms");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_histogram_destroy(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null histogram");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  hist = statsd_histogram_create(p, 3);
+  ck_assert_msg(hist != NULL, "Failed to create histograms: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_histogram_get_count(hist) == 3,
+    "Expected 3 histograms, got %u", statsd_histogram_get_count(hist));
+
+  mark_point();
+  res = statsd_histogram_add(NULL, 0, 1);
+  ck_assert_msg(res < 0, "Failed to handle null histogram");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_histogram_add(hist, 3, 1);
+  ck_assert_msg(res < 0, "Failed to handle invalid index");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_histogram_destroy(hist);
+  ck_assert_msg(res == 0, "Failed to destroy histograms: %s", strerror(errno));
+}
+END_TEST
+
+START_TEST (histogram_fold_test) {
+  register unsigned int i;
+  int res;
+  struct statsd *statsd;
+  struct statsd_histogram *hist;
+  const char *pending = NULL;
+  size_t pendinglen = 0;
+  const char *expected;
+
+  hist = statsd_histogram_create(p, 2);
+  ck_assert_msg(hist != NULL, "Failed to create histograms: %s",
+    strerror(errno));
+
+  statsd = statsd_statsd_open(p, pr_netaddr_get_addr(p, "127.0.0.1", NULL),
+    FALSE, 1.0, "pre.", NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_histogram_fold(hist, 0, NULL, "lat");
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Have several processes, as sessions would, add the timings 1-1000. */
+  for (i = 0; i < 4; i++) {
+    pid_t pid;
+
+    pid = fork();
+    ck_assert_msg(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+    if (pid == 0) {
+      uint64_t val;
+
+      for (val = (i * 250) + 1; val <= (i + 1) * 250; val++) {
+        if (statsd_histogram_add(hist, 1, val) < 0) {
+          _exit(1);
+        }
+      }
+
+      _exit(0);
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
+    int status;
+
+    res = wait(&status);
+    ck_assert_msg(res > 0, "Failed to wait for child: %s", strerror(errno));
+    ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+      "Child failed, status %d", status);
+  }
+
+  (void) statsd_statsd_set_fd(statsd, -1);
+
+  /* An empty histogram writes nothing. */
+  res = statsd_histogram_fold(hist, 0, statsd, "empty");
+  ck_assert_msg(res == 0, "Failed to fold histogram: %s", strerror(errno));
+
+  res = statsd_histogram_fold(hist, 1, statsd, "lat");
+  ck_assert_msg(res == 0, "Failed to fold histogram: %s", strerror(errno));
+
+  res = statsd_statsd_get_pending(statsd, &pending, &pendinglen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+    strerror(errno));
+
+  /* The exact percentiles are 500, 900, and 990; each is reported as the
+   * midpoint of its bucket.
+   */
+  expected = "pre.lat.p50:501|g\npre.lat.p90:899|g\npre.lat.p99:987|g\n"
+    "pre.lat.max:1000|g\npre.lat.count:1000|g";
+  ck_assert_msg(pendinglen == strlen(expected) &&
+    strncmp(pending, expected, pendinglen) == 0,
+    "Expected '%s', got '%.*s'", expected, (int) pendinglen, pending);
+
+  (void) statsd_statsd_close(statsd);
+
+  /* Folding resets the histogram. */
+  statsd = statsd_statsd_open(p, pr_netaddr_get_addr(p, "127.0.0.1", NULL),
+    FALSE, 1.0, NULL, NULL);
+  (void) statsd_statsd_set_fd(statsd, -1);
+
+  res = statsd_histogram_fold(hist, 1, statsd, "lat");
+  ck_assert_msg(res == 0, "Failed to fold histogram: %s", strerror(errno));
+
+  res = statsd_statsd_get_pending(statsd, &pending, &pendinglen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+    strerror(errno));
+  ck_assert_msg(pendinglen == 0, "Expected no pending metrics, got '%.*s'",
+    (int) pendinglen, pending);
+
+  (void) statsd_statsd_close(statsd);
+  (void) statsd_histogram_destroy(hist);
+}
+END_TEST
+
+Suite *tests_get_histogram_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("histogram");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, histogram_bucket_test);
+  tcase_add_test(testcase, histogram_create_test);
+  tcase_add_test(testcase, histogram_fold_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
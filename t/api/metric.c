@@ -195,6 +195,268 @@ START_TEST (metric_gauge_test) {
 }
 END_TEST
 
+START_TEST (metric_format_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  const char *buf = NULL, *expected;
+  size_t buflen = 0;
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 0.25, "p.", ".s");
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_metric_counter(statsd, "foo:bar|baz@quxx", 5, 0);
+  ck_assert_msg(res == 0, "Failed to set counter: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_metric_counter(statsd, "foo", -3,
+    STATSD_METRIC_FL_IGNORE_SAMPLING);
+  ck_assert_msg(res == 0, "Failed to set counter: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_metric_timer(statsd, "foo", 1234567890, 0);
+  ck_assert_msg(res == 0, "Failed to set timer: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_metric_gauge(statsd, "foo", -1, STATSD_METRIC_FL_GAUGE_ADJUST);
+  ck_assert_msg(res == 0, "Failed to set gauge: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_metric_gauge(statsd, "foo", 0, STATSD_METRIC_FL_GAUGE_ADJUST);
+  ck_assert_msg(res == 0, "Failed to set gauge: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_metric_gauge(statsd, "foo", -7, 0);
+  ck_assert_msg(res == 0, "Failed to set gauge: %s", strerror(errno));
+
+  expected = "p.foo_bar_baz_quxx.s:5|c|@0.25\n"
+    "p.foo.s:-3|c\n"
+    "p.foo.s:1234567890|ms|@0.25\n"
+    "p.foo.s:-1|g\n"
+    "p.foo.s:+0|g\n"
+    "p.foo.s:0|g";
+
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, &buf, &buflen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s", strerror(errno));
+  ck_assert_msg(buflen == strlen(expected), "Expected %lu bytes, got %lu",
+    (unsigned long) strlen(expected), (unsigned long) buflen);
+  ck_assert_msg(strncmp(buf, expected, buflen) == 0,
+    "Expected '%s', got '%.*s'", expected, (int) buflen, buf);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (metric_name_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  struct statsd_metric_name mn;
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 0.25, "p.", ".s");
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_metric_name_init(NULL, p, "foo", &mn);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_metric_name_init(statsd, p, NULL, &mn);
+  ck_assert_msg(res < 0, "Failed to handle null name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_metric_name_init(statsd, p, "foo:bar", &mn);
+  ck_assert_msg(res == 0, "Failed to init name: %s", strerror(errno));
+  ck_assert_msg(strcmp(mn.name, "foo:bar") == 0,
+    "Expected name 'foo:bar', got '%s'", mn.name);
+  ck_assert_msg(mn.fqnamelen == 11 && strcmp(mn.fqname, "p.foo_bar.s") == 0,
+    "Expected namespaced name 'p.foo_bar.s', got '%s'", mn.fqname);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (metric_register_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  struct statsd_metric *counter, *timer, *gauge;
+  struct statsd_sampling sampling;
+  const char *buf = NULL, *expected;
+  size_t buflen = 0;
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 0.25, "p.", ".s");
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  counter = statsd_metric_register(NULL, p, STATSD_METRIC_TYPE_COUNTER, "foo",
+    0);
+  ck_assert_msg(counter == NULL, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  counter = statsd_metric_register(statsd, p, -1, "foo", 0);
+  ck_assert_msg(counter == NULL, "Failed to handle invalid type");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_metric_write(NULL, 1);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  counter = statsd_metric_register(statsd, p, STATSD_METRIC_TYPE_COUNTER,
+    "foo:bar", 0);
+  ck_assert_msg(counter != NULL, "Failed to register counter: %s",
+    strerror(errno));
+
+  timer = statsd_metric_register(statsd, p, STATSD_METRIC_TYPE_TIMER, "foo",
+    STATSD_METRIC_FL_IGNORE_SAMPLING);
+  ck_assert_msg(timer != NULL, "Failed to register timer: %s",
+    strerror(errno));
+
+  gauge = statsd_metric_register(statsd, p, STATSD_METRIC_TYPE_GAUGE, "foo",
+    STATSD_METRIC_FL_GAUGE_ADJUST);
+  ck_assert_msg(gauge != NULL, "Failed to register gauge: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_metric_write(counter, 5);
+  ck_assert_msg(res == 0, "Failed to write counter: %s", strerror(errno));
+
+  res = statsd_metric_write(timer, 1234567890);
+  ck_assert_msg(res == 0, "Failed to write timer: %s", strerror(errno));
+
+  res = statsd_metric_write(gauge, -1);
+  ck_assert_msg(res == 0, "Failed to write gauge: %s", strerror(errno));
+
+  res = statsd_metric_write(gauge, 0);
+  ck_assert_msg(res == 0, "Failed to write gauge: %s", strerror(errno));
+
+  /* A change of the client's sampling rate is reflected in the metric. */
+  res = statsd_statsd_set_sampling(statsd, 0.5);
+  ck_assert_msg(res == 0, "Failed to set sampling: %s", strerror(errno));
+
+  res = statsd_metric_write(counter, -3);
+  ck_assert_msg(res == 0, "Failed to write counter: %s", strerror(errno));
+
+  /* A prepared sampling rate is used in place of the client's rate, except
+   * for metrics which ignore sampling.
+   */
+  mark_point();
+  res = statsd_metric_write_sampled(NULL, 1, &sampling);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_metric_write_sampled(counter, 1, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_statsd_prepare_sampling(&sampling, 0.1);
+  ck_assert_msg(res == 0, "Failed to prepare sampling: %s", strerror(errno));
+
+  res = statsd_metric_write_sampled(counter, 2, &sampling);
+  ck_assert_msg(res == 0, "Failed to write counter: %s", strerror(errno));
+
+  res = statsd_metric_write_sampled(timer, 7, &sampling);
+  ck_assert_msg(res == 0, "Failed to write timer: %s", strerror(errno));
+
+  ck_assert_msg(statsd_statsd_get_sampling(statsd) == 0.5,
+    "Expected sampling 0.5, got %g", statsd_statsd_get_sampling(statsd));
+
+  /* Registered metrics are written the same as any other metric. */
+  expected = "p.foo_bar.s:5|c|@0.25\n"
+    "p.foo.s:1234567890|ms\n"
+    "p.foo.s:-1|g\n"
+    "p.foo.s:+0|g\n"
+    "p.foo_bar.s:-3|c|@0.5\n"
+    "p.foo_bar.s:2|c|@0.1\n"
+    "p.foo.s:7|ms";
+
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, &buf, &buflen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s", strerror(errno));
+  ck_assert_msg(buflen == strlen(expected), "Expected %lu bytes, got %lu",
+    (unsigned long) strlen(expected), (unsigned long) buflen);
+  ck_assert_msg(strncmp(buf, expected, buflen) == 0,
+    "Expected '%s', got '%.*s'", expected, (int) buflen, buf);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (metric_catalog_test) {
+  register unsigned int i, j;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  enum {
+#define STATSD_METRIC(id, type, name, flags)	CATALOG_##id,
+#include "metrics.def"
+    CATALOG_COUNT
+  };
+  static const struct {
+    int type;
+    const char *name;
+    int flags;
+  } catalog[] = {
+#define STATSD_METRIC(id, type, name, flags) \
+    { STATSD_METRIC_TYPE_##type, name, flags },
+#include "metrics.def"
+  };
+
+  /* The log level counters are indexed by log level. */
+  ck_assert_msg(CATALOG_LOG_EMERG == PR_LOG_EMERG &&
+    CATALOG_LOG_ERR == PR_LOG_ERR &&
+    CATALOG_LOG_DEBUG == PR_LOG_DEBUG,
+    "Expected log level counters in log level order");
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  for (i = 0; i < CATALOG_COUNT; i++) {
+    struct statsd_metric *metric;
+
+    metric = statsd_metric_register(statsd, p, catalog[i].type,
+      catalog[i].name, catalog[i].flags);
+    ck_assert_msg(metric != NULL, "Failed to register '%s': %s",
+      catalog[i].name, strerror(errno));
+
+    for (j = i + 1; j < CATALOG_COUNT; j++) {
+      ck_assert_msg(catalog[i].type != catalog[j].type ||
+        strcmp(catalog[i].name, catalog[j].name) != 0,
+        "Duplicate catalog metric '%s'", catalog[i].name);
+    }
+  }
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
 Suite *tests_get_metric_suite(void) {
   Suite *suite;
   TCase *testcase;
@@ -207,6 +469,10 @@ Suite *tests_get_metric_suite(void) {
   tcase_add_test(testcase, metric_counter_test);
   tcase_add_test(testcase, metric_timer_test);
   tcase_add_test(testcase, metric_gauge_test);
+  tcase_add_test(testcase, metric_format_test);
+  tcase_add_test(testcase, metric_name_test);
+  tcase_add_test(testcase, metric_register_test);
+  tcase_add_test(testcase, metric_catalog_test);
 
   suite_add_tcase(suite, testcase);
   return suite;
@@ -0,0 +1,224 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Relay tests. */
+
+#include "tests.h"
+#include "statsd.h"
+#include "metric.h"
+#include "relay.h"
+
+#include <sys/wait.h>
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.relay", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.relay", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Opens a UDP socket on the loopback address, standing in for the statsd
+ * server; the chosen port is returned via the given pointer.
+ */
+static int statsd_listen(unsigned int *port) {
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ck_assert_msg(fd >= 0, "Failed to open UDP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind UDP socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get UDP socket name: %s", strerror(errno));
+
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
+START_TEST (relay_open_test) {
+  int res, fds[2];
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_relay_open(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null fds");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_relay_open(fds);
+  ck_assert_msg(res == 0, "Failed to open relay sockets: %s", strerror(errno));
+
+  mark_point();
+  statsd = statsd_statsd_open_relay(NULL, -1, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open_relay(p, -1, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle bad fd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open_relay(p, fds[0], 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open relay client: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_statsd_get_max_packet_size(statsd) ==
+    STATSD_MAX_UNIX_PACKET_SIZE, "Expected max packet size %lu, got %lu",
+    (unsigned long) STATSD_MAX_UNIX_PACKET_SIZE,
+    (unsigned long) statsd_statsd_get_max_packet_size(statsd));
+
+  (void) statsd_statsd_close(statsd);
+
+  /* The relay socket is not closed with the client. */
+  res = fcntl(fds[0], F_GETFD);
+  ck_assert_msg(res >= 0, "Relay socket unexpectedly closed: %s",
+    strerror(errno));
+
+  (void) close(fds[0]);
+  (void) close(fds[1]);
+}
+END_TEST
+
+START_TEST (relay_run_test) {
+  int fd, res, status, fds[2];
+  unsigned int port;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  pid_t pid;
+  char buf[1024];
+  ssize_t len;
+
+  mark_point();
+  res = statsd_relay_run(NULL, NULL, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  fd = statsd_listen(&port);
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  ck_assert_msg(addr != NULL, "Failed to resolve 127.0.0.1: %s",
+    strerror(errno));
+  pr_netaddr_set_port2((pr_netaddr_t *) addr, port);
+
+  res = statsd_relay_open(fds);
+  ck_assert_msg(res == 0, "Failed to open relay sockets: %s", strerror(errno));
+
+  pid = fork();
+  ck_assert_msg(pid >= 0, "Failed to fork: %s", strerror(errno));
+
+  if (pid == 0) {
+    struct statsd *client;
+
+    (void) close(fds[0]);
+
+    client = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+    if (client == NULL) {
+      _exit(1);
+    }
+
+    res = statsd_relay_run(p, &(fds[1]), &client, 1);
+    statsd_statsd_close(client);
+    _exit(res == 0 ? 0 : 1);
+  }
+
+  (void) close(fds[1]);
+
+  statsd = statsd_statsd_open_relay(p, fds[0], 1.0, "pre.", NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open relay client: %s",
+    strerror(errno));
+
+  res = statsd_metric_counter(statsd, "foo", 1, 0);
+  ck_assert_msg(res == 0, "Failed to add counter: %s", strerror(errno));
+
+  res = statsd_metric_timer(statsd, "bar", 7, 0);
+  ck_assert_msg(res == 0, "Failed to add timer: %s", strerror(errno));
+
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  /* The relay sends on what it receives, in its own packets. */
+  memset(buf, '\0', sizeof(buf));
+  len = recv(fd, buf, sizeof(buf)-1, 0);
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+  ck_assert_msg(strcmp(buf, "pre.foo:1|c\npre.bar:7|ms") == 0,
+    "Expected 'pre.foo:1|c\\npre.bar:7|ms', got '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+
+  /* Once the sessions' end is closed, the relay stops on its own. */
+  (void) close(fds[0]);
+
+  res = waitpid(pid, &status, 0);
+  ck_assert_msg(res == pid, "Failed to wait for relay: %s", strerror(errno));
+  ck_assert_msg(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+    "Relay failed, status %d", status);
+
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_relay_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("relay");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, relay_open_test);
+  tcase_add_test(testcase, relay_run_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
@@ -0,0 +1,436 @@
+/*
+ * ProFTPD - mod_statsd testsuite
+ * Copyright (c) 2026 TJ Saunders <tj@castaglia.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+/* Sketch tests. */
+
+#include "tests.h"
+#include "statsd.h"
+#include "metric.h"
+#include "sketch.h"
+
+static pool *p = NULL;
+
+static void set_up(void) {
+  if (p == NULL) {
+    p = make_sub_pool(NULL);
+  }
+
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.sketch", 1, 20);
+  }
+}
+
+static void tear_down(void) {
+  if (getenv("TEST_VERBOSE") != NULL) {
+    pr_trace_set_levels("statsd.sketch", 0, 0);
+  }
+
+  if (p) {
+    destroy_pool(p);
+    p = NULL;
+  }
+}
+
+/* Checks the sketch's estimate of the given quantile against the exact value,
+ * from the sorted values.
+ */
+static void assert_quantile(const struct statsd_sketch *sketch, double q,
+    const uint64_t *sorted, unsigned int count, double accuracy) {
+  int res;
+  uint64_t exact, val;
+  double err;
+
+  res = statsd_sketch_get_quantile(sketch, q, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile %g: %s", q, strerror(errno));
+
+  exact = sorted[(unsigned int) (q * (count - 1))];
+
+  /* Allow for the rounding of the estimate to an integer. */
+  err = (double) (val > exact ? val - exact : exact - val);
+  ck_assert_msg(err <= (accuracy * exact) + 1.0,
+    "Expected quantile %g within %g of %lu, got %lu", q, accuracy,
+    (unsigned long) exact, (unsigned long) val);
+}
+
+static int cmp_timings(const void *a, const void *b) {
+  uint64_t x, y;
+
+  x = *((const uint64_t *) a);
+  y = *((const uint64_t *) b);
+
+  return (x > y) - (x < y);
+}
+
+static int count_sketches(const char *name, size_t namelen, float sampling,
+    const struct statsd_sketch *sketch, void *user_data) {
+  unsigned int *count;
+
+  count = user_data;
+  (*count)++;
+  return 0;
+}
+
+START_TEST (sketch_create_test) {
+  struct statsd_sketch *sketch;
+  uint64_t val;
+  int res;
+
+  mark_point();
+  sketch = statsd_sketch_create(NULL, 0.01);
+  ck_assert_msg(sketch == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  sketch = statsd_sketch_create(p, 0.5);
+  ck_assert_msg(sketch == NULL, "Failed to handle invalid accuracy");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  sketch = statsd_sketch_create(p, 0.01);
+  ck_assert_msg(sketch != NULL, "Failed to create sketch: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_sketch_get_count(sketch) == 0,
+    "Expected count 0, got %lu",
+    (unsigned long) statsd_sketch_get_count(sketch));
+
+  mark_point();
+  res = statsd_sketch_get_quantile(sketch, 0.5, &val);
+  ck_assert_msg(res < 0, "Failed to handle empty sketch");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_sketch_add(NULL, 1);
+  ck_assert_msg(res < 0, "Failed to handle null sketch");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_sketch_add(sketch, 0);
+  ck_assert_msg(res == 0, "Failed to add timing: %s", strerror(errno));
+  res = statsd_sketch_add(sketch, 7);
+  ck_assert_msg(res == 0, "Failed to add timing: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_sketch_get_quantile(sketch, 2.0, &val);
+  ck_assert_msg(res < 0, "Failed to handle invalid quantile");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_sketch_get_quantile(sketch, 0.0, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(val == 0, "Expected 0, got %lu", (unsigned long) val);
+
+  res = statsd_sketch_get_quantile(sketch, 1.0, &val);
+  ck_assert_msg(res == 0, "Failed to get quantile: %s", strerror(errno));
+  ck_assert_msg(val == 7, "Expected 7, got %lu", (unsigned long) val);
+
+  res = statsd_sketch_reset(sketch);
+  ck_assert_msg(res == 0, "Failed to reset sketch: %s", strerror(errno));
+  ck_assert_msg(statsd_sketch_get_count(sketch) == 0,
+    "Expected count 0, got %lu",
+    (unsigned long) statsd_sketch_get_count(sketch));
+}
+END_TEST
+
+START_TEST (sketch_accuracy_test) {
+  register unsigned int i;
+  struct statsd_sketch *sketch;
+  uint64_t *timings;
+  unsigned int count = 10000;
+  double accuracy = 0.01;
+
+  sketch = statsd_sketch_create(p, accuracy);
+  timings = palloc(p, sizeof(uint64_t) * count);
+
+  /* A long-tailed distribution of timings. */
+  srandom(17);
+  for (i = 0; i < count; i++) {
+    uint64_t ms;
+
+    ms = (uint64_t) (random() % 100);
+    if (i % 10 == 0) {
+      ms *= 100;
+    }
+
+    if (i % 1000 == 0) {
+      ms *= 1000;
+    }
+
+    timings[i] = ms;
+    statsd_sketch_add(sketch, ms);
+  }
+
+  qsort(timings, count, sizeof(uint64_t), cmp_timings);
+
+  ck_assert_msg(statsd_sketch_get_count(sketch) == count,
+    "Expected count %u, got %lu", count,
+    (unsigned long) statsd_sketch_get_count(sketch));
+  ck_assert_msg(statsd_sketch_get_max(sketch) == timings[count-1],
+    "Expected max %lu, got %lu", (unsigned long) timings[count-1],
+    (unsigned long) statsd_sketch_get_max(sketch));
+
+  assert_quantile(sketch, 0.1, timings, count, accuracy);
+  assert_quantile(sketch, 0.5, timings, count, accuracy);
+  assert_quantile(sketch, 0.9, timings, count, accuracy);
+  assert_quantile(sketch, 0.99, timings, count, accuracy);
+  assert_quantile(sketch, 0.999, timings, count, accuracy);
+}
+END_TEST
+
+START_TEST (sketch_collapse_test) {
+  register unsigned int i;
+  struct statsd_sketch *sketch;
+  uint64_t timings[1000];
+  unsigned int count = 1000;
+  double accuracy = 0.01;
+
+  sketch = statsd_sketch_create(p, accuracy);
+
+  /* With 1% accuracy, the buckets cannot span this range of timings, so the
+   * lowest buckets are collapsed; the high quantiles remain accurate.
+   */
+  for (i = 0; i < count; i++) {
+    timings[i] = (i < 500) ? (i + 1) : (uint64_t) 1000000000UL + (i * 1000);
+    statsd_sketch_add(sketch, timings[i]);
+  }
+
+  qsort(timings, count, sizeof(uint64_t), cmp_timings);
+
+  assert_quantile(sketch, 0.9, timings, count, accuracy);
+  assert_quantile(sketch, 0.99, timings, count, accuracy);
+  ck_assert_msg(statsd_sketch_get_max(sketch) == timings[count-1],
+    "Expected max %lu, got %lu", (unsigned long) timings[count-1],
+    (unsigned long) statsd_sketch_get_max(sketch));
+}
+END_TEST
+
+START_TEST (sketch_merge_test) {
+  register unsigned int i;
+  int res;
+  struct statsd_sketch *a, *b, *c, *all;
+  double qs[] = { 0.1, 0.5, 0.9, 0.99, -1.0 };
+
+  a = statsd_sketch_create(p, 0.02);
+  b = statsd_sketch_create(p, 0.02);
+  all = statsd_sketch_create(p, 0.02);
+
+  mark_point();
+  res = statsd_sketch_merge(NULL, b);
+  ck_assert_msg(res < 0, "Failed to handle null sketch");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  c = statsd_sketch_create(p, 0.05);
+  res = statsd_sketch_merge(a, c);
+  ck_assert_msg(res < 0, "Failed to handle mismatched accuracy");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  for (i = 0; i < 2000; i++) {
+    uint64_t ms;
+
+    ms = (i * 37) % 5000;
+    statsd_sketch_add(i % 2 ? a : b, ms);
+    statsd_sketch_add(all, ms);
+  }
+
+  res = statsd_sketch_merge(a, b);
+  ck_assert_msg(res == 0, "Failed to merge sketches: %s", strerror(errno));
+
+  ck_assert_msg(statsd_sketch_get_count(a) == statsd_sketch_get_count(all),
+    "Expected count %lu, got %lu",
+    (unsigned long) statsd_sketch_get_count(all),
+    (unsigned long) statsd_sketch_get_count(a));
+
+  /* Merging is lossless: the merged sketch is the same as the sketch of all
+   * of the timings.
+   */
+  for (i = 0; qs[i] >= 0.0; i++) {
+    uint64_t merged, expected;
+
+    statsd_sketch_get_quantile(a, qs[i], &merged);
+    statsd_sketch_get_quantile(all, qs[i], &expected);
+    ck_assert_msg(merged == expected, "Expected quantile %g of %lu, got %lu",
+      qs[i], (unsigned long) expected, (unsigned long) merged);
+  }
+}
+END_TEST
+
+START_TEST (sketch_table_test) {
+  register unsigned int i;
+  int res;
+  unsigned int count = 0;
+  struct statsd_sketch_table *tab;
+  char name[32];
+
+  mark_point();
+  tab = statsd_sketch_table_create(NULL, 0.01);
+  ck_assert_msg(tab == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  tab = statsd_sketch_table_create(p, 0.01);
+  ck_assert_msg(tab != NULL, "Failed to create sketch table: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_sketch_table_should_flush(tab) == FALSE,
+    "Expected empty table to not need flushing");
+
+  mark_point();
+  res = statsd_sketch_table_add(tab, 1.0, NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null name");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  for (i = 0; i < STATSD_SKETCH_MAX_SERIES; i++) {
+    snprintf(name, sizeof(name), "metric.%u", i);
+
+    res = statsd_sketch_table_add(tab, 1.0, name, i);
+    ck_assert_msg(res == 0, "Failed to add timer '%s': %s", name,
+      strerror(errno));
+  }
+
+  mark_point();
+  res = statsd_sketch_table_add(tab, 1.0, "foo", 1);
+  ck_assert_msg(res < 0, "Failed to handle full table");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  res = statsd_sketch_table_flush(tab, count_sketches, &count);
+  ck_assert_msg(res == 0, "Failed to flush table: %s", strerror(errno));
+  ck_assert_msg(count == STATSD_SKETCH_MAX_SERIES,
+    "Expected %u sketches, got %u", STATSD_SKETCH_MAX_SERIES, count);
+  ck_assert_msg(statsd_sketch_table_get_count(tab) == 0,
+    "Expected 0 sketches after flush, got %u",
+    statsd_sketch_table_get_count(tab));
+
+  /* The sketches are reused after a flush. */
+  res = statsd_sketch_table_add(tab, 1.0, "foo", 1);
+  ck_assert_msg(res == 0, "Failed to add timer: %s", strerror(errno));
+
+  (void) statsd_sketch_table_destroy(tab);
+}
+END_TEST
+
+START_TEST (sketch_metric_test) {
+  register unsigned int i;
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+  char buf[1024];
+  ssize_t len;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  struct statsd_sketch_table *tab;
+  const char *pending = NULL;
+  size_t pendinglen = 0;
+
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ck_assert_msg(fd >= 0, "Failed to open UDP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind UDP socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get UDP socket name: %s", strerror(errno));
+
+  addr = pr_netaddr_get_addr(p, "127.0.0.1", NULL);
+  ck_assert_msg(addr != NULL, "Failed to resolve 127.0.0.1: %s",
+    strerror(errno));
+  pr_netaddr_set_port2((pr_netaddr_t *) addr, ntohs(sin.sin_port));
+
+  statsd = statsd_statsd_open(p, addr, FALSE, 0.5, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  tab = statsd_sketch_table_create(statsd_statsd_get_pool(statsd), 0.01);
+
+  mark_point();
+  res = statsd_statsd_set_sketches(NULL, tab);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_statsd_set_sketches(statsd, tab);
+  ck_assert_msg(res == 0, "Failed to set sketches: %s", strerror(errno));
+
+  for (i = 1; i <= 100; i++) {
+    res = statsd_metric_timer(statsd, "foo", i, 0);
+    ck_assert_msg(res == 0, "Failed to add timer: %s", strerror(errno));
+  }
+
+  /* Nothing is written to the client until the sketches are flushed. */
+  res = statsd_statsd_get_pending(statsd, &pending, &pendinglen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+    strerror(errno));
+  ck_assert_msg(pendinglen == 0, "Expected no pending metrics, got '%.*s'",
+    (int) pendinglen, pending);
+
+  res = statsd_metric_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  len = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT);
+  ck_assert_msg(len > 0, "Failed to receive metrics: %s", strerror(errno));
+
+  /* The percentiles are within 1% of the exact values (here, 50, 90, and
+   * 99), and the sampled count is scaled by the sampling rate.
+   */
+  ck_assert_msg(strcmp(buf, "foo.p50:50|g\nfoo.p90:89|g\nfoo.p99:99|g\n"
+    "foo.max:100|g\nfoo.count:200|g") == 0,
+    "Expected timer sketch gauges, got '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+Suite *tests_get_sketch_suite(void) {
+  Suite *suite;
+  TCase *testcase;
+
+  suite = suite_create("sketch");
+  testcase = tcase_create("base");
+
+  tcase_add_checked_fixture(testcase, set_up, tear_down);
+
+  tcase_add_test(testcase, sketch_create_test);
+  tcase_add_test(testcase, sketch_accuracy_test);
+  tcase_add_test(testcase, sketch_collapse_test);
+  tcase_add_test(testcase, sketch_merge_test);
+  tcase_add_test(testcase, sketch_table_test);
+  tcase_add_test(testcase, sketch_metric_test);
+
+  suite_add_tcase(suite, testcase);
+  return suite;
+}
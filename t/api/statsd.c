@@ -1,6 +1,6 @@
 /*
  * ProFTPD - mod_statsd testsuite
- * Copyright (c) 2017-2025 TJ Saunders <tj@castaglia.org>
+ * Copyright (c) 2017-2026 TJ Saunders <tj@castaglia.org>
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -64,6 +64,64 @@ static const pr_netaddr_t *statsd_addr(unsigned int port) {
   return addr;
 }
 
+/* Opens a UDP socket on the loopback address, for receiving the metrics sent
+ * by the client; the chosen port is returned via the given pointer.
+ */
+static int statsd_listen(unsigned int *port) {
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+
+  fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  ck_assert_msg(fd >= 0, "Failed to open UDP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind UDP socket: %s", strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get UDP socket name: %s", strerror(errno));
+
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
+/* Opens a listening TCP socket on the loopback address; the chosen port is
+ * returned via the given pointer.
+ */
+static int statsd_tcp_listen(unsigned int *port) {
+  int fd, res;
+  struct sockaddr_in sin;
+  socklen_t sinlen;
+
+  fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  ck_assert_msg(fd >= 0, "Failed to open TCP socket: %s", strerror(errno));
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = 0;
+
+  res = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+  ck_assert_msg(res == 0, "Failed to bind TCP socket: %s", strerror(errno));
+
+  res = listen(fd, 5);
+  ck_assert_msg(res == 0, "Failed to listen on TCP socket: %s",
+    strerror(errno));
+
+  sinlen = sizeof(sin);
+  res = getsockname(fd, (struct sockaddr *) &sin, &sinlen);
+  ck_assert_msg(res == 0, "Failed to get TCP socket name: %s", strerror(errno));
+
+  *port = ntohs(sin.sin_port);
+  return fd;
+}
+
 START_TEST (statsd_close_test) {
   int res;
 
@@ -106,19 +164,147 @@ START_TEST (statsd_open_test) {
 
   (void) statsd_statsd_close(statsd);
 
+  /* The TCP connect is non-blocking, so even if statsd is not listening for
+   * TCP connections, the client is opened.
+   */
   mark_point();
   statsd = statsd_statsd_open(p, addr, TRUE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open TCP statsd connection: %s",
+    strerror(errno));
 
-  /* If statsd IS running, but is not configured for TCP, the "Connection
-   * refused" error is expected.
-   */
-  if (statsd != NULL &&
-      errno != ECONNREFUSED) {
-    ck_abort_msg("Failed to open TCP statsd connection: %s", strerror(errno));
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
 
-  } else {
-    (void) statsd_statsd_close(statsd);
-  }
+START_TEST (statsd_open_unix_test) {
+  int fd, res;
+  char buf[64];
+  const char *path = "/tmp/mod_statsd-test.sock";
+  struct sockaddr_un unix_addr;
+  struct statsd *statsd;
+
+  mark_point();
+  statsd = statsd_statsd_open_unix(NULL, NULL, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open_unix(p, NULL, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle null path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  (void) unlink(path);
+
+  mark_point();
+  statsd = statsd_statsd_open_unix(p, path, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle nonexistent path");
+  ck_assert_msg(errno == ENOENT, "Expected ENOENT (%d), got %s (%d)", ENOENT,
+    strerror(errno), errno);
+
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  ck_assert_msg(fd >= 0, "Failed to open Unix domain socket: %s",
+    strerror(errno));
+
+  memset(&unix_addr, 0, sizeof(unix_addr));
+  unix_addr.sun_family = AF_UNIX;
+  sstrncpy(unix_addr.sun_path, path, sizeof(unix_addr.sun_path));
+
+  res = bind(fd, (struct sockaddr *) &unix_addr, sizeof(unix_addr));
+  ck_assert_msg(res == 0, "Failed to bind Unix domain socket: %s",
+    strerror(errno));
+
+  mark_point();
+  statsd = statsd_statsd_open_unix(p, path, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+  ck_assert_msg(statsd_statsd_get_max_packet_size(statsd) ==
+    STATSD_MAX_UNIX_PACKET_SIZE, "Expected max packet size %lu, got %lu",
+    (unsigned long) STATSD_MAX_UNIX_PACKET_SIZE,
+    (unsigned long) statsd_statsd_get_max_packet_size(statsd));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  res = statsd_statsd_write(statsd, "bar:2|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  res = recv(fd, buf, sizeof(buf)-1, MSG_DONTWAIT);
+  ck_assert_msg(res == 15, "Expected 15 bytes, got %d (%s)", res,
+    strerror(errno));
+  ck_assert_msg(strcmp(buf, "foo:1|c\nbar:2|c") == 0,
+    "Expected 'foo:1|c\\nbar:2|c', got '%s'", buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+  (void) unlink(path);
+}
+END_TEST
+
+START_TEST (statsd_open_fd_test) {
+  int fd, res, sockfd;
+  unsigned int port = 0;
+  char buf[64];
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_open_socket(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null addr and path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open_fd(NULL, -1, NULL, NULL, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle null pool");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  fd = statsd_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  sockfd = statsd_statsd_open_socket(addr, NULL);
+  ck_assert_msg(sockfd >= 0, "Failed to open socket: %s", strerror(errno));
+
+  mark_point();
+  statsd = statsd_statsd_open_fd(p, sockfd, NULL, NULL, 1.0, NULL, NULL);
+  ck_assert_msg(statsd == NULL, "Failed to handle null addr and path");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open_fd(p, sockfd, addr, NULL, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, STATSD_STATSD_FL_SEND_NOW);
+  ck_assert_msg(res == 0, "Failed to send metric: %s", strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  res = recv(fd, buf, sizeof(buf)-1, 0);
+  ck_assert_msg(res == 7, "Expected 7 bytes, got %d (%s)", res,
+    strerror(errno));
+  ck_assert_msg(strcmp(buf, "foo:1|c") == 0, "Expected 'foo:1|c', got '%s'",
+    buf);
+
+  /* Closing the client must not close the shared socket. */
+  (void) statsd_statsd_close(statsd);
+
+  res = fcntl(sockfd, F_GETFD);
+  ck_assert_msg(res >= 0, "Shared socket unexpectedly closed: %s",
+    strerror(errno));
+
+  (void) close(sockfd);
+  (void) close(fd);
 }
 END_TEST
 
@@ -192,6 +378,32 @@ START_TEST (statsd_get_namespacing_test) {
 }
 END_TEST
 
+START_TEST (statsd_get_fd_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_get_fd(NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_get_fd(statsd);
+  ck_assert_msg(res >= 0, "Failed to get fd: %s", strerror(errno));
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
 START_TEST (statsd_get_pool_test) {
   pool *res;
   const pr_netaddr_t *addr;
@@ -244,39 +456,85 @@ START_TEST (statsd_get_sampling_test) {
 }
 END_TEST
 
-START_TEST (statsd_set_fd_test) {
+START_TEST (statsd_set_sampling_test) {
+  register unsigned int i;
   int res;
-  const pr_netaddr_t *addr;
+  unsigned int nsampled = 0;
+  const char *suffix;
+  size_t suffixlen = 0;
   struct statsd *statsd;
 
   mark_point();
-  res = statsd_statsd_set_fd(NULL, -1);
+  res = statsd_statsd_set_sampling(NULL, 0.5);
   ck_assert_msg(res < 0, "Failed to handle null statsd");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
-  addr = statsd_addr(STATSD_DEFAULT_PORT);
-
   mark_point();
-  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  statsd = statsd_statsd_open(p, statsd_addr(STATSD_DEFAULT_PORT), FALSE,
+    1.0, NULL, NULL);
   ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
     strerror(errno));
 
   mark_point();
-  res = statsd_statsd_set_fd(statsd, -1);
-  ck_assert_msg(res == 0, "Failed to set fd: %s", strerror(errno));
+  res = statsd_statsd_set_sampling(statsd, 0.0);
+  ck_assert_msg(res < 0, "Failed to handle zero sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_set_sampling(statsd, 1.5);
+  ck_assert_msg(res < 0, "Failed to handle too-large sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_set_sampling(statsd, 0.25);
+  ck_assert_msg(res == 0, "Failed to set sampling: %s", strerror(errno));
+  ck_assert_msg(statsd_statsd_get_sampling(statsd) == 0.25,
+    "Expected sampling 0.25, got %g", statsd_statsd_get_sampling(statsd));
+
+  suffix = statsd_statsd_get_sampling_suffix(statsd, &suffixlen);
+  ck_assert_msg(suffixlen == 6 && strncmp(suffix, "|@0.25", 6) == 0,
+    "Expected '|@0.25', got '%.*s'", (int) suffixlen, suffix);
+
+  /* A client opened without sampling still gets its PRNG seeded. */
+  for (i = 0; i < 100000; i++) {
+    if (statsd_statsd_should_sample(statsd) == TRUE) {
+      nsampled++;
+    }
+  }
+
+  ck_assert_msg(nsampled > 24000 && nsampled < 26000,
+    "Expected about 25000 sampled, got %u", nsampled);
+
+  /* Restoring the rate removes the suffix. */
+  mark_point();
+  res = statsd_statsd_set_sampling(statsd, 1.0);
+  ck_assert_msg(res == 0, "Failed to set sampling: %s", strerror(errno));
+
+  suffix = statsd_statsd_get_sampling_suffix(statsd, &suffixlen);
+  ck_assert_msg(suffixlen == 0, "Expected no suffix, got '%.*s'",
+    (int) suffixlen, suffix);
+
+  for (i = 0; i < 1000; i++) {
+    res = statsd_statsd_should_sample(statsd);
+    ck_assert_msg(res == TRUE, "Expected TRUE, got %d", res);
+  }
 
   (void) statsd_statsd_close(statsd);
 }
 END_TEST
 
-START_TEST (statsd_write_test) {
+START_TEST (statsd_should_sample_test) {
+  register unsigned int i;
   int res;
+  unsigned int nsampled = 0;
   const pr_netaddr_t *addr;
   struct statsd *statsd;
 
   mark_point();
-  res = statsd_statsd_write(NULL, NULL, 0, 0);
+  res = statsd_statsd_should_sample(NULL);
   ck_assert_msg(res < 0, "Failed to handle null statsd");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
@@ -288,30 +546,219 @@ START_TEST (statsd_write_test) {
   ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
     strerror(errno));
 
+  for (i = 0; i < 1000; i++) {
+    res = statsd_statsd_should_sample(statsd);
+    ck_assert_msg(res == TRUE, "Expected TRUE, got %d", res);
+  }
+
+  (void) statsd_statsd_close(statsd);
+
   mark_point();
-  res = statsd_statsd_write(statsd, NULL, 0, 0);
-  ck_assert_msg(res < 0, "Failed to handle null metric");
+  statsd = statsd_statsd_open(p, addr, FALSE, 0.25, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  for (i = 0; i < 100000; i++) {
+    res = statsd_statsd_should_sample(statsd);
+    ck_assert_msg(res == TRUE || res == FALSE, "Expected TRUE/FALSE, got %d",
+      res);
+    if (res == TRUE) {
+      nsampled++;
+    }
+  }
+
+  ck_assert_msg(nsampled > 24000 && nsampled < 26000,
+    "Expected about 25000 sampled, got %u", nsampled);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_prepare_sampling_test) {
+  register unsigned int i;
+  int res;
+  unsigned int nsampled = 0;
+  struct statsd_sampling sampling;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_prepare_sampling(NULL, 0.5);
+  ck_assert_msg(res < 0, "Failed to handle null sampling");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = statsd_statsd_write(statsd, "foo", 0, 0);
-  ck_assert_msg(res < 0, "Failed to handle zero length metric");
+  res = statsd_statsd_prepare_sampling(&sampling, 0.0);
+  ck_assert_msg(res < 0, "Failed to handle zero sampling");
   ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
     strerror(errno), errno);
 
   mark_point();
-  res = statsd_statsd_write(statsd, "foo", 3, 0);
-  ck_assert_msg(res == 0, "Failed to send metric: %s", strerror(errno));
+  res = statsd_statsd_prepare_sampling(&sampling, 0.25);
+  ck_assert_msg(res == 0, "Failed to prepare sampling: %s", strerror(errno));
+  ck_assert_msg(sampling.suffixlen == 6 &&
+    strncmp(sampling.suffix, "|@0.25", 6) == 0,
+    "Expected '|@0.25', got '%.*s'", (int) sampling.suffixlen,
+    sampling.suffix);
 
   mark_point();
-  res = statsd_statsd_write(statsd, "bar", 3, STATSD_STATSD_FL_SEND_NOW);
-  ck_assert_msg(res == 0, "Failed to send metric now: %s", strerror(errno));
+  res = statsd_statsd_should_sample_at(NULL, &sampling);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, statsd_addr(STATSD_DEFAULT_PORT), FALSE,
+    1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  res = statsd_statsd_should_sample_at(statsd, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* The prepared rate is used without changing the client's rate. */
+  for (i = 0; i < 100000; i++) {
+    if (statsd_statsd_should_sample_at(statsd, &sampling) == TRUE) {
+      nsampled++;
+    }
+  }
+
+  ck_assert_msg(nsampled > 24000 && nsampled < 26000,
+    "Expected about 25000 sampled, got %u", nsampled);
+  ck_assert_msg(statsd_statsd_get_sampling(statsd) == 1.0,
+    "Expected sampling 1.0, got %g", statsd_statsd_get_sampling(statsd));
+
+  mark_point();
+  res = statsd_statsd_prepare_sampling(&sampling, 1.0);
+  ck_assert_msg(res == 0, "Failed to prepare sampling: %s", strerror(errno));
+  ck_assert_msg(sampling.suffixlen == 0, "Expected no suffix, got '%.*s'",
+    (int) sampling.suffixlen, sampling.suffix);
+
+  for (i = 0; i < 1000; i++) {
+    res = statsd_statsd_should_sample_at(statsd, &sampling);
+    ck_assert_msg(res == TRUE, "Expected TRUE, got %d", res);
+  }
 
   (void) statsd_statsd_close(statsd);
+}
+END_TEST
 
-  /* Now test sending metrics to a bad port. */
-  addr = statsd_addr(45778);
+START_TEST (statsd_sample_once_test) {
+  register unsigned int i;
+  int res;
+  unsigned int nsampled = 0;
+
+  mark_point();
+  res = statsd_statsd_sample_once(-1.0);
+  ck_assert_msg(res < 0, "Failed to handle negative sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_sample_once(2.0);
+  ck_assert_msg(res < 0, "Failed to handle too-large sampling");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  for (i = 0; i < 100; i++) {
+    res = statsd_statsd_sample_once(0.0);
+    ck_assert_msg(res == FALSE, "Expected FALSE, got %d", res);
+
+    res = statsd_statsd_sample_once(1.0);
+    ck_assert_msg(res == TRUE, "Expected TRUE, got %d", res);
+  }
+
+  for (i = 0; i < 10000; i++) {
+    if (statsd_statsd_sample_once(0.5) == TRUE) {
+      nsampled++;
+    }
+  }
+
+  ck_assert_msg(nsampled > 4500 && nsampled < 5500,
+    "Expected about 5000 sampled, got %u", nsampled);
+}
+END_TEST
+
+START_TEST (statsd_format_sampling_test) {
+  register unsigned int i;
+  int res;
+  char buf[32];
+  const char *suffix;
+  size_t suffixlen = 0;
+  struct statsd *statsd;
+  static const struct {
+    double rate;
+    const char *text;
+  } rates[] = {
+    { 1.0,	"|@1" },
+    { 0.5,	"|@0.5" },
+    { 0.25,	"|@0.25" },
+    { 0.333,	"|@0.333" },
+    { 0.005,	"|@0.005" },
+    { 0.001,	"|@0.001" },
+    { 0.0001234,	"|@0.000123" },
+    { 0.0, NULL }
+  };
+
+  mark_point();
+  res = statsd_statsd_format_sampling(NULL, 0, 0.5);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_format_sampling(buf, sizeof(buf), 0.0);
+  ck_assert_msg(res < 0, "Failed to handle zero rate");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_format_sampling(buf, 4, 0.5);
+  ck_assert_msg(res < 0, "Failed to handle too-small buffer");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  for (i = 0; rates[i].text != NULL; i++) {
+    mark_point();
+    res = statsd_statsd_format_sampling(buf, sizeof(buf), rates[i].rate);
+    ck_assert_msg(res == (int) strlen(rates[i].text),
+      "Expected length %lu for %g, got %d",
+      (unsigned long) strlen(rates[i].text), rates[i].rate, res);
+    ck_assert_msg(strcmp(buf, rates[i].text) == 0,
+      "Expected '%s' for %g, got '%s'", rates[i].text, rates[i].rate, buf);
+  }
+
+  /* The rate as formatted for the client, from its float sampling. */
+  mark_point();
+  statsd = statsd_statsd_open(p, statsd_addr(STATSD_DEFAULT_PORT), FALSE,
+    0.003, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  suffix = statsd_statsd_get_sampling_suffix(statsd, &suffixlen);
+  ck_assert_msg(suffixlen == 7 && strncmp(suffix, "|@0.003", 7) == 0,
+    "Expected '|@0.003', got '%.*s'", (int) suffixlen, suffix);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_get_fill_test) {
+  int res;
+  unsigned int fill_pct = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  char metric[64];
+
+  mark_point();
+  res = statsd_statsd_get_fill(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
 
   mark_point();
   statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
@@ -319,8 +766,674 @@ START_TEST (statsd_write_test) {
     strerror(errno));
 
   mark_point();
-  res = statsd_statsd_write(statsd, "bar", 3, STATSD_STATSD_FL_SEND_NOW);
-  ck_assert_msg(res == 0, "Failed to send metric now: %s", strerror(errno));
+  res = statsd_statsd_get_fill(statsd, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null fill");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  res = statsd_statsd_set_max_packet_size(statsd, 100);
+  ck_assert_msg(res == 0, "Failed to set max packet size: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_get_fill(statsd, &fill_pct);
+  ck_assert_msg(res == 0, "Failed to get fill: %s", strerror(errno));
+  ck_assert_msg(fill_pct == 0, "Expected fill 0, got %u", fill_pct);
+
+  memset(metric, 'a', sizeof(metric));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, metric, 50, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  res = statsd_statsd_get_fill(statsd, &fill_pct);
+  ck_assert_msg(res == 0, "Failed to get fill: %s", strerror(errno));
+  ck_assert_msg(fill_pct == 50, "Expected fill 50, got %u", fill_pct);
+
+  /* With the newline separating the metrics, the packet is now full. */
+  mark_point();
+  res = statsd_statsd_write(statsd, metric, 49, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  res = statsd_statsd_get_fill(statsd, &fill_pct);
+  ck_assert_msg(res == 0, "Failed to get fill: %s", strerror(errno));
+  ck_assert_msg(fill_pct == 100, "Expected fill 100, got %u", fill_pct);
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  res = statsd_statsd_get_fill(statsd, &fill_pct);
+  ck_assert_msg(res == 0, "Failed to get fill: %s", strerror(errno));
+  ck_assert_msg(fill_pct == 0, "Expected fill 0, got %u", fill_pct);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_set_max_packet_size_test) {
+  int fd, res;
+  unsigned int port = 0;
+  size_t pktsz;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  char metric[1024], data[2048];
+  ssize_t datalen;
+
+  mark_point();
+  res = statsd_statsd_set_max_packet_size(NULL, 0);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  fd = statsd_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  pktsz = statsd_statsd_get_max_packet_size(statsd);
+  ck_assert_msg(pktsz == STATSD_MAX_UDP_PACKET_SIZE,
+    "Expected default packet size %lu, got %lu",
+    (unsigned long) STATSD_MAX_UDP_PACKET_SIZE, (unsigned long) pktsz);
+
+  mark_point();
+  res = statsd_statsd_set_max_packet_size(statsd, 1);
+  ck_assert_msg(res < 0, "Failed to handle too-small packet size");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_set_max_packet_size(statsd, 65536);
+  ck_assert_msg(res < 0, "Failed to handle too-large packet size");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  memset(metric, 'a', sizeof(metric));
+
+  /* This metric is too large for the default packet size. */
+  mark_point();
+  res = statsd_statsd_write(statsd, metric, sizeof(metric), 0);
+  ck_assert_msg(res < 0, "Failed to handle oversized metric");
+  ck_assert_msg(errno == EMSGSIZE, "Expected EMSGSIZE (%d), got %s (%d)",
+    EMSGSIZE, strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_set_max_packet_size(statsd, 1400);
+  ck_assert_msg(res == 0, "Failed to set packet size: %s", strerror(errno));
+
+  pktsz = statsd_statsd_get_max_packet_size(statsd);
+  ck_assert_msg(pktsz == 1400, "Expected packet size 1400, got %lu",
+    (unsigned long) pktsz);
+
+  mark_point();
+  res = statsd_statsd_write(statsd, metric, sizeof(metric), 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  /* This metric will not fit into the same packet. */
+  mark_point();
+  res = statsd_statsd_write(statsd, metric, 500, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  datalen = recv(fd, data, sizeof(data), 0);
+  ck_assert_msg(datalen == sizeof(metric), "Expected %lu bytes, got %ld",
+    (unsigned long) sizeof(metric), (long) datalen);
+
+  datalen = recv(fd, data, sizeof(data), 0);
+  ck_assert_msg(datalen == 500, "Expected 500 bytes, got %ld", (long) datalen);
+
+  /* For a statsd server on the loopback interface, the automatic packet size
+   * should be at least our default.
+   */
+  mark_point();
+  res = statsd_statsd_set_max_packet_size(statsd, 0);
+  ck_assert_msg(res == 0, "Failed to set packet size: %s", strerror(errno));
+
+  pktsz = statsd_statsd_get_max_packet_size(statsd);
+  ck_assert_msg(pktsz >= STATSD_MAX_UDP_PACKET_SIZE,
+    "Expected packet size of at least %lu, got %lu",
+    (unsigned long) STATSD_MAX_UDP_PACKET_SIZE, (unsigned long) pktsz);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (statsd_set_fd_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_set_fd(NULL, -1);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_set_fd(statsd, -1);
+  ck_assert_msg(res == 0, "Failed to set fd: %s", strerror(errno));
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_write_test) {
+  int res;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_write(NULL, NULL, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  addr = statsd_addr(STATSD_DEFAULT_PORT);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, NULL, 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle null metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo", 0, 0);
+  ck_assert_msg(res < 0, "Failed to handle zero length metric");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo", 3, 0);
+  ck_assert_msg(res == 0, "Failed to send metric: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "bar", 3, STATSD_STATSD_FL_SEND_NOW);
+  ck_assert_msg(res == 0, "Failed to send metric now: %s", strerror(errno));
+
+  (void) statsd_statsd_close(statsd);
+
+  /* Now test sending metrics to a bad port. */
+  addr = statsd_addr(45778);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "bar", 3, STATSD_STATSD_FL_SEND_NOW);
+  ck_assert_msg(res == 0, "Failed to send metric now: %s", strerror(errno));
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_write_buffered_test) {
+  register unsigned int i;
+  int fd, res;
+  unsigned int port = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  const char *buf = NULL, *pending = NULL;
+  size_t buflen = 0, pending_len = 0;
+  char data[STATSD_MAX_UDP_PACKET_SIZE + 1];
+  ssize_t datalen;
+
+  fd = statsd_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null buffer");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, &buf, &buflen);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s", strerror(errno));
+  ck_assert_msg(buf != NULL, "Expected pending buffer, got null");
+  ck_assert_msg(buflen == 0, "Expected 0 pending bytes, got %lu",
+    (unsigned long) buflen);
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "bar:2|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  /* The pending metrics must be in the same buffer, without any new
+   * allocations.
+   */
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, &pending, &pending_len);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s", strerror(errno));
+  ck_assert_msg(pending == buf, "Expected pending buffer %p, got %p", buf,
+    pending);
+  ck_assert_msg(pending_len == 15, "Expected 15 pending bytes, got %lu",
+    (unsigned long) pending_len);
+  ck_assert_msg(strncmp(pending, "foo:1|c\nbar:2|c", 15) == 0,
+    "Expected 'foo:1|c\\nbar:2|c', got '%.*s'", (int) pending_len, pending);
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  datalen = recv(fd, data, sizeof(data), 0);
+  ck_assert_msg(datalen == 15, "Expected 15 bytes, got %ld", (long) datalen);
+  ck_assert_msg(strncmp(data, "foo:1|c\nbar:2|c", 15) == 0,
+    "Expected 'foo:1|c\\nbar:2|c', got '%.*s'", (int) datalen, data);
+
+  mark_point();
+  res = statsd_statsd_get_pending(statsd, &pending, &pending_len);
+  ck_assert_msg(res == 0, "Failed to get pending metrics: %s", strerror(errno));
+  ck_assert_msg(pending == buf, "Expected pending buffer %p, got %p", buf,
+    pending);
+  ck_assert_msg(pending_len == 0, "Expected 0 pending bytes, got %lu",
+    (unsigned long) pending_len);
+
+  /* Write enough metrics to fill multiple packets; each packet must stay
+   * within the max packet size, and the buffer must be reused.
+   */
+  for (i = 0; i < 100; i++) {
+    res = statsd_statsd_write(statsd, "command.NOOP.200:1|c", 20, 0);
+    ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+    res = statsd_statsd_get_pending(statsd, &pending, &pending_len);
+    ck_assert_msg(res == 0, "Failed to get pending metrics: %s",
+      strerror(errno));
+    ck_assert_msg(pending == buf, "Expected pending buffer %p, got %p", buf,
+      pending);
+  }
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  /* 24 metrics of 21 bytes (including newline) fit in each packet; 100
+   * metrics thus require 5 packets.
+   */
+  for (i = 0; i < 5; i++) {
+    datalen = recv(fd, data, sizeof(data), 0);
+    ck_assert_msg(datalen > 0, "Failed to receive packet #%u: %s", i + 1,
+      strerror(errno));
+    ck_assert_msg(datalen <= STATSD_MAX_UDP_PACKET_SIZE,
+      "Packet #%u exceeds max packet size: %ld bytes", i + 1, (long) datalen);
+  }
+
+  /* Metrics which could never fit into a packet are rejected. */
+  memset(data, 'a', sizeof(data));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, data, sizeof(data), 0);
+  ck_assert_msg(res < 0, "Failed to handle oversized metric");
+  ck_assert_msg(errno == EMSGSIZE, "Expected EMSGSIZE (%d), got %s (%d)",
+    EMSGSIZE, strerror(errno), errno);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (statsd_write_batched_test) {
+  register unsigned int i;
+  int fd, res;
+  unsigned int nmetrics = 0, port = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+  char data[STATSD_MAX_UDP_PACKET_SIZE + 1];
+  ssize_t datalen;
+
+  fd = statsd_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  /* 24 metrics of 21 bytes (including newline) fit in each packet; 200
+   * metrics thus require 9 packets, which is less than a full batch.
+   */
+  for (i = 0; i < 200; i++) {
+    res = statsd_statsd_write(statsd, "command.NOOP.200:1|c", 20, 0);
+    ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+  }
+
+  /* Nothing should have been sent yet. */
+  datalen = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+  ck_assert_msg(datalen < 0, "Received %ld bytes unexpectedly",
+    (long) datalen);
+  ck_assert_msg(errno == EAGAIN || errno == EWOULDBLOCK,
+    "Expected EAGAIN (%d), got %s (%d)", EAGAIN, strerror(errno), errno);
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  for (i = 0; i < 9; i++) {
+    ssize_t j;
+
+    datalen = recv(fd, data, sizeof(data), 0);
+    ck_assert_msg(datalen > 0, "Failed to receive packet #%u: %s", i + 1,
+      strerror(errno));
+    ck_assert_msg(datalen <= STATSD_MAX_UDP_PACKET_SIZE,
+      "Packet #%u exceeds max packet size: %ld bytes", i + 1, (long) datalen);
+    ck_assert_msg(data[0] != '\n' && data[datalen-1] != '\n',
+      "Packet #%u has leading/trailing newline", i + 1);
+
+    nmetrics++;
+    for (j = 0; j < datalen; j++) {
+      if (data[j] == '\n') {
+        nmetrics++;
+      }
+    }
+  }
+
+  ck_assert_msg(nmetrics == 200, "Expected 200 metrics, got %u", nmetrics);
+
+  /* Filling more than a full batch of packets sends the full batch. */
+  for (i = 0; i < (STATSD_MAX_BATCH_PACKETS * 24) + 1; i++) {
+    res = statsd_statsd_write(statsd, "command.NOOP.200:1|c", 20, 0);
+    ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+  }
+
+  for (i = 0; i < STATSD_MAX_BATCH_PACKETS; i++) {
+    datalen = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+    ck_assert_msg(datalen == 503, "Expected 503 bytes for packet #%u, got %ld",
+      i + 1, (long) datalen);
+  }
+
+  datalen = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+  ck_assert_msg(datalen < 0, "Received %ld bytes unexpectedly",
+    (long) datalen);
+
+  (void) statsd_statsd_close(statsd);
+
+  datalen = recv(fd, data, sizeof(data), 0);
+  ck_assert_msg(datalen == 20, "Expected 20 bytes, got %ld", (long) datalen);
+
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (statsd_write_unreachable_test) {
+  int fd, res;
+  unsigned int port = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  /* Find a free port, then close the socket, so that nothing is listening
+   * on that port.
+   */
+  fd = statsd_listen(&port);
+  (void) close(fd);
+
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, FALSE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  /* The first packet is sent, and elicits an ICMP error. */
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, STATSD_STATSD_FL_SEND_NOW);
+  ck_assert_msg(res == 0, "Failed to send metric now: %s", strerror(errno));
+
+  /* The next packet learns of the ICMP error, via the connected socket. */
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, STATSD_STATSD_FL_SEND_NOW);
+  ck_assert_msg(res < 0, "Failed to handle unreachable statsd server");
+  ck_assert_msg(errno == ECONNREFUSED, "Expected ECONNREFUSED (%d), got %s (%d)",
+    ECONNREFUSED, strerror(errno), errno);
+
+  /* Subsequent packets are dropped without being sent. */
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res < 0, "Failed to handle unreachable statsd server");
+  ck_assert_msg(errno == ECONNREFUSED, "Expected ECONNREFUSED (%d), got %s (%d)",
+    ECONNREFUSED, strerror(errno), errno);
+
+  (void) statsd_statsd_close(statsd);
+}
+END_TEST
+
+START_TEST (statsd_write_tcp_test) {
+  register unsigned int i;
+  int fd, res;
+  unsigned int port = 0;
+  char buf[64];
+  size_t buflen = 0;
+  const char *expected = "foo:1|c\nbar:2|c\n";
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  fd = statsd_tcp_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, TRUE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  res = statsd_statsd_write(statsd, "bar:2|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  /* The connection is accepted by the kernel, even before we accept(2) it;
+   * the metrics are sent once the non-blocking connect completes.
+   */
+  res = accept(fd, NULL, NULL);
+  ck_assert_msg(res >= 0, "Failed to accept TCP connection: %s",
+    strerror(errno));
+  (void) close(fd);
+  fd = res;
+
+  memset(buf, '\0', sizeof(buf));
+  for (i = 0; i < 100 && buflen < strlen(expected); i++) {
+    res = statsd_statsd_flush(statsd);
+    ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+    res = recv(fd, buf + buflen, sizeof(buf) - buflen - 1, MSG_DONTWAIT);
+    if (res > 0) {
+      buflen += res;
+
+    } else {
+      usleep(10000);
+    }
+  }
+
+  ck_assert_msg(strcmp(buf, expected) == 0, "Expected '%s', got '%s'",
+    expected, buf);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (statsd_write_tcp_coalesced_test) {
+  register unsigned int i;
+  int fd, res;
+  unsigned int port = 0;
+  char buf[128];
+  size_t buflen = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  fd = statsd_tcp_listen(&port);
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, TRUE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  res = accept(fd, NULL, NULL);
+  ck_assert_msg(res >= 0, "Failed to accept TCP connection: %s",
+    strerror(errno));
+  (void) close(fd);
+  fd = res;
+
+  /* Make sure the connection is complete, so that only coalescing delays
+   * the sending of metrics.
+   */
+  for (i = 0; i < 100; i++) {
+    res = statsd_statsd_write(statsd, "x:1|c", 5, STATSD_STATSD_FL_SEND_NOW);
+    ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+    res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (res > 0) {
+      break;
+    }
+
+    usleep(10000);
+  }
+
+  ck_assert_msg(res == 6, "Expected 6 bytes, got %d (%s)", res,
+    strerror(errno));
+
+  /* These metrics stay queued until flushed. */
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  res = statsd_statsd_write(statsd, "bar:2|c", 7, 0);
+  ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+
+  usleep(10000);
+  res = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+  ck_assert_msg(res < 0, "Expected no data before flush, got %d bytes", res);
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res == 0, "Failed to flush metrics: %s", strerror(errno));
+
+  memset(buf, '\0', sizeof(buf));
+  for (i = 0; i < 100 && buflen < 16; i++) {
+    res = recv(fd, buf + buflen, sizeof(buf) - buflen - 1, MSG_DONTWAIT);
+    if (res > 0) {
+      buflen += res;
+
+    } else {
+      usleep(10000);
+    }
+  }
+
+  ck_assert_msg(strcmp(buf, "foo:1|c\nbar:2|c\n") == 0,
+    "Expected 'foo:1|c\\nbar:2|c\\n', got '%s'", buf);
+
+  /* Once the queued metrics reach the max packet size, they are sent
+   * without waiting for a flush.
+   */
+  res = statsd_statsd_set_max_packet_size(statsd, 64);
+  ck_assert_msg(res == 0, "Failed to set max packet size: %s",
+    strerror(errno));
+
+  for (i = 0; i < 8; i++) {
+    res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+    ck_assert_msg(res == 0, "Failed to write metric: %s", strerror(errno));
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  buflen = 0;
+  for (i = 0; i < 100 && buflen < 64; i++) {
+    res = recv(fd, buf + buflen, sizeof(buf) - buflen - 1, MSG_DONTWAIT);
+    if (res > 0) {
+      buflen += res;
+
+    } else {
+      usleep(10000);
+    }
+  }
+
+  ck_assert_msg(buflen == 64, "Expected 64 bytes, got %lu",
+    (unsigned long) buflen);
+
+  (void) statsd_statsd_close(statsd);
+  (void) close(fd);
+}
+END_TEST
+
+START_TEST (statsd_write_tcp_full_test) {
+  register unsigned int i;
+  int fd, res;
+  unsigned int port = 0;
+  unsigned long dropped = 0;
+  const pr_netaddr_t *addr;
+  struct statsd *statsd;
+
+  mark_point();
+  res = statsd_statsd_get_dropped(NULL, NULL);
+  ck_assert_msg(res < 0, "Failed to handle null statsd");
+  ck_assert_msg(errno == EINVAL, "Expected EINVAL (%d), got %s (%d)", EINVAL,
+    strerror(errno), errno);
+
+  /* Find a free port, then close the socket, so that nothing is listening
+   * on that port.
+   */
+  fd = statsd_listen(&port);
+  (void) close(fd);
+
+  addr = statsd_addr(port);
+
+  mark_point();
+  statsd = statsd_statsd_open(p, addr, TRUE, 1.0, NULL, NULL);
+  ck_assert_msg(statsd != NULL, "Failed to open statsd connection: %s",
+    strerror(errno));
+
+  /* With no statsd server, metrics are queued until the queue is full. */
+  for (i = 0; i < (STATSD_TCP_RING_SIZE / 8); i++) {
+    res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+    ck_assert_msg(res == 0, "Failed to queue metric #%u: %s", i + 1,
+      strerror(errno));
+  }
+
+  mark_point();
+  res = statsd_statsd_write(statsd, "foo:1|c", 7, 0);
+  ck_assert_msg(res < 0, "Failed to handle full queue");
+  ck_assert_msg(errno == ENOSPC, "Expected ENOSPC (%d), got %s (%d)", ENOSPC,
+    strerror(errno), errno);
+
+  res = statsd_statsd_get_dropped(statsd, &dropped);
+  ck_assert_msg(res == 0, "Failed to get dropped count: %s", strerror(errno));
+  ck_assert_msg(dropped == 1, "Expected 1 dropped metric, got %lu", dropped);
+
+  mark_point();
+  res = statsd_statsd_flush(statsd);
+  ck_assert_msg(res < 0, "Failed to handle unreachable statsd server");
 
   (void) statsd_statsd_close(statsd);
 }
@@ -371,11 +1484,27 @@ Suite *tests_get_statsd_suite(void) {
 
   tcase_add_test(testcase, statsd_close_test);
   tcase_add_test(testcase, statsd_open_test);
+  tcase_add_test(testcase, statsd_open_unix_test);
+  tcase_add_test(testcase, statsd_open_fd_test);
   tcase_add_test(testcase, statsd_get_namespacing_test);
+  tcase_add_test(testcase, statsd_get_fd_test);
   tcase_add_test(testcase, statsd_get_pool_test);
   tcase_add_test(testcase, statsd_get_sampling_test);
+  tcase_add_test(testcase, statsd_set_sampling_test);
+  tcase_add_test(testcase, statsd_should_sample_test);
+  tcase_add_test(testcase, statsd_prepare_sampling_test);
+  tcase_add_test(testcase, statsd_sample_once_test);
+  tcase_add_test(testcase, statsd_format_sampling_test);
+  tcase_add_test(testcase, statsd_get_fill_test);
+  tcase_add_test(testcase, statsd_set_max_packet_size_test);
   tcase_add_test(testcase, statsd_set_fd_test);
   tcase_add_test(testcase, statsd_write_test);
+  tcase_add_test(testcase, statsd_write_buffered_test);
+  tcase_add_test(testcase, statsd_write_batched_test);
+  tcase_add_test(testcase, statsd_write_unreachable_test);
+  tcase_add_test(testcase, statsd_write_tcp_test);
+  tcase_add_test(testcase, statsd_write_tcp_coalesced_test);
+  tcase_add_test(testcase, statsd_write_tcp_full_test);
   tcase_add_test(testcase, statsd_flush_test);
 
   suite_add_tcase(suite, testcase);
@@ -32,6 +32,12 @@ struct testsuite_info {
 static struct testsuite_info suites[] = {
   { "statsd",		tests_get_statsd_suite },
   { "metric",		tests_get_metric_suite },
+  { "arena",		tests_get_arena_suite },
+  { "relay",		tests_get_relay_suite },
+  { "aggregate",	tests_get_aggregate_suite },
+  { "sketch",		tests_get_sketch_suite },
+  { "histogram",	tests_get_histogram_suite },
+  { "cardinality",	tests_get_cardinality_suite },
 
   { NULL, NULL }
 };
@@ -37,6 +37,12 @@
 
 Suite *tests_get_statsd_suite(void);
 Suite *tests_get_metric_suite(void);
+Suite *tests_get_arena_suite(void);
+Suite *tests_get_relay_suite(void);
+Suite *tests_get_aggregate_suite(void);
+Suite *tests_get_sketch_suite(void);
+Suite *tests_get_histogram_suite(void);
+Suite *tests_get_cardinality_suite(void);
 
 extern volatile unsigned int recvd_signal_flags;
 extern pid_t mpid;
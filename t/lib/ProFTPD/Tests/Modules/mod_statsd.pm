@@ -62,6 +62,71 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  statsd_max_packet_size => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_server_ttl => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_opt_shared_socket => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_opt_shared_counters => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_opt_relay => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_opt_aggregate => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_timer_sketch => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_opt_shared_histograms => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_flush_interval => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_sampling_session => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_command_sampling => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_tail_sampling => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  statsd_max_metric_names => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -930,6 +995,9 @@ sub statsd_exclude_filter {
       my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
       $client->login($setup->{user}, $setup->{passwd});
       $client->syst();
+
+      # The second time, the filter result for SYST is already known.
+      $client->syst();
       $client->quit();
     };
     if ($@) {
@@ -968,6 +1036,9 @@ sub statsd_exclude_filter {
         "Expected count values for $counter_name, found none");
     }
 
+    $self->assert(!defined($counters->{'command.SYST.215'}),
+      "Expected no count values for command.SYST.215, found some");
+
     my $timers = get_statsd_info('timers');
 
     # For timers, we simply expect to HAVE timings
@@ -1094,4 +1165,1581 @@ sub statsd_log_levels {
   test_cleanup($setup, $ex);
 }
 
+sub statsd_max_packet_size {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdMaxPacketSize => 'auto',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_server_ttl {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdServerTTL => 1,
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_opt_shared_socket {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdOptions => 'SharedSocket',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_opt_shared_counters {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.arena:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdOptions => 'SharedCounters',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_opt_relay {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.relay:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdOptions => 'Relay',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_opt_aggregate {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdOptions => 'Aggregate',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_timer_sketch {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20 statsd.sketch:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdTimerSketch => 'on 2',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Timings are sent as percentile gauges, rather than as timers.
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      foreach my $label (qw(p50 p90 p99 max count)) {
+        my $gauge_name = "$timer_name.$label";
+        $self->assert(defined($gauges->{$gauge_name}),
+          "Expected gauge $gauge_name, found none");
+      }
+
+      $self->assert($gauges->{"$timer_name.count"} == 1,
+        "Expected $timer_name.count gauge 1, got " .
+        $gauges->{"$timer_name.count"});
+    }
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_opt_shared_histograms {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.histogram:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdOptions => 'SharedHistograms',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+
+    # The daemon sends the histogram percentiles at shutdown; USER and PASS
+    # are both authentication commands.
+    foreach my $label (qw(p50 p90 p99 max)) {
+      my $gauge_name = "latency.auth.$label";
+      $self->assert(defined($gauges->{$gauge_name}),
+        "Expected gauge $gauge_name, found none");
+    }
+
+    $self->assert($gauges->{'latency.auth.count'} == 2,
+      "Expected latency.auth.count gauge 2, got " .
+      $gauges->{'latency.auth.count'});
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_flush_interval {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        # Long enough that the metrics are only sent at session end.
+        StatsdFlushInterval => '60',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_sampling_session {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        # Low enough that the session is almost certainly not sampled.
+        StatsdSampling => '0.0001 session',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    # An unsampled session sends no command metrics.
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      $self->assert(!defined($counters->{$counter_name}),
+        "Expected no count values for $counter_name, found some");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our unsampled connection gauge is a GAUGE; we expect it to have the same
+    # value after as before.
+    $self->assert(defined($gauges->{'connection.unsampled'}),
+      "Expected connection.unsampled gauge, found none");
+    $self->assert($gauges->{'connection.unsampled'} == 0,
+      "Expected connection.unsampled gauge 0, got " .
+      "$gauges->{'connection.unsampled'}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_command_sampling {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        # Low enough that the other commands are almost certainly not sampled.
+        StatsdSampling => '0.0001',
+        StatsdCommandSampling => '100 USER PASS',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    # The commands with their own sampling percentage are always sampled.
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counter = $counters->{$counter_name};
+      $self->assert(defined($counter),
+        "Expected count values for $counter_name, found none");
+      $self->assert($counter == 1,
+        "Expected counter value 1 for $counter_name, got $counter");
+    }
+
+    $self->assert(!defined($counters->{'command.QUIT.221'}),
+      "Expected no count values for command.QUIT.221, found some");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_tail_sampling {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        # Low enough that the other commands are almost certainly not sampled.
+        StatsdSampling => '0.0001',
+        StatsdTailSampling => 'on',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+
+      # This command fails, and so is always sampled.
+      eval { $client->cwd('/foo/bar/baz') };
+      unless ($@) {
+        die("CWD succeeded unexpectedly");
+      }
+
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    # The failed command is always sampled; the successful commands are
+    # almost certainly not.
+    my $counter_name = 'command.CWD.550';
+    my $counter = $counters->{$counter_name};
+    $self->assert(defined($counter),
+      "Expected count values for $counter_name, found none");
+    $self->assert($counter == 1,
+      "Expected counter value 1 for $counter_name, got $counter");
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      $self->assert(!defined($counters->{$counter_name}),
+        "Expected no count values for $counter_name, found some");
+    }
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
+sub statsd_max_metric_names {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+  my $setup = test_setup($tmpdir, 'statsd');
+
+  my $statsd_host = $ENV{STATSD_HOST};
+  my $statsd_port = $ENV{STATSD_PORT};
+
+  my $config = {
+    PidFile => $setup->{pid_file},
+    ScoreboardFile => $setup->{scoreboard_file},
+    SystemLog => $setup->{log_file},
+    TraceLog => $setup->{log_file},
+    Trace => 'statsd:20 statsd.statsd:20 statsd.metric:20',
+
+    AuthUserFile => $setup->{auth_user_file},
+    AuthGroupFile => $setup->{auth_group_file},
+    AuthOrder => 'mod_auth_file.c',
+
+    IfModules => {
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+
+      'mod_statsd.c' => {
+        StatsdEngine => 'on',
+        StatsdServer => "udp://$statsd_host:$statsd_port",
+        StatsdMaxMetricNames => 1,
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($setup->{config_file},
+    $config);
+
+  delete_statsd_info();
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($setup->{user}, $setup->{passwd});
+
+      # Unknown commands are named by the client; only the first name fits.
+      eval { $client->quote('FOO') };
+      eval { $client->quote('BAR') };
+      eval { $client->quote('BAZ') };
+      eval { $client->quote('FOO') };
+      $client->quit();
+    };
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($setup->{config_file}, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($setup->{pid_file});
+  $self->assert_child_ok($pid);
+
+  eval {
+    my $counters = get_statsd_info('counters');
+
+    my $counter_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $counter_name (@$counter_names) {
+      my $counts = $counters->{$counter_name};
+      $self->assert($counts > 0,
+        "Expected count values for $counter_name, found none");
+    }
+
+    $self->assert($counters->{'command.FOO.500'} == 2,
+      "Expected command.FOO.500 count 2, got " .
+      "$counters->{'command.FOO.500'}");
+    $self->assert($counters->{'command.OTHER.500'} == 2,
+      "Expected command.OTHER.500 count 2, got " .
+      "$counters->{'command.OTHER.500'}");
+    $self->assert($counters->{'cardinality.collapsed.command'} == 2,
+      "Expected cardinality.collapsed.command count 2, got " .
+      "$counters->{'cardinality.collapsed.command'}");
+    $self->assert(!defined($counters->{'command.BAR.500'}),
+      "Expected no count values for command.BAR.500, found some");
+
+    my $timers = get_statsd_info('timers');
+
+    # For timers, we simply expect to HAVE timings
+    my $timer_names = [qw(
+      command.USER.331
+      command.PASS.230
+      command.QUIT.221
+    )];
+
+    foreach my $timer_name (@$timer_names) {
+      my $timings = $timers->{$timer_name};
+      $self->assert(scalar(@$timings) > 0,
+        "Expected timing values for $timer_name, found none");
+    }
+
+    my $gauges = get_statsd_info('gauges');
+
+    # Our connection gauge is a GAUGE; we expect it to have the same value after
+    # as before.
+    $self->assert($gauges->{connection} == 0,
+      "Expected connection gauge 0, got $gauges->{connection}");
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  test_cleanup($setup, $ex);
+}
+
 1;